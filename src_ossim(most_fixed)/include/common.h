@@ -28,7 +28,14 @@ enum ins_opcode_t {
 	ALLOC,	// Allocate memory
 	FREE,	// Deallocated a memory block
 	READ,	// Write data to a byte on memory
-	WRITE	// Read data from a byte on memory
+	WRITE,	// Read data from a byte on memory
+	FORK,	// Duplicate the process, both go on after the instruction
+	SHMGET,	// Create a shared memory segment
+	SHMAT,	// Attach a shared memory segment to a region
+	SHMDT,	// Detach the shared memory segment of a region
+	ALLOCA,	// Allocate memory on the stack
+	MMAP,	// Map an anonymous area to a region
+	MUNMAP	// Unmap the area of a region
 };
 
 /* instructions executed by the CPU */
@@ -39,9 +46,24 @@ struct inst_t {
 	uint32_t arg_2;
 };
 
+/* A resident slot of a streamed code segment */
+struct code_chunk_t {
+	int32_t index;	// Chunk number held in this slot, -1 if empty
+	uint32_t used;	// Last access stamp, the oldest slot is reloaded first
+	struct inst_t text[CODE_CHUNK_SZ];
+};
+
 struct code_seg_t {
-	struct inst_t * text;
+	struct inst_t * text;	// Whole program, NULL in streaming mode
 	uint32_t size;
+	uint32_t refs;	// Processes sharing it, forks share the whole program
+	/* Streaming mode, only valid when text is NULL */
+	char * path;	// Program file the chunks are decoded from
+	long * chunk_off;	// File offset of the first chunk_known chunks
+	uint32_t chunk_known;
+	uint32_t chunk_cap;
+	uint32_t tick;
+	struct code_chunk_t * chunks;	// CODE_MAX_CHUNKS resident slots
 };
 
 struct trans_table_t {
@@ -5,5 +5,19 @@
 
 struct pcb_t * load(const char * path);
 
+/* Return the instruction at [pc] of [code], decoding its chunk from the
+ * program file first if the segment is streamed and it is not resident */
+struct inst_t * fetch_inst(struct code_seg_t * code, uint32_t pc);
+
+/* Duplicate [proc] under a new PID: registers and program counter, the
+ * code segment is shared. The paging address space is left to pgfork().
+ * Return NULL if out of memory */
+struct pcb_t * clone_proc(struct pcb_t * proc);
+
+/* Release [proc] with its legacy page table, and its code segment once
+ * no other process shares it. The paging address space must already
+ * have been torn down by free_pcb_mm() */
+void unload(struct pcb_t * proc);
+
 #endif
 
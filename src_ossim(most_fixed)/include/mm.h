@@ -12,9 +12,25 @@
 
 #define PAGING_MEMSWPSZ BIT(14) /* 16MB */
 #define PAGING_SWPFPN_OFFSET 5  
-#define PAGING_MAX_PGN  (DIV_ROUND_UP(PAGING_CPU_BUS_WIDTH,PAGING_PAGESZ))
+#define PAGING_MAX_PGN  (DIV_ROUND_UP(BIT(PAGING_CPU_BUS_WIDTH),PAGING_PAGESZ))
 
 #define PAGING_SBRK_INIT_SZ PAGING_PAGESZ
+#define PAGING_PGN_BITS (PAGING_CPU_BUS_WIDTH - NBITS(PAGING_PAGESZ))
+
+#ifdef MM_PGTBL_RADIX
+#define PGTBL_NENT BIT(PGTBL_BITS)
+#define PGTBL_LEVELS DIV_ROUND_UP(PAGING_PGN_BITS, PGTBL_BITS)
+#endif
+
+/* Address space layout: the heap grows up from 0, the stack down from
+ * PAGING_STACK_TOP, and areas mapped by mmap or shmat are placed top
+ * down from PAGING_MMAP_BASE, leaving PAGING_STACK_GAP bytes to the
+ * stack. VMA_HEAP and VMA_STACK are the vm_id of the first two */
+#define VMA_HEAP 0
+#define VMA_STACK 1
+#define PAGING_STACK_TOP (PAGING_MAX_PGN * PAGING_PAGESZ)
+#define PAGING_STACK_GAP (PAGING_STACK_TOP / 16)
+#define PAGING_MMAP_BASE (PAGING_STACK_TOP - PAGING_STACK_GAP)
 /* PTE BIT */
 #define PAGING_PTE_PRESENT_MASK BIT(31) 
 #define PAGING_PTE_SWAPPED_MASK BIT(30)
@@ -22,10 +38,38 @@
 #define PAGING_PTE_DIRTY_MASK BIT(28)
 #define PAGING_PTE_EMPTY01_MASK BIT(14)
 #define PAGING_PTE_EMPTY02_MASK BIT(13)
+/* Set on every write to an online page, the swap copy kept since the
+ * page came back from swap (if any) is then out of date */
+#define PAGING_PTE_SET_DIRTY(pte) (pte=pte|PAGING_PTE_DIRTY_MASK)
+#define PAGING_PAGE_DIRTY(pte) (pte&PAGING_PTE_DIRTY_MASK)
+/* Set on a page brought in by swap readahead until it is accessed */
+#define PAGING_PTE_READAHEAD_MASK PAGING_PTE_EMPTY02_MASK
+/* Set on every access to an online page, cleared by the replacement
+ * policy. Swapped PTEs reuse the bit for SWPOFF */
+#define PAGING_PTE_ACCESSED_MASK PAGING_PTE_EMPTY01_MASK
+
+/* Set on an online page mapping a frame shared with other pages (the
+ * zero frame or a merged one), the first write gives it its own copy */
+#define PAGING_PTE_COW_MASK PAGING_PTE_RESERVE_MASK
+
+/* Set on a page attached to a shared memory segment. Such a PTE is
+ * never present, it names the segment and the page within it, which
+ * the page table of the segment maps */
+#define PAGING_PTE_SHM_MASK BIT(27)
+
+/* Set on every page of a huge page, PAGING_HPAGE_NR pages aligned on
+ * their number mapped to as many contiguous frames, online or swapped
+ * all together. Only its first page is seen by the replacement policy */
+#define PAGING_PTE_HUGE_MASK BIT(26)
+#define PAGING_HPAGE_NR BIT(HPAGE_ORDER)
+#define PAGING_HPAGE_HEAD(pgn) ((pgn) & ~(PAGING_HPAGE_NR - 1))
 
 /* PTE BIT PRESENT */
 #define PAGING_PTE_SET_PRESENT(pte) (pte=pte|PAGING_PTE_PRESENT_MASK)
 #define PAGING_PAGE_PRESENT(pte) (pte&PAGING_PTE_PRESENT_MASK)
+/* A mapped page is either online in MEMRAM or swapped out to a MEMSWP */
+#define PAGING_PAGE_SWAPPED(pte) (pte&PAGING_PTE_SWAPPED_MASK)
+#define PAGING_PAGE_ONLINE(pte) (PAGING_PAGE_PRESENT(pte) && !PAGING_PAGE_SWAPPED(pte))
 
 /* USRNUM */
 #define PAGING_PTE_USRNUM_LOBIT 15
@@ -39,12 +83,23 @@
 /* SWPOFF */
 #define PAGING_PTE_SWPOFF_LOBIT 5
 #define PAGING_PTE_SWPOFF_HIBIT 25
+/* SHMPGN, SHMID */
+#define PAGING_PTE_SHMPGN_LOBIT 0
+#define PAGING_PTE_SHMPGN_HIBIT 13
+#define PAGING_PTE_SHMID_LOBIT 14
+#define PAGING_PTE_SHMID_HIBIT 25
 
 
 #define PAGING_PTE_USRNUM_MASK GENMASK(PAGING_PTE_USRNUM_HIBIT,PAGING_PTE_USRNUM_LOBIT)
 #define PAGING_PTE_FPN_MASK    GENMASK(PAGING_PTE_FPN_HIBIT,PAGING_PTE_FPN_LOBIT)
 #define PAGING_PTE_SWPTYP_MASK GENMASK(PAGING_PTE_SWPTYP_HIBIT,PAGING_PTE_SWPTYP_LOBIT)
 #define PAGING_PTE_SWPOFF_MASK GENMASK(PAGING_PTE_SWPOFF_HIBIT,PAGING_PTE_SWPOFF_LOBIT)
+#define PAGING_PTE_SHMPGN_MASK GENMASK(PAGING_PTE_SHMPGN_HIBIT,PAGING_PTE_SHMPGN_LOBIT)
+#define PAGING_PTE_SHMID_MASK  GENMASK(PAGING_PTE_SHMID_HIBIT,PAGING_PTE_SHMID_LOBIT)
+/* Frames an online PTE can address on MEMRAM */
+#define PAGING_MAX_FPN BIT(PAGING_PTE_FPN_HIBIT - PAGING_PTE_FPN_LOBIT + 1)
+/* Frames a swapped PTE can address on one MEMSWP */
+#define PAGING_MAX_SWPFPN BIT(PAGING_PTE_SWPOFF_HIBIT - PAGING_PTE_SWPOFF_LOBIT + 1)
 
 /* OFFSET */
 #define PAGING_ADDR_OFFST_LOBIT 0
@@ -93,22 +148,180 @@
 #define PAGING_SWPTYP(x) GETVAL(x,PAGING_PTE_SWPTYP_MASK,PAGING_PTE_SWPTYP_LOBIT)
 /* Extract SWAPOFF */
 #define PAGING_SWPOFF(x) GETVAL(x,PAGING_PTE_SWPOFF_MASK,PAGING_PTE_SWPOFF_LOBIT)
+/* Extract the FPN of an online PTE (PAGING_FPN decodes physical addresses) */
+#define PAGING_PTE_FPN(x) GETVAL(x,PAGING_PTE_FPN_MASK,PAGING_PTE_FPN_LOBIT)
+/* Extract the segment and its page of a PTE attached to shared memory */
+#define PAGING_PTE_SHMID(x) GETVAL(x,PAGING_PTE_SHMID_MASK,PAGING_PTE_SHMID_LOBIT)
+#define PAGING_PTE_SHMPGN(x) GETVAL(x,PAGING_PTE_SHMPGN_MASK,PAGING_PTE_SHMPGN_LOBIT)
 
 /* Memory range operator */
 #define INCLUDE(x1,x2,y1,y2) (((y1-x1)*(x2-y2)>=0)?1:0)
 #define OVERLAP(x1,x2,y1,y2) (((y2-x1)*(x2-y1)>=0)?1:0)
 
-/* Synchronization mutex */
-extern pthread_mutex_t mem_lock;
+/* Synchronization
+ * Each mm_struct has its own lock for its page table, regions and page
+ * lists, each memphy_struct has a lock for its frame allocator only and
+ * each TLB has its own lock. When nested they are taken in the order
+ *     dump_lock -> mm_struct::lock -> memphy_struct::lock -> tlb lock
+ * with MEMRAM before any MEMSWP, and never another way round. The lock
+ * of the shared frame tables sits between mm_struct::lock and the
+ * memphy locks, the zswap pool lock comes after all of them. A shared
+ * memory segment has a mm_struct of its own, whose lock is taken after
+ * the segment table lock, itself after the lock of the process
+ * attaching or accessing the segment. Frame contents are not locked: a
+ * frame is only touched by the process whose page table maps it. Global
+ * replacement reaches into other processes while holding the MEMRAM
+ * lock, so there their mm_struct::lock is only ever try-locked.
+ */
+
+/* Page table prototypes */
+int pgtbl_init(struct mm_struct *mm);
+void pgtbl_free(struct mm_struct *mm);
+uint32_t pte_get(struct mm_struct *mm, int pgn);
+uint32_t *pte_ptr(struct mm_struct *mm, int pgn);
+int pgtbl_populate(struct mm_struct *mm, int pgn, int endpgn);
+uint32_t *pte_next(struct mm_struct *mm, int *pgn, int endpgn);
+void pgtbl_report(void);
+
+/* Node arena prototypes */
+void mm_arena_init(struct mm_arena *arena);
+void *mm_node_alloc(struct mm_struct *mm, enum mm_node_cls cls);
+void mm_node_free(struct mm_struct *mm, enum mm_node_cls cls, void *node);
+void mm_arena_release(struct mm_arena *arena);
+
+/* Page replacement policy, one is chosen per run
+ * @admit : a page of @mm became online, -1 if it cannot be tracked
+ * @victim: pick an online page of @mm to move out and forget it
+ */
+struct pg_policy {
+	const char *name;
+	int (*admit)(struct mm_struct *mm, int pgn);
+	int (*victim)(struct mm_struct *mm, int *pgn);
+};
+
+extern struct pg_policy *pg_policy;
+extern int pg_global; /* victims are taken from any process */
+extern int pg_demand; /* frames are only given on first touch */
+
+int pg_policy_select(const char *name);
+void pg_policy_forget(struct mm_struct *mm, int pgn, int endpgn);
+void pg_policy_report(void);
+/* Paging events counted over the whole run */
+enum pg_stat_ev {
+	PG_STAT_REF,	   /* pg_getval/pg_setval access */
+	PG_STAT_FAULT,	   /* page brought back from swap */
+	PG_STAT_EVICT,	   /* page moved out to swap */
+	PG_STAT_WRITEBACK, /* evicted page copied to swap */
+	PG_STAT_WBSKIP,	   /* evicted clean page whose swap copy was kept */
+	PG_STAT_DIRECT,	   /* frame reclaimed by a faulting or allocating process */
+	PG_STAT_KSWAPD,	   /* frame reclaimed in the background */
+	PG_STAT_RA,		   /* page brought in by swap readahead */
+	PG_STAT_RAHIT,	   /* readahead page accessed afterwards */
+	PG_STAT_ZSTORE,	   /* evicted page compressed into the zswap pool */
+	PG_STAT_ZREJECT,   /* evicted page the zswap pool did not take */
+	PG_STAT_ZLOAD,	   /* page brought back from the zswap pool */
+	PG_STAT_DEVLOAD,   /* page brought back from a swap device */
+	PG_STAT_ZEROMAP,   /* new page mapped to the zero frame */
+	PG_STAT_MERGE,	   /* page merged into a shared frame by the scanner */
+	PG_STAT_COW,	   /* write to a shared frame copied it */
+	PG_STAT_FORK,	   /* address space duplicated by fork */
+	PG_STAT_SHMGET,	   /* shared memory segment created */
+	PG_STAT_SHMAT,	   /* shared memory segment attached */
+	PG_STAT_SHMDT,	   /* shared memory segment detached */
+	PG_STAT_RGREUSE,   /* allocation served by a free region */
+	PG_STAT_RGBRK,	   /* allocation served by moving the break */
+	PG_STAT_RGGROW,	   /* break moved past the mapped pages */
+	PG_STAT_RGFRAG,	   /* break moved with enough bytes free in smaller regions */
+	PG_STAT_RGMERGE,   /* freed region merged with a free neighbour */
+	PG_STAT_RGTRIM,	   /* freed region given back to the top of the heap */
+	PG_STAT_RUN,	   /* contiguous run of frames taken for a mapping */
+	PG_STAT_RUNPG,	   /* frames in those runs */
+	PG_STAT_HUGEMAP,   /* huge page mapped */
+	PG_STAT_HUGEEVICT, /* huge page moved out to swap */
+	PG_STAT_HUGEFAULT, /* huge page brought back from swap */
+	PG_STAT_HUGESPLIT, /* huge page split into base pages */
+	PG_STAT_ALLOCA,	   /* region allocated on the stack */
+	PG_STAT_MMAP,	   /* anonymous area mapped */
+	PG_STAT_MUNMAP,	   /* anonymous area unmapped */
+	PG_STAT_DEMAND,	   /* page given its first frame when first touched */
+	PG_STAT_VSZ,	   /* pages in the VMAs of torn down address spaces */
+	PG_STAT_RSS,	   /* those of them online at that time */
+	PG_STAT_QUOTA,	   /* own page swapped out by a process at its resident limit */
+	PG_STAT_SWAPQUOTA, /* page kept online, its owner is at its swap limit */
+	PG_STAT_OOMKILL,   /* process killed out of memory */
+	PG_STAT_OOMREAP,   /* page given back by a killed process at once */
+	PG_STAT_NEV
+};
+
+void pg_stat_inc(enum pg_stat_ev ev);
+void pg_stat_add(enum pg_stat_ev ev, unsigned long n);
+
+/* Compressed swap cache, a page in the pool is swapped to this type */
+#define ZSWAP_SWPTYP PAGING_MAX_MMSWP
+
+extern int zswap_enabled;
+
+int zswap_init(long pool_sz);
+int zswap_store(const BYTE *page, int *idx);
+int zswap_load(int idx, BYTE *page);
+int zswap_dup(int idx, int *newidx);
+int zswap_free(int idx);
+void zswap_report(void);
+
+/* Shared frames, and with same-page merging the zero frame and the
+ * merging scanner */
+extern int ksm_enabled;
+
+int ksm_init(struct memphy_struct *mram, struct memphy_struct **mswp,
+             struct memphy_struct *active_mswp);
+int ksm_start(void);
+void ksm_stop(void);
+int ksm_map_zero(struct mm_struct *mm, int pgn);
+int ksm_share(struct mm_struct *mm, int pgn, int fpn);
+int ksm_unshare(struct mm_struct *mm, int pgn, int fpn);
+void ksm_put(struct mm_struct *mm, int pgn, int fpn);
+int ksm_is_zero(int fpn);
+int ksm_swap_out(struct pcb_t *caller, struct mm_struct *only, int fpn, int clock);
+void ksm_report(void);
+
+/* Memory quotas and the OOM killer */
+void mm_charge_rss(struct mm_struct *mm, int npages);
+void mm_charge_swap(struct mm_struct *mm, int npages);
+int mm_rss_room(struct mm_struct *mm, int npages);
+int mm_swap_room(struct mm_struct *mm, int npages);
+void oom_register(struct mm_struct *mm);
+void oom_unregister(struct mm_struct *mm);
+int oom_killed(struct mm_struct *mm);
+int oom_kill(struct pcb_t *caller, struct mm_struct *only);
+
+/* Pressure stall information */
+void psi_init(int ncpus);
+void psi_memstall_enter(void);
+void psi_memstall_leave(void);
+void psi_report(void);
+
+/* Shared memory segments */
+int pgshmget(struct pcb_t *proc, uint32_t key, uint32_t size);
+int pgshmat(struct pcb_t *proc, uint32_t key, uint32_t reg_index);
+int pgshmdt(struct pcb_t *proc, uint32_t reg_index);
+int shm_detach(struct pcb_t *caller, struct vm_rg_struct *rg);
+int shm_getval(uint32_t pte, int off, BYTE *data, struct pcb_t *caller);
+int shm_setval(uint32_t pte, int off, BYTE value, struct pcb_t *caller);
+void shm_dup(uint32_t pte);
+void shm_put(uint32_t pte);
+void shm_exit(struct mm_struct *mm);
+void shm_report(void);
 
 /* VM region prototypes */
-struct vm_rg_struct * init_vm_rg(int rg_start, int rg_endi);
+struct vm_rg_struct * init_vm_rg(struct mm_struct *mm, int rg_start, int rg_endi);
 int enlist_vm_rg_node(struct vm_rg_struct **rglist, struct vm_rg_struct* rgnode);
-int enlist_pgn_node(struct pgn_t **pgnlist, int pgn);
+void init_vm_freerg(struct vm_area_struct *vma);
+int enlist_pgn_node(struct mm_struct *mm, int pgn);
 int vmap_page_range(struct pcb_t *caller, int addr, int pgnum, 
                     struct framephy_struct *frames, struct vm_rg_struct *ret_rg);
 int vm_map_ram(struct pcb_t *caller, int astart, int send, int mapstart, int incpgnum, struct vm_rg_struct *ret_rg);
 int alloc_pages_range(struct pcb_t *caller, int incpgnum, struct framephy_struct **frm_lst);
+void free_frame_list(struct pcb_t *caller, struct framephy_struct *head, int putback);
 int __swap_cp_page(struct memphy_struct *mpsrc, int srcfpn,
                 struct memphy_struct *mpdst, int dstfpn) ;
 int pte_set_fpn(uint32_t *pte, int fpn);
@@ -125,10 +338,17 @@ int __free(struct pcb_t *caller, int vmaid, int rgid);
 int __read(struct pcb_t *caller, int vmaid, int rgid, int offset, BYTE *data);
 int __write(struct pcb_t *caller, int vmaid, int rgid, int offset, BYTE value);
 int init_mm(struct mm_struct *mm, struct pcb_t *caller);
+int free_mm(struct mm_struct *mm);
+struct vm_area_struct *init_vma(struct mm_struct *mm, unsigned long id,
+                                unsigned long start, unsigned int flags);
 
 /* VM prototypes */
 int pgalloc(struct pcb_t *proc, uint32_t size, uint32_t reg_index);
+int pgalloca(struct pcb_t *proc, uint32_t size, uint32_t reg_index);
 int pgfree_data(struct pcb_t *proc, uint32_t reg_index);
+int pgmmap(struct pcb_t *proc, uint32_t size, uint32_t reg_index);
+int pgmunmap(struct pcb_t *proc, uint32_t reg_index);
+int pgfork(struct pcb_t *proc, struct pcb_t *child);
 int pgread(
 		struct pcb_t * proc, // Process executing the instruction
 		uint32_t source, // Index of source register
@@ -144,22 +364,63 @@ struct vm_rg_struct * get_symrg_byid(struct mm_struct* mm, int rgid);
 int validate_overlap_vm_area(struct pcb_t *caller, int vmaid, int vmastart, int vmaend);
 int get_free_vmrg_area(struct pcb_t *caller, int vmaid, int size, struct vm_rg_struct *newrg);
 int inc_vma_limit(struct pcb_t *caller, int vmaid, int inc_sz);
+int pg_getval(struct mm_struct *mm, int addr, BYTE *data, struct pcb_t *caller);
+int pg_setval(struct mm_struct *mm, int addr, BYTE value, struct pcb_t *caller);
 int find_victim_page(struct mm_struct* mm, int *pgn);
+int get_swap_slot(struct pcb_t *caller, int *swptyp, int *swpfpn);
+void swap_slot_free(struct pcb_t *caller, int swptyp, int swpoff);
+int swap_out_victim(struct pcb_t *caller, int *retfpn);
+int swap_out_global(struct pcb_t *caller, int *retfpn);
+int swap_out_shared(struct pcb_t *caller, struct mm_struct *mm, int pgn);
+int pg_get_frame(struct pcb_t *caller, struct mm_struct *mm, int *retfpn);
+int kswapd_start(struct memphy_struct *mram, struct memphy_struct **mswp,
+                 struct memphy_struct *active_mswp);
+void kswapd_stop(void);
+int free_pcb_memph(struct pcb_t *caller);
+void free_pte_range(struct pcb_t *caller, int pgn, int endpgn);
+void reap_pte_range(struct pcb_t *caller, struct mm_struct *mm, int pgn, int endpgn);
+int free_pcb_mm(struct pcb_t *caller);
 struct vm_area_struct *get_vma_by_num(struct mm_struct *mm, int vmaid);
+struct vm_area_struct *find_vma(struct mm_struct *mm, unsigned long addr);
+int vma_insert(struct mm_struct *mm, struct vm_area_struct *vma);
+void vma_remove(struct mm_struct *mm, struct vm_area_struct *vma);
+int get_unmapped_area(struct mm_struct *mm, int len);
+void vm_unmap_area(struct pcb_t *caller, struct vm_area_struct *vma);
 
 /* MEM/PHY protypes */
 int MEMPHY_get_freefp(struct memphy_struct *mp, int *fpn);
 int MEMPHY_put_freefp(struct memphy_struct *mp, int fpn);
+int MEMPHY_get_freerun(struct memphy_struct *mp, int npages, int *retfpn);
+int MEMPHY_rmap_init(struct memphy_struct *mp);
+int MEMPHY_buddy_init(struct memphy_struct *mp);
+int MEMPHY_is_used(struct memphy_struct *mp, int fpn);
+int MEMPHY_set_owner(struct memphy_struct *mp, int fpn, struct mm_struct *owner, int pgn);
+int MEMPHY_set_swpcopy(struct memphy_struct *mp, int fpn, int swptyp, int swpoff);
+int MEMPHY_get_swpcopy(struct memphy_struct *mp, int fpn, int *swptyp, int *swpoff);
 int MEMPHY_read(struct memphy_struct * mp, int addr, BYTE *value);
 int MEMPHY_write(struct memphy_struct * mp, int addr, BYTE data);
+int MEMPHY_read_page(struct memphy_struct *mp, int fpn, BYTE *buf);
+int MEMPHY_write_page(struct memphy_struct *mp, int fpn, const BYTE *buf);
 int MEMPHY_dump(struct memphy_struct * mp);
-int init_memphy(struct memphy_struct *mp, int max_size, int randomflg);
+int init_memphy(struct memphy_struct *mp, long max_size, int randomflg);
+int init_memphy_file(struct memphy_struct *mp, long max_size, enum memphy_kind kind);
+#ifdef MM_TLB
+/* TLB prototypes */
+int tlb_init(int ncpu);
+void tlb_bind_cpu(int id);
+int tlb_lookup(uint32_t pid, int pgn, int *fpn);
+void tlb_insert(uint32_t pid, int pgn, int fpn);
+void tlb_flush_page(uint32_t pid, int pgn);
+void tlb_flush_pid(uint32_t pid);
+void tlb_report(void);
+#endif
+
 /* DEBUG */
 int print_list_fp(struct framephy_struct *fp);
 int print_list_rg(struct vm_rg_struct *rg);
-int print_list_vma(struct vm_area_struct *rg);
+int print_list_vma(struct mm_struct *mm);
 
-int print_list_pgn(struct pgn_t *ip);
+int print_list_pgn(struct pgn_queue *q);
 int print_pgtbl(struct pcb_t *ip, uint32_t start, uint32_t end);
 
 #endif
@@ -9,8 +9,90 @@
 #define VMDBG 1
 #define MMDBG 1
 
+/* Per-CPU software TLB in front of the page table, TLB_SETS sets of
+ * TLB_WAYS ways each, tagged by PID */
+#define MM_TLB
+#define TLB_SETS 16
+#define TLB_WAYS 4
+
+/* Page replacement policy used unless another one is given with
+ * os -r: "fifo", "clock" or "2q". 2Q keeps PG_2Q_KIN percent of the
+ * online pages of a process on its FIFO side and remembers up to
+ * PG_2Q_KOUT percent as many pages evicted from there */
+#define PG_POLICY_DEFAULT "fifo"
+#define PG_2Q_KIN 25
+#define PG_2Q_KOUT 50
+
+/* Swap readahead: a fault right after the pages last brought in also
+ * brings in the following swapped pages of the VMA, if frames are free.
+ * The window starts at SWAP_RA_MIN pages, doubles while at least half
+ * of the last one was used and halves otherwise, up to SWAP_RA_MAX */
+#define MM_SWAP_RA
+#define SWAP_RA_MIN 2
+#define SWAP_RA_MAX 32
+
+/* Background reclaim (os -k): kswapd swaps cold pages out as soon as
+ * fewer than KSWAPD_LOW_PCT percent of the MEMRAM frames are free, until
+ * KSWAPD_HIGH_PCT percent are */
+#define KSWAPD_LOW_PCT 4
+#define KSWAPD_HIGH_PCT 8
+
+/* Compressed swap cache (os -z): evicted pages are compressed into a
+ * host memory pool of up to ZSWAP_POOL_SZ bytes ahead of the MEMSWPs.
+ * Pages that do not shrink to ZSWAP_MAX_PCT percent of a page, or do
+ * not fit in the pool anymore, go to a swap device */
+#define ZSWAP_POOL_SZ 1048576
+#define ZSWAP_MAX_PCT 75
+
+/* Same-page merging (os -m): new pages map a shared zero frame until
+ * written, and a scanner merges identical pages, KSM_SCAN_BATCH frames
+ * every KSM_SLEEP_USEC microseconds. Shared frames are looked up by
+ * content checksum in tables of 2^KSM_HASH_BITS buckets */
+#define KSM_SCAN_BATCH 64
+#define KSM_SLEEP_USEC 1000
+#define KSM_HASH_BITS 10
+
+/* Shared memory segments (shmget/shmat/shmdt) alive at the same time */
+#define SHM_MAX_SEGS 64
+
+/*
+ * Buddy allocator of MEMRAM frames (os -b), largest block is
+ * 2^MEMPHY_BUDDY_MAX_ORDER frames
+ */
+#define MEMPHY_BUDDY_MAX_ORDER 10
+
+/*
+ * Huge pages of 2^HPAGE_ORDER base pages, used for the aligned parts of
+ * large allocations when MEMRAM has the frames in one run
+ */
+#define MM_HUGEPAGE
+#define HPAGE_ORDER 3
+
+/*
+ * Radix page tables of 2^PGTBL_BITS entries per table, the lower levels
+ * allocated only when a page in their range is mapped. Without it every
+ * process has a flat table of PAGING_MAX_PGN entries
+ */
+#define MM_PGTBL_RADIX
+#define PGTBL_BITS 7
+
+/* Swap devices given as size:mmap or size:file in the configure file
+ * are stored in an unlinked host file created in this directory */
+#define MEMPHY_FILE_DIR "/tmp"
+
+/* Benchmark builds (make bench) leave every dump out */
+#ifndef OS_BENCH
 #define IODUMP 1
 #define PAGETBL_DUMP 1
 #define MEMPHY_DUMP
+#endif
+
+/* Programs longer than CODE_STREAM_THRESHOLD instructions are not read
+ * in full by the loader; their code is decoded on demand in chunks of
+ * CODE_CHUNK_SZ instructions and at most CODE_MAX_CHUNKS chunks stay
+ * resident per process */
+#define CODE_STREAM_THRESHOLD 4096
+#define CODE_CHUNK_SZ 256
+#define CODE_MAX_CHUNKS 2
 
 #endif
\ No newline at end of file
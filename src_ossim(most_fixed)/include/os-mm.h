@@ -1,9 +1,18 @@
 #ifndef OSMM_H
 #define OSMM_H
 
+#include <sys/types.h> /* pthread types, <pthread.h> pulls in our sched.h */
+
 #define MM_PAGING
 #define PAGING_MAX_MMSWP 4 /* max number of supported swapped space */
 #define PAGING_MAX_SYMTBL_SZ 30
+/* Free regions of a VMA are kept in VM_FREERG_NCLASS size classes, and
+ * hashed by their boundaries in 2^VM_FREERG_TAG_BITS buckets */
+#define VM_FREERG_NCLASS 16
+#define VM_FREERG_TAG_BITS 5
+/* VMAs of a process: the heap, the stack, and one per area mapped by
+ * mmap or shmat, each of those bound to a register */
+#define VM_MAX_AREAS (PAGING_MAX_SYMTBL_SZ + 2)
 
 typedef char BYTE;
 typedef uint32_t addr_t;
@@ -14,6 +23,15 @@ struct pgn_t{
    struct pgn_t *pg_next; 
 };
 
+/*
+ *  Queue of page numbers, oldest at the head
+ */
+struct pgn_queue {
+   struct pgn_t *head;
+   struct pgn_t *tail;
+   int size;
+};
+
 /*
  *  Memory region struct
  */
@@ -22,8 +40,18 @@ struct vm_rg_struct {
    unsigned long rg_end;
 
    struct vm_rg_struct *rg_next;
+
+   /* Free regions only: previous region of the size class, and next
+    * ones in the boundary tag buckets of rg_start and rg_end */
+   struct vm_rg_struct *rg_prev;
+   struct vm_rg_struct *rg_snext;
+   struct vm_rg_struct *rg_enext;
 };
 
+/* vm_flags */
+#define VM_GROWSDOWN 0x1 /* the stack */
+#define VM_MAPPING 0x2   /* made by mmap or shmat, unmapped as a whole */
+
 /*
  *  Memory area struct
  */
@@ -32,31 +60,131 @@ struct vm_area_struct {
    unsigned long vm_start;
    unsigned long vm_end;
 
+   /* Break of the area: allocations move it up, or down from vm_end
+    * for a VM_GROWSDOWN area, which then grows below vm_start */
    unsigned long sbrk;
+   unsigned int vm_flags;
 /*
  * Derived field
  * unsigned long vm_limit = vm_end - vm_start
  */
    struct mm_struct *vm_mm;
-   struct vm_rg_struct *vm_freerg_list;
-   struct vm_area_struct *vm_next;
+   /* Free regions by size class, class c holds the sizes in
+    * [2^c, 2^(c+1)) and the last one anything larger. Bit c of
+    * vm_freerg_map is set while class c is not empty */
+   struct vm_rg_struct *vm_freerg_list[VM_FREERG_NCLASS];
+   uint32_t vm_freerg_map;
+   unsigned long vm_freerg_bytes;
+   /* Boundary tags: free regions hashed by start and by end address */
+   struct vm_rg_struct *vm_freerg_start[1 << VM_FREERG_TAG_BITS];
+   struct vm_rg_struct *vm_freerg_end[1 << VM_FREERG_TAG_BITS];
+
+   /* Swap readahead: the page a sequential fault would hit next, the
+    * current window and how much of the last window got used */
+   int ra_next;
+   int ra_win;
+   int ra_issued;
+   int ra_hits;
+};
+
+/*
+ * Bookkeeping node arena of a mm_struct. Nodes are bumped out of
+ * MM_ARENA_BLKSZ blocks and recycled on a free list per node class,
+ * the blocks are only given back when the whole mm goes away
+ */
+#define MM_ARENA_BLKSZ 4096
+
+enum mm_node_cls {
+   MM_NODE_RG,  /* struct vm_rg_struct */
+   MM_NODE_PGN, /* struct pgn_t */
+   MM_NODE_FP,  /* struct framephy_struct */
+   MM_NODE_VMA, /* struct vm_area_struct */
+   MM_NODE_NCLS
+};
+
+struct mm_arena_blk {
+   struct mm_arena_blk *next;
+};
+
+struct mm_arena {
+   struct mm_arena_blk *blocks;
+   char *bump;
+   char *end;
+   void *freelist[MM_NODE_NCLS];
 };
 
 /* 
  * Memory management struct
  */
 struct mm_struct {
+   uint32_t pid; /* owner process, tags its TLB entries */
+#ifdef MM_PGTBL_RADIX
+   void **pgd; /* top table, see mm-pgtbl.c */
+#else
    uint32_t *pgd;
+#endif
 
-   struct vm_area_struct *mmap;
+   /* The VMAs sorted by vm_start, and the same ones sorted by vm_id,
+    * both searched by bisection. Areas never overlap, so growing one
+    * keeps the address order */
+   struct vm_area_struct *mmap[VM_MAX_AREAS];
+   struct vm_area_struct *mmap_byid[VM_MAX_AREAS];
+   int map_count;
+   unsigned long vm_next_id; /* id of the next mapped area */
 
    /* Currently we support a fixed number of symbol */
    struct vm_rg_struct symrgtbl[PAGING_MAX_SYMTBL_SZ];
 
-   /* list of free page */
-   struct pgn_t *fifo_pgn;
+   /* Online pages, in the order the replacement policy keeps them */
+   struct pgn_queue fifo_pgn;
+   /* 2Q only: pages faulted back in soon after leaving fifo_pgn, and
+    * the (ghost) numbers of pages recently evicted from fifo_pgn */
+   struct pgn_queue hot_pgn;
+   struct pgn_queue ghost_pgn;
+
+   /* Storage of every node hanging off this mm */
+   struct mm_arena arena;
+
+   /* Protects every field above */
+   pthread_mutex_t lock;
+
+   /* Quotas in pages (0 for none) and what is charged against them: the
+    * MEMRAM frames owned in the reverse map and the swapped PTEs. The
+    * counts are updated with atomics, the OOM killer reads them unlocked */
+   int rss_limit;
+   int swap_limit;
+   int rss;
+   int swap_pages;
+
+   /* OOM killer state and list of the processes it picks from, see
+    * mm-oom.c */
+   int oom_state;
+   int oom_listed;
+   struct mm_struct *oom_next;
+   struct mm_struct *oom_prev;
 };
 
+#ifdef MM_TLB
+/*
+ * Software TLB of one CPU
+ */
+struct tlb_entry {
+   int valid;
+   uint32_t pid; /* address space tag */
+   int pgn;
+   int fpn;
+   uint32_t used; /* LRU stamp within the set */
+};
+
+struct tlb_struct {
+   pthread_mutex_t lock; /* flushes come from other CPUs */
+   struct tlb_entry ent[TLB_SETS][TLB_WAYS];
+   uint32_t tick;
+   unsigned long hits;
+   unsigned long misses;
+};
+#endif
+
 /*
  * FRAME/MEM PHY struct
  */
@@ -64,22 +192,70 @@ struct framephy_struct {
    int fpn;
    struct framephy_struct *fp_next;
 
-   /* Resereed for tracking allocated framed */
+   /* Resereed for tracking allocated framed
+    * In the reverse map of a MEMPHY: the page of owner living here,
+    * and the swap slot still holding a copy of it (swptyp -1 if none) */
    struct mm_struct* owner;
+   int pgn;
+   int swptyp;
+   int swpoff;
+};
+
+/*
+ * Where a MEMPHY device keeps its content: host memory, a memory mapped
+ * host file, or a host file accessed with pread/pwrite (storage NULL)
+ */
+enum memphy_kind {
+   MEMPHY_MEM,
+   MEMPHY_MMAP,
+   MEMPHY_FILE
 };
 
 struct memphy_struct {
    /* Basic field of data and size */
    BYTE *storage;
-   int maxsz;
+   long maxsz;
+   enum memphy_kind kind;
+   int fd; /* backing file, -1 for MEMPHY_MEM */
    
    /* Sequential device fields */ 
    int rdmflg;
    int cursor;
 
-   /* Management structure */
-   struct framephy_struct *free_fp_list;
-   struct framephy_struct *used_fp_list;
+   /* Management structure
+    * Free frames are kept on a flat stack, free_pos[] gives the stack
+    * slot of each free frame (-1 when used) so that any frame can be
+    * pulled out in O(1), and used_map has a bit set for every used frame
+    */
+   pthread_mutex_t lock; /* frame allocator fields below */
+   int numfp;
+   int *free_stack;
+   int free_top;
+   int *free_pos;
+   uint32_t *used_map;
+
+   /* Buddy mode: free frames form blocks of 2^order frames aligned on
+    * their size instead, on the list of their order from buddy_head[],
+    * and buddy_order[fpn] is the order of the free block starting at
+    * fpn (-1 if none). free_top is then the number of free frames */
+   int buddy;
+   int buddy_head[MEMPHY_BUDDY_MAX_ORDER + 1];
+   int *buddy_next;
+   int *buddy_prev;
+   signed char *buddy_order;
+
+   /* Background reclaim: kswapd waits on reclaim until an allocation
+    * leaves fewer than low_wmark free frames (0 disables it) and then
+    * frees frames up to high_wmark */
+   int low_wmark;
+   int high_wmark;
+   pthread_cond_t reclaim;
+
+   /* Reverse map, rmap[fpn].owner is NULL while the frame is free or
+    * not mapped yet, rmap_hand is the clock hand of global replacement.
+    * Only MEMRAM has one (MEMPHY_rmap_init), swap devices have none */
+   struct framephy_struct *rmap;
+   int rmap_hand;
 };
 
 #endif
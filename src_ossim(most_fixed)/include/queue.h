@@ -4,10 +4,13 @@
 
 #include "common.h"
 
+/* Initial capacity, a full queue doubles its ring on the next enqueue */
 #define MAX_QUEUE_SIZE 10
 
 struct queue_t {
-	struct pcb_t *proc[MAX_QUEUE_SIZE];
+	struct pcb_t **proc; // Ring buffer of [cap] entries starting at [head]
+	int head;
+	int cap;
 	int size;
 	int slot;
 };
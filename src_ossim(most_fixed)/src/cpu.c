@@ -1,7 +1,10 @@
 #include "cpu.h"
 #include "mem.h"
 #include "mm.h"
+#include "loader.h"
+#include "sched.h"
 #include <pthread.h>
+#include <stdio.h>
 
 int calc(struct pcb_t *proc)
 {
@@ -56,6 +59,25 @@ int write(
 	return write_mem(proc->regs[destination] + offset, proc, data);
 }
 
+#ifdef MM_PAGING
+int fork_proc(struct pcb_t *proc)
+{
+	/* The child shares every frame of the parent copy-on-write */
+	struct pcb_t *child = clone_proc(proc);
+	if (child == NULL)
+		return 1;
+	if (pgfork(proc, child) < 0)
+	{
+		unload(child);
+		return 1;
+	}
+
+	printf("\tProcess %2d forked process %2d\n", proc->pid, child->pid);
+	add_proc(child);
+	return 0;
+}
+#endif
+
 int run(struct pcb_t *proc)
 {
 	/* Check if Program Counter point to the proper instruction */
@@ -64,7 +86,7 @@ int run(struct pcb_t *proc)
 		return 1;
 	}
 
-	struct inst_t ins = proc->code->text[proc->pc];
+	struct inst_t ins = *fetch_inst(proc->code, proc->pc);
 	proc->pc++;
 	int stat = 1;
 	switch (ins.opcode)
@@ -98,6 +120,41 @@ int run(struct pcb_t *proc)
 		stat = pgwrite(proc, ins.arg_0, ins.arg_1, ins.arg_2);
 #else
 		stat = write(proc, ins.arg_0, ins.arg_1, ins.arg_2);
+#endif
+		break;
+	case FORK:
+#ifdef MM_PAGING
+		stat = fork_proc(proc);
+#endif
+		break;
+	case SHMGET:
+#ifdef MM_PAGING
+		stat = pgshmget(proc, ins.arg_0, ins.arg_1);
+#endif
+		break;
+	case SHMAT:
+#ifdef MM_PAGING
+		stat = pgshmat(proc, ins.arg_0, ins.arg_1);
+#endif
+		break;
+	case SHMDT:
+#ifdef MM_PAGING
+		stat = pgshmdt(proc, ins.arg_0);
+#endif
+		break;
+	case ALLOCA:
+#ifdef MM_PAGING
+		stat = pgalloca(proc, ins.arg_0, ins.arg_1);
+#endif
+		break;
+	case MMAP:
+#ifdef MM_PAGING
+		stat = pgmmap(proc, ins.arg_0, ins.arg_1);
+#endif
+		break;
+	case MUNMAP:
+#ifdef MM_PAGING
+		stat = pgmunmap(proc, ins.arg_0);
 #endif
 		break;
 	default:
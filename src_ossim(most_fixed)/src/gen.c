@@ -0,0 +1,380 @@
+/*
+ * Synthetic workload generator
+ *
+ * Emits a configuration file in the format read_config() expects, at
+ * input/[name], and its process descriptions at input/proc/[name]_[i].
+ * The same seed and options always produce the same files.
+ *
+ * Usage: gen [options] name
+ *   -s seed           random seed                            (1)
+ *   -n procs          number of processes                    (8)
+ *   -u progs          distinct program files, reused by
+ *                     several processes when < procs         (procs)
+ *   -t slot           time slice                             (2)
+ *   -c cpus           number of CPUs                         (4)
+ *   -a rate           mean arrivals per time slot            (1.0)
+ *   -p lo,hi          priority range                         (0,138)
+ *   -i lo,hi          instructions per process               (10,40)
+ *   -m c,a,f,r,w[,k]  calc/alloc/free/read/write/fork
+ *                     weights                                (30,10,5,30,25,0)
+ *   -z lo,hi          region size in bytes                   (100,1000)
+ *   -g regions        regions used per process               (10)
+ *   -w ws,prob        working set of ws regions hit with
+ *                     probability prob                       (2,0.8)
+ *   -M ram            MEMRAM size                            (1048576)
+ *   -W s0,s1,s2,s3    MEMSWP sizes                           (16777216,0,0,0)
+ */
+
+#include "common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#define GEN_MAX_REGIONS 10
+
+static struct gen_args
+{
+	uint64_t seed;
+	int procs;
+	int progs;
+	int time_slot;
+	int cpus;
+	double rate;
+	int prio_lo, prio_hi;
+	int ins_lo, ins_hi;
+	int mix[6]; /* indexed by enum ins_opcode_t */
+	int rg_lo, rg_hi;
+	int regions;
+	int ws;
+	double ws_prob;
+	int memramsz;
+	long memswpsz[PAGING_MAX_MMSWP];
+} args = {
+	.seed = 1,
+	.procs = 8,
+	.progs = 0,
+	.time_slot = 2,
+	.cpus = 4,
+	.rate = 1.0,
+	.prio_lo = 0, .prio_hi = 138,
+	.ins_lo = 10, .ins_hi = 40,
+	.mix = {30, 10, 5, 30, 25, 0},
+	.rg_lo = 100, .rg_hi = 1000,
+	.regions = GEN_MAX_REGIONS,
+	.ws = 2,
+	.ws_prob = 0.8,
+	.memramsz = 1048576,
+	.memswpsz = {16777216, 0, 0, 0},
+};
+
+static uint64_t rng_state;
+
+/* xorshift64*, so runs do not depend on the host libc rand() */
+static uint64_t rng_next(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static double rng_unit(void)
+{
+	return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Uniform integer in [lo, hi] */
+static int rng_range(int lo, int hi)
+{
+	if (hi <= lo)
+		return lo;
+	return lo + (int)(rng_next() % (uint64_t)(hi - lo + 1));
+}
+
+/*
+ * Region state of a program being generated, so that every emitted
+ * read, write and free targets a region that is currently allocated
+ */
+struct gen_prog
+{
+	int size[GEN_MAX_REGIONS]; /* 0 if the region is not allocated */
+	int last_off[GEN_MAX_REGIONS];
+	int hot[GEN_MAX_REGIONS];  /* most recently allocated first */
+	int nhot;
+};
+
+static void touch_hot(struct gen_prog *pg, int rg)
+{
+	int i, j;
+	for (i = 0; i < pg->nhot && pg->hot[i] != rg; i++)
+		;
+	if (i == pg->nhot)
+		pg->nhot++;
+	for (j = i; j > 0; j--)
+		pg->hot[j] = pg->hot[j - 1];
+	pg->hot[0] = rg;
+}
+
+static void drop_hot(struct gen_prog *pg, int rg)
+{
+	int i, j;
+	for (i = 0; i < pg->nhot; i++)
+		if (pg->hot[i] == rg)
+		{
+			for (j = i; j < pg->nhot - 1; j++)
+				pg->hot[j] = pg->hot[j + 1];
+			pg->nhot--;
+			return;
+		}
+}
+
+/* Pick an allocated region, favouring the working set */
+static int pick_region(struct gen_prog *pg)
+{
+	int ws = (args.ws < pg->nhot) ? args.ws : pg->nhot;
+
+	if (pg->nhot == 0)
+		return -1;
+	if (ws > 0 && rng_unit() < args.ws_prob)
+		return pg->hot[rng_range(0, ws - 1)];
+	return pg->hot[rng_range(0, pg->nhot - 1)];
+}
+
+/* Pick an offset, sequential after the last access in the working set */
+static int pick_offset(struct gen_prog *pg, int rg)
+{
+	if (rng_unit() < args.ws_prob)
+		pg->last_off[rg] = (pg->last_off[rg] + 1) % pg->size[rg];
+	else
+		pg->last_off[rg] = rng_range(0, pg->size[rg] - 1);
+	return pg->last_off[rg];
+}
+
+static enum ins_opcode_t pick_opcode(void)
+{
+	int total = 0, i, r;
+	for (i = 0; i < 6; i++)
+		total += args.mix[i];
+	r = rng_range(0, total - 1);
+	for (i = 0; i < 6; i++)
+	{
+		if (r < args.mix[i])
+			return (enum ins_opcode_t)i;
+		r -= args.mix[i];
+	}
+	return CALC;
+}
+
+static int gen_prog_file(const char *path, int prio)
+{
+	FILE *file;
+	struct gen_prog pg;
+	int n = rng_range(args.ins_lo, args.ins_hi);
+	int i, rg, off, dst, val;
+
+	if ((file = fopen(path, "w")) == NULL)
+	{
+		printf("Cannot create process description at %s\n", path);
+		return -1;
+	}
+	memset(&pg, 0, sizeof(pg));
+	fprintf(file, "%d %d\n", prio, n);
+
+	for (i = 0; i < n; i++)
+	{
+		enum ins_opcode_t op = pick_opcode();
+
+		/* Nothing to access yet, allocate first */
+		if ((op == FREE || op == READ || op == WRITE) && pg.nhot == 0)
+			op = ALLOC;
+		/* Every region is in use, release one instead */
+		if (op == ALLOC && pg.nhot == args.regions)
+			op = FREE;
+
+		switch (op)
+		{
+		case CALC:
+			fprintf(file, "calc\n");
+			break;
+		case ALLOC:
+			for (rg = 0; pg.size[rg] != 0; rg++)
+				;
+			pg.size[rg] = rng_range(args.rg_lo, args.rg_hi);
+			pg.last_off[rg] = -1;
+			touch_hot(&pg, rg);
+			fprintf(file, "alloc %d %d\n", pg.size[rg], rg);
+			break;
+		case FREE:
+			/* Cold regions are released first */
+			rg = pg.hot[pg.nhot - 1];
+			pg.size[rg] = 0;
+			drop_hot(&pg, rg);
+			fprintf(file, "free %d\n", rg);
+			break;
+		case READ:
+			/* Into a register that is allocated as well. Drawn one by
+			 * one, the order of the arguments of a call is not fixed */
+			rg = pick_region(&pg);
+			off = pick_offset(&pg, rg);
+			dst = pg.hot[rng_range(0, pg.nhot - 1)];
+			fprintf(file, "read %d %d %d\n", rg, off, dst);
+			break;
+		case WRITE:
+			val = rng_range(1, 127);
+			rg = pick_region(&pg);
+			off = pick_offset(&pg, rg);
+			fprintf(file, "write %d %d %d\n", val, rg, off);
+			break;
+		case FORK:
+			/* The child runs the rest of the program as well */
+			fprintf(file, "fork\n");
+			break;
+		case SHMGET:
+		case SHMAT:
+		case SHMDT:
+			/* Not in the mix, segment keys would have to be agreed on
+			 * between the programs */
+			break;
+		case ALLOCA:
+		case MMAP:
+		case MUNMAP:
+			/* Not in the mix either, the regions come from alloc */
+			break;
+		}
+	}
+
+	fclose(file);
+	return 0;
+}
+
+static int parse_pair(const char *s, int *lo, int *hi)
+{
+	return (sscanf(s, "%d,%d", lo, hi) == 2 && *lo <= *hi) ? 0 : -1;
+}
+
+static void usage(void)
+{
+	printf("Usage: gen [-s seed] [-n procs] [-u progs] [-t slot] [-c cpus]\n"
+		   "           [-a rate] [-p lo,hi] [-i lo,hi] [-m c,a,f,r,w[,k]]\n"
+		   "           [-z lo,hi] [-g regions] [-w ws,prob] [-M ram]\n"
+		   "           [-W s0,s1,s2,s3] name\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, i;
+	char path[100];
+	FILE *file;
+
+	while ((opt = getopt(argc, argv, "s:n:u:t:c:a:p:i:m:z:g:w:M:W:")) != -1)
+	{
+		int ok = 0;
+		switch (opt)
+		{
+		case 's':
+			args.seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'n':
+			args.procs = atoi(optarg);
+			break;
+		case 'u':
+			args.progs = atoi(optarg);
+			break;
+		case 't':
+			args.time_slot = atoi(optarg);
+			break;
+		case 'c':
+			args.cpus = atoi(optarg);
+			break;
+		case 'a':
+			args.rate = atof(optarg);
+			break;
+		case 'p':
+			ok = parse_pair(optarg, &args.prio_lo, &args.prio_hi);
+			break;
+		case 'i':
+			ok = parse_pair(optarg, &args.ins_lo, &args.ins_hi);
+			break;
+		case 'm':
+			if (sscanf(optarg, "%d,%d,%d,%d,%d,%d", &args.mix[CALC],
+					   &args.mix[ALLOC], &args.mix[FREE], &args.mix[READ],
+					   &args.mix[WRITE], &args.mix[FORK]) < 5)
+				ok = -1;
+			break;
+		case 'z':
+			ok = parse_pair(optarg, &args.rg_lo, &args.rg_hi);
+			break;
+		case 'g':
+			args.regions = atoi(optarg);
+			break;
+		case 'w':
+			if (sscanf(optarg, "%d,%lf", &args.ws, &args.ws_prob) != 2)
+				ok = -1;
+			break;
+		case 'M':
+			args.memramsz = atoi(optarg);
+			break;
+		case 'W':
+			if (sscanf(optarg, "%ld,%ld,%ld,%ld", &args.memswpsz[0],
+					   &args.memswpsz[1], &args.memswpsz[2],
+					   &args.memswpsz[3]) < 1)
+				ok = -1;
+			break;
+		default:
+			usage();
+		}
+		if (ok < 0)
+			usage();
+	}
+	if (optind != argc - 1 || args.procs <= 0 || args.rate <= 0)
+		usage();
+	if (args.regions <= 0 || args.regions > GEN_MAX_REGIONS)
+		args.regions = GEN_MAX_REGIONS;
+	if (args.prio_lo < 0 || args.prio_hi >= MAX_PRIO - 1)
+		usage();
+	if (args.progs <= 0 || args.progs > args.procs)
+		args.progs = args.procs;
+
+	/* xorshift must not start from zero */
+	rng_state = args.seed ? args.seed : 0x9E3779B97F4A7C15ULL;
+
+	/* Program files */
+	int *prog_prio = malloc(sizeof(int) * args.progs);
+	for (i = 0; i < args.progs; i++)
+	{
+		prog_prio[i] = rng_range(args.prio_lo, args.prio_hi);
+		snprintf(path, sizeof(path), "input/proc/%s_%d", argv[optind], i);
+		if (gen_prog_file(path, prog_prio[i]) < 0)
+			return 1;
+	}
+
+	/* Config file */
+	snprintf(path, sizeof(path), "input/%s", argv[optind]);
+	if ((file = fopen(path, "w")) == NULL)
+	{
+		printf("Cannot create configure file at %s\n", path);
+		return 1;
+	}
+	fprintf(file, "%d %d %d\n", args.time_slot, args.cpus, args.procs);
+	fprintf(file, "%d", args.memramsz);
+	for (i = 0; i < PAGING_MAX_MMSWP; i++)
+		fprintf(file, " %ld", args.memswpsz[i]);
+	fprintf(file, "\n");
+
+	/* Poisson arrivals: exponential gaps of mean 1 / rate time slots */
+	double arrival = 0;
+	for (i = 0; i < args.procs; i++)
+	{
+		int prog = (args.progs == args.procs) ? i : rng_range(0, args.progs - 1);
+		arrival += -log(1.0 - rng_unit()) / args.rate;
+		fprintf(file, "%lu %s_%d %d\n", (unsigned long)arrival,
+				argv[optind], prog, prog_prio[prog]);
+	}
+
+	fclose(file);
+	free(prog_prio);
+	return 0;
+}
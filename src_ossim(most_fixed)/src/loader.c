@@ -11,6 +11,13 @@ static uint32_t avail_pid = 1;
 #define OPT_FREE	"free"
 #define OPT_READ	"read"
 #define OPT_WRITE	"write"
+#define OPT_FORK	"fork"
+#define OPT_SHMGET	"shmget"
+#define OPT_SHMAT	"shmat"
+#define OPT_SHMDT	"shmdt"
+#define OPT_ALLOCA	"alloca"
+#define OPT_MMAP	"mmap"
+#define OPT_MUNMAP	"munmap"
 
 static enum ins_opcode_t get_opcode(char * opt) {
 	if (!strcmp(opt, OPT_CALC)) {
@@ -23,19 +30,176 @@ static enum ins_opcode_t get_opcode(char * opt) {
 		return READ;
 	}else if (!strcmp(opt, OPT_WRITE)) {
 		return WRITE;
+	}else if (!strcmp(opt, OPT_FORK)) {
+		return FORK;
+	}else if (!strcmp(opt, OPT_SHMGET)) {
+		return SHMGET;
+	}else if (!strcmp(opt, OPT_SHMAT)) {
+		return SHMAT;
+	}else if (!strcmp(opt, OPT_SHMDT)) {
+		return SHMDT;
+	}else if (!strcmp(opt, OPT_ALLOCA)) {
+		return ALLOCA;
+	}else if (!strcmp(opt, OPT_MMAP)) {
+		return MMAP;
+	}else if (!strcmp(opt, OPT_MUNMAP)) {
+		return MUNMAP;
 	}else{
 		printf("Opcode: %s\n", opt);
 		exit(1);
 	}
 }
 
+/* Decode one instruction from [file] into [ins]. Return 0 on success,
+ * 1 if the file ends before a full instruction could be read */
+static int read_inst(FILE * file, struct inst_t * ins) {
+	char opcode[10];
+	if (fscanf(file, "%9s", opcode) != 1) {
+		return 1;
+	}
+	ins->opcode = get_opcode(opcode);
+	switch(ins->opcode) {
+	case CALC:
+	case FORK:
+		break;
+	case ALLOC:
+	case SHMGET:
+	case SHMAT:
+	case ALLOCA:
+	case MMAP:
+		fscanf(file, "%u %u\n", &ins->arg_0, &ins->arg_1);
+		break;
+	case FREE:
+	case SHMDT:
+	case MUNMAP:
+		fscanf(file, "%u\n", &ins->arg_0);
+		break;
+	case READ:
+	case WRITE:
+		fscanf(file, "%u %u %u\n", &ins->arg_0, &ins->arg_1, &ins->arg_2);
+		break;
+	default:
+		printf("Opcode: %s\n", opcode);
+		exit(1);
+	}
+	return 0;
+}
+
+/* Switch [code] to streaming mode. [chunk_off] holds the file offsets of
+ * the first [chunk_known] chunks, at least the one of the first
+ * instruction, nothing is decoded yet. Return -1 if out of memory */
+static int init_code_stream(struct code_seg_t * code, const char * path,
+		const long * chunk_off, uint32_t chunk_known) {
+	int i;
+	code->text = NULL;
+	code->refs = 1;
+	code->chunk_cap = 16;
+	while (code->chunk_cap < chunk_known) {
+		code->chunk_cap *= 2;
+	}
+	code->path = strdup(path);
+	code->chunk_off = (long*)malloc(sizeof(long) * code->chunk_cap);
+	code->chunks = (struct code_chunk_t*)malloc(
+		sizeof(struct code_chunk_t) * CODE_MAX_CHUNKS
+	);
+	if (code->path == NULL || code->chunk_off == NULL
+			|| code->chunks == NULL) {
+		free(code->path);
+		free(code->chunk_off);
+		free(code->chunks);
+		return -1;
+	}
+	memcpy(code->chunk_off, chunk_off, sizeof(long) * chunk_known);
+	code->chunk_known = chunk_known;
+	code->tick = 0;
+	for (i = 0; i < CODE_MAX_CHUNKS; i++) {
+		code->chunks[i].index = -1;
+		code->chunks[i].used = 0;
+	}
+	return 0;
+}
+
+/* Decode chunk [index] of [code] into [slot]. Chunk offsets are only
+ * learnt by decoding, so a chunk past the known ones is reached by
+ * decoding its predecessors through the same slot first */
+static void load_chunk(struct code_seg_t * code, struct code_chunk_t * slot,
+		uint32_t index) {
+	FILE * file;
+	if ((file = fopen(code->path, "r")) == NULL) {
+		printf("Cannot find process description at '%s'\n", code->path);
+		exit(1);
+	}
+	uint32_t k = (index < code->chunk_known) ? index : code->chunk_known - 1;
+	fseek(file, code->chunk_off[k], SEEK_SET);
+	for (;; k++) {
+		uint32_t base = k * CODE_CHUNK_SZ;
+		uint32_t n = code->size - base;
+		uint32_t i;
+		if (n > CODE_CHUNK_SZ) {
+			n = CODE_CHUNK_SZ;
+		}
+		for (i = 0; i < n; i++) {
+			if (read_inst(file, &slot->text[i])) {
+				printf("Truncated process description at '%s'\n",
+					code->path);
+				exit(1);
+			}
+		}
+		/* Without room for one more offset the next chunks are
+		 * just decoded from the last one known, every time */
+		if (k + 1 == code->chunk_known && base + n < code->size) {
+			if (code->chunk_known == code->chunk_cap) {
+				long * off = (long*)realloc(code->chunk_off,
+					sizeof(long) * code->chunk_cap * 2);
+				if (off != NULL) {
+					code->chunk_off = off;
+					code->chunk_cap *= 2;
+				}
+			}
+			if (code->chunk_known < code->chunk_cap) {
+				code->chunk_off[code->chunk_known++] = ftell(file);
+			}
+		}
+		if (k == index) {
+			break;
+		}
+	}
+	fclose(file);
+	slot->index = index;
+}
+
+struct inst_t * fetch_inst(struct code_seg_t * code, uint32_t pc) {
+	if (code->text != NULL) {
+		return &code->text[pc];
+	}
+	int32_t index = pc / CODE_CHUNK_SZ;
+	struct code_chunk_t * slot = &code->chunks[0];
+	int i;
+	for (i = 0; i < CODE_MAX_CHUNKS; i++) {
+		if (code->chunks[i].index == index) {
+			slot = &code->chunks[i];
+			break;
+		}
+		/* Remember the least recently used slot as the victim */
+		if (code->chunks[i].used < slot->used) {
+			slot = &code->chunks[i];
+		}
+	}
+	if (slot->index != index) {
+		load_chunk(code, slot, index);
+	}
+	slot->used = ++code->tick;
+	return &slot->text[pc % CODE_CHUNK_SZ];
+}
+
 struct pcb_t * load(const char * path) {
 	/* Create new PCB for the new process */
 	struct pcb_t * proc = (struct pcb_t * )malloc(sizeof(struct pcb_t));
-	proc->pid = avail_pid;
-	avail_pid++;
+	/* Forks hand out PIDs from the CPUs as well */
+	proc->pid = __atomic_fetch_add(&avail_pid, 1, __ATOMIC_RELAXED);
 	proc->page_table =
 		(struct page_table_t*)malloc(sizeof(struct page_table_t));
+	proc->page_table->size = 0;
 	proc->bp = PAGE_SIZE;
 	proc->pc = 0;
 
@@ -45,47 +209,95 @@ struct pcb_t * load(const char * path) {
 		printf("Cannot find process description at '%s'\n", path);
 		exit(1);		
 	}
-	char opcode[10];
 	proc->code = (struct code_seg_t*)malloc(sizeof(struct code_seg_t));
 	fscanf(file, "%u %u", &proc->priority, &proc->code->size);
+	if (proc->code->size > CODE_STREAM_THRESHOLD) {
+		/* Large program, admit it now and decode its code lazily */
+		long text_off = ftell(file);
+		if (init_code_stream(proc->code, path, &text_off, 1) < 0) {
+			printf("Cannot stream process description at '%s'\n",
+				path);
+			exit(1);
+		}
+		fclose(file);
+		return proc;
+	}
+	proc->code->refs = 1;
+	proc->code->path = NULL;
+	proc->code->chunk_off = NULL;
+	proc->code->chunks = NULL;
 	proc->code->text = (struct inst_t*)malloc(
 		sizeof(struct inst_t) * proc->code->size
 	);
 	uint32_t i = 0;
 	for (i = 0; i < proc->code->size; i++) {
-		fscanf(file, "%s", opcode);
-		proc->code->text[i].opcode = get_opcode(opcode);
-		switch(proc->code->text[i].opcode) {
-		case CALC:
-			break;
-		case ALLOC:
-			fscanf(
-				file,
-				"%u %u\n",
-				&proc->code->text[i].arg_0,
-				&proc->code->text[i].arg_1
-			);
-			break;
-		case FREE:
-			fscanf(file, "%u\n", &proc->code->text[i].arg_0);
-			break;
-		case READ:
-		case WRITE:
-			fscanf(
-				file,
-				"%u %u %u\n",
-				&proc->code->text[i].arg_0,
-				&proc->code->text[i].arg_1,
-				&proc->code->text[i].arg_2
-			);
-			break;	
-		default:
-			printf("Opcode: %s\n", opcode);
-			exit(1);
-		}
+		read_inst(file, &proc->code->text[i]);
 	}
+	fclose(file);
 	return proc;
 }
 
+struct pcb_t * clone_proc(struct pcb_t * proc) {
+	struct pcb_t * child = (struct pcb_t * )malloc(sizeof(struct pcb_t));
+	struct code_seg_t * code = proc->code;
+	if (child == NULL) {
+		return NULL;
+	}
+	*child = *proc;
+	child->page_table =
+		(struct page_table_t*)malloc(sizeof(struct page_table_t));
+	if (child->page_table == NULL) {
+		free(child);
+		return NULL;
+	}
+	child->page_table->size = 0;
+#ifdef MM_PAGING
+	child->mm = NULL;
+#endif
 
+	/* A decoded program is only read, the child shares it. A streamed
+	 * one gets chunk slots of its own, starting from what is learnt
+	 * about the file, and reloads its chunks on demand */
+	if (code->text != NULL) {
+		__atomic_add_fetch(&code->refs, 1, __ATOMIC_RELAXED);
+	}else{
+		child->code = (struct code_seg_t*)malloc(
+			sizeof(struct code_seg_t));
+		if (child->code == NULL) {
+			free(child->page_table);
+			free(child);
+			return NULL;
+		}
+		child->code->size = code->size;
+		if (init_code_stream(child->code, code->path, code->chunk_off,
+				code->chunk_known) < 0) {
+			free(child->code);
+			free(child->page_table);
+			free(child);
+			return NULL;
+		}
+	}
+	child->pid = __atomic_fetch_add(&avail_pid, 1, __ATOMIC_RELAXED);
+	return child;
+}
 
+void unload(struct pcb_t * proc) {
+	int i;
+	struct code_seg_t * code = proc->code;
+	/* The last process running the code frees it */
+	if (__atomic_sub_fetch(&code->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		if (code->text != NULL) {
+			free(code->text);
+		}else{
+			free(code->path);
+			free(code->chunk_off);
+			free(code->chunks);
+		}
+		free(code);
+	}
+	for (i = 0; i < proc->page_table->size; i++) {
+		free(proc->page_table->table[i].next_lv);
+	}
+	free(proc->page_table);
+	free(proc);
+}
@@ -0,0 +1,106 @@
+// #ifdef MM_PAGING
+/*
+ * PAGING based Memory Management
+ * Bookkeeping node arena mm/mm-arena.c
+ */
+
+#include "mm.h"
+#include <stdlib.h>
+#include <stdint.h>
+
+/* Node size of each class, rounded to keep every node pointer aligned */
+#define MM_NODE_ALIGN(sz) (DIV_ROUND_UP(sz, sizeof(void *)) * sizeof(void *))
+
+static const size_t mm_node_sz[MM_NODE_NCLS] = {
+	[MM_NODE_RG] = MM_NODE_ALIGN(sizeof(struct vm_rg_struct)),
+	[MM_NODE_PGN] = MM_NODE_ALIGN(sizeof(struct pgn_t)),
+	[MM_NODE_FP] = MM_NODE_ALIGN(sizeof(struct framephy_struct)),
+	[MM_NODE_VMA] = MM_NODE_ALIGN(sizeof(struct vm_area_struct)),
+};
+
+/*
+ * mm_arena_init - set up an empty arena, no block is taken until the
+ * first node is allocated
+ * @arena: arena
+ */
+void mm_arena_init(struct mm_arena *arena)
+{
+	int cls;
+
+	arena->blocks = NULL;
+	arena->bump = arena->end = NULL;
+	for (cls = 0; cls < MM_NODE_NCLS; cls++)
+		arena->freelist[cls] = NULL;
+}
+
+/*
+ * mm_node_alloc - get a bookkeeping node of the given class
+ * @mm : owner of the node
+ * @cls: node class
+ *
+ * A recycled node of the class is reused first, otherwise the node is
+ * bumped from the current block
+ */
+void *mm_node_alloc(struct mm_struct *mm, enum mm_node_cls cls)
+{
+	struct mm_arena *arena = &mm->arena;
+	size_t sz = mm_node_sz[cls];
+	void *node;
+
+	if (arena->freelist[cls] != NULL)
+	{
+		node = arena->freelist[cls];
+		arena->freelist[cls] = *(void **)node;
+		return node;
+	}
+
+	if (arena->bump == NULL || arena->bump + sz > arena->end)
+	{ /* Current block is used up, chain a new one in front */
+		struct mm_arena_blk *blk = malloc(MM_ARENA_BLKSZ);
+		if (blk == NULL)
+			return NULL;
+
+		blk->next = arena->blocks;
+		arena->blocks = blk;
+		arena->bump = (char *)blk + MM_NODE_ALIGN(sizeof(struct mm_arena_blk));
+		arena->end = (char *)blk + MM_ARENA_BLKSZ;
+	}
+
+	node = arena->bump;
+	arena->bump += sz;
+	return node;
+}
+
+/*
+ * mm_node_free - recycle a node on the free list of its class
+ * @mm  : owner of the node
+ * @cls : node class
+ * @node: node got from mm_node_alloc() with the same class
+ */
+void mm_node_free(struct mm_struct *mm, enum mm_node_cls cls, void *node)
+{
+	if (node == NULL)
+		return;
+
+	*(void **)node = mm->arena.freelist[cls];
+	mm->arena.freelist[cls] = node;
+}
+
+/*
+ * mm_arena_release - give every block back at once, all nodes of the
+ * arena become invalid
+ * @arena: arena
+ */
+void mm_arena_release(struct mm_arena *arena)
+{
+	struct mm_arena_blk *blk;
+
+	while ((blk = arena->blocks) != NULL)
+	{
+		arena->blocks = blk->next;
+		free(blk);
+	}
+	mm_arena_init(arena);
+}
+
+// #endif
@@ -0,0 +1,647 @@
+// #ifdef MM_PAGING
+/*
+ * PAGING based Memory Management
+ * Shared frames and same-page merging mm/mm-ksm.c
+ *
+ * A shared frame is mapped copy-on-write (PAGING_PTE_COW_MASK) by any
+ * number of pages, the first write through any of its PTEs gives that
+ * page a private copy again. Frames get shared by fork, and with
+ * same-page merging (os -m) newly mapped pages all share one zero
+ * filled frame until they are first written, while a scanner thread
+ * walks the MEMRAM frames in the background and leaves pages of any
+ * process found with the same content on a single frame.
+ *
+ * A shared frame has no owner in the reverse map, its pages are listed
+ * here instead and each of their processes is charged for it. To free
+ * the frame, replacement moves all of them out to swap. The zero frame
+ * is never freed and, like the zero page of Linux, charged to nobody.
+ *
+ * Like the KSM of Linux, a frame is only merged once its checksum has
+ * not changed between two scans. Shared frames are kept in the stable
+ * table; candidates seen during the current pass go to the unstable
+ * table, which is dropped at the end of every pass.
+ */
+
+#include "mm.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#define KSM_HASH_SZ (1 << KSM_HASH_BITS)
+
+/* A page mapping a shared frame */
+struct ksm_mapper
+{
+	struct mm_struct *mm;
+	int pgn;
+	struct ksm_mapper *next;
+};
+
+struct ksm_frame
+{
+	uint32_t sum;	   /* content checksum at the last scan */
+	int refcnt;		   /* PTEs mapping a shared frame, 0 if private */
+	struct ksm_mapper *mappers; /* those PTEs, none for the zero frame */
+	int stable;		   /* in the stable table, shared by content */
+	int stable_next;   /* next shared frame in the same bucket */
+	int unstable_next; /* next candidate of this pass in the same bucket */
+};
+
+int ksm_enabled = 0;
+
+/* Protects refcnt, mappers, the stable table and the counters below, it comes
+ * after any mm_struct::lock and before any memphy_struct::lock */
+static pthread_mutex_t ksm_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ksm_wake = PTHREAD_COND_INITIALIZER;
+static int ksm_stopping;
+
+static struct ksm_frame *ksm_fr;
+static int ksm_stable[KSM_HASH_SZ];
+static int ksm_unstable[KSM_HASH_SZ]; /* scanner only, no lock */
+static int ksm_zero_fpn = -1;
+static uint32_t ksm_zero_sum;
+
+static int ksm_zero_refs;	   /* PTEs mapping the zero frame */
+static int ksm_shared_refs;	   /* PTEs mapping any other shared frame */
+static int ksm_shared_frames;
+static int ksm_saved_peak;
+static unsigned long ksm_passes;
+
+static pthread_t ksm_thread;
+static int ksm_running;
+
+/* The scanner is a kernel thread, it only uses the memory devices */
+static struct pcb_t ksm_pcb;
+
+/* FNV-1a over a page */
+static uint32_t ksm_checksum(const BYTE *page)
+{
+	uint32_t h = 2166136261U;
+	int i;
+
+	for (i = 0; i < PAGING_PAGESZ; i++)
+		h = (h ^ (unsigned char)page[i]) * 16777619U;
+	return h;
+}
+
+/* Count the frames saved so far, under ksm_lock */
+static void ksm_account(void)
+{
+	int saved = ksm_zero_refs + ksm_shared_refs - ksm_shared_frames;
+
+	if (saved > ksm_saved_peak)
+		ksm_saved_peak = saved;
+}
+
+/*
+ * ksm_stable_find - look for a shared frame holding @page
+ * Called under ksm_lock, return -1 if there is none
+ */
+static int ksm_stable_find(const BYTE *page, uint32_t sum)
+{
+	BYTE buf[PAGING_PAGESZ];
+	int fpn;
+
+	for (fpn = ksm_stable[sum & (KSM_HASH_SZ - 1)]; fpn >= 0; fpn = ksm_fr[fpn].stable_next)
+		if (ksm_fr[fpn].sum == sum &&
+			MEMPHY_read_page(ksm_pcb.mram, fpn, buf) == 0 &&
+			memcmp(buf, page, PAGING_PAGESZ) == 0)
+			return fpn;
+
+	return -1;
+}
+
+static void ksm_stable_insert(int fpn, uint32_t sum)
+{
+	ksm_fr[fpn].sum = sum;
+	ksm_fr[fpn].stable = 1;
+	ksm_fr[fpn].stable_next = ksm_stable[sum & (KSM_HASH_SZ - 1)];
+	ksm_stable[sum & (KSM_HASH_SZ - 1)] = fpn;
+}
+
+static void ksm_stable_remove(int fpn)
+{
+	int *it = &ksm_stable[ksm_fr[fpn].sum & (KSM_HASH_SZ - 1)];
+
+	if (!ksm_fr[fpn].stable)
+		return;
+	while (*it >= 0 && *it != fpn)
+		it = &ksm_fr[*it].stable_next;
+	if (*it == fpn)
+		*it = ksm_fr[fpn].stable_next;
+	ksm_fr[fpn].stable = 0;
+}
+
+/*
+ * ksm_add_mapper - list a page as mapping a shared frame and charge its
+ * process for it
+ * @m: node for it. Called under ksm_lock
+ */
+static void ksm_add_mapper(int fpn, struct ksm_mapper *m, struct mm_struct *mm, int pgn)
+{
+	m->mm = mm;
+	m->pgn = pgn;
+	m->next = ksm_fr[fpn].mappers;
+	ksm_fr[fpn].mappers = m;
+	ksm_fr[fpn].refcnt++;
+	ksm_shared_refs++;
+	mm_charge_rss(mm, 1);
+}
+
+/*
+ * ksm_del_mapper - take a page off the mappers of a shared frame
+ * Called under ksm_lock. Return 1 if it was the last one, the frame is
+ * not shared anymore
+ */
+static int ksm_del_mapper(int fpn, struct mm_struct *mm, int pgn)
+{
+	struct ksm_mapper **it = &ksm_fr[fpn].mappers, *m;
+
+	while ((m = *it) != NULL && (m->mm != mm || m->pgn != pgn))
+		it = &m->next;
+	if (m != NULL)
+	{
+		*it = m->next;
+		free(m);
+	}
+	mm_charge_rss(mm, -1);
+
+	ksm_shared_refs--;
+	if (--ksm_fr[fpn].refcnt > 0)
+		return 0;
+
+	ksm_stable_remove(fpn);
+	ksm_shared_frames--;
+	return 1;
+}
+
+/*
+ * ksm_make_shared - turn a private frame into a shared frame mapped once,
+ * by the page that owned it
+ * Called under ksm_lock with the owner of the frame locked. Return -1
+ * if out of memory, the frame stays private then
+ */
+static int ksm_make_shared(int fpn)
+{
+	struct memphy_struct *mram = ksm_pcb.mram;
+	struct ksm_mapper *m;
+	struct mm_struct *owner;
+	int pgn, typ, off;
+
+	pthread_mutex_lock(&mram->lock);
+	owner = mram->rmap[fpn].owner;
+	pgn = mram->rmap[fpn].pgn;
+	pthread_mutex_unlock(&mram->lock);
+	if (owner == NULL || (m = malloc(sizeof(*m))) == NULL)
+		return -1;
+
+	/* A swap copy belongs to one page, the frame has no single page now */
+	if (MEMPHY_get_swpcopy(mram, fpn, &typ, &off) == 0)
+		swap_slot_free(&ksm_pcb, typ, off);
+	MEMPHY_set_owner(mram, fpn, NULL, -1);
+
+	ksm_add_mapper(fpn, m, owner, pgn);
+	ksm_shared_frames++;
+	return 0;
+}
+
+/*
+ * ksm_promote - turn a private frame met earlier in this pass into a
+ * shared frame, if it still holds @page
+ * @mm : owner of the page being scanned, locked
+ *
+ * Called under ksm_lock. The owner of the candidate is only try-locked,
+ * it is busy and left alone otherwise
+ */
+static int ksm_promote(struct mm_struct *mm, int fpn, const BYTE *page, uint32_t sum)
+{
+	struct memphy_struct *mram = ksm_pcb.mram;
+	BYTE buf[PAGING_PAGESZ];
+	struct mm_struct *owner;
+	uint32_t *pte;
+	int cand, pgn, ret;
+
+	for (cand = ksm_unstable[sum & (KSM_HASH_SZ - 1)]; cand >= 0; cand = ksm_fr[cand].unstable_next)
+	{
+		if (cand == fpn || ksm_fr[cand].sum != sum || ksm_fr[cand].refcnt > 0)
+			continue;
+
+		pthread_mutex_lock(&mram->lock);
+		owner = mram->rmap[cand].owner;
+		pgn = mram->rmap[cand].pgn;
+		if (owner == NULL || (owner != mm && pthread_mutex_trylock(&owner->lock) != 0))
+		{
+			pthread_mutex_unlock(&mram->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&mram->lock);
+
+		/* The frame may have been reused since it was seen */
+		pte = pte_ptr(owner, pgn);
+		ret = -1;
+		if (PAGING_PAGE_ONLINE(*pte) && !(*pte & PAGING_PTE_COW_MASK) &&
+			PAGING_PTE_FPN(*pte) == cand &&
+			MEMPHY_read_page(mram, cand, buf) == 0 &&
+			memcmp(buf, page, PAGING_PAGESZ) == 0 &&
+			ksm_make_shared(cand) == 0)
+		{
+			SETBIT(*pte, PAGING_PTE_COW_MASK);
+			ksm_stable_insert(cand, sum);
+			ret = 0;
+		}
+		if (owner != mm)
+			pthread_mutex_unlock(&owner->lock);
+		if (ret == 0)
+			return cand;
+	}
+
+	return -1;
+}
+
+/*
+ * ksm_scan_frame - try to merge the page living in a MEMRAM frame
+ * @fpn: frame under the scanner hand
+ */
+static void ksm_scan_frame(int fpn)
+{
+	struct memphy_struct *mram = ksm_pcb.mram;
+	BYTE page[PAGING_PAGESZ];
+	struct ksm_mapper *m;
+	struct mm_struct *mm;
+	uint32_t sum, *pte;
+	int pgn, target, typ, off;
+
+	/* Free, shared and unmapped frames have no owner */
+	pthread_mutex_lock(&mram->lock);
+	mm = mram->rmap[fpn].owner;
+	pgn = mram->rmap[fpn].pgn;
+	if (mm == NULL || pthread_mutex_trylock(&mm->lock) != 0)
+	{
+		pthread_mutex_unlock(&mram->lock);
+		return;
+	}
+	pthread_mutex_unlock(&mram->lock);
+
+	/* Huge pages keep their frames in one run */
+	if (pte_get(mm, pgn) & PAGING_PTE_HUGE_MASK)
+	{
+		pthread_mutex_unlock(&mm->lock);
+		return;
+	}
+
+	if (MEMPHY_read_page(mram, fpn, page) < 0)
+	{
+		pthread_mutex_unlock(&mm->lock);
+		return;
+	}
+	sum = ksm_checksum(page);
+	if (sum != ksm_fr[fpn].sum)
+	{ /* Changed since the last pass, still being written */
+		ksm_fr[fpn].sum = sum;
+		pthread_mutex_unlock(&mm->lock);
+		return;
+	}
+	if ((m = malloc(sizeof(*m))) == NULL)
+	{
+		pthread_mutex_unlock(&mm->lock);
+		return;
+	}
+
+	pthread_mutex_lock(&ksm_lock);
+	target = ksm_stable_find(page, sum);
+	if (target == ksm_zero_fpn)
+	{
+		ksm_zero_refs++;
+		free(m);
+	}
+	else if (target >= 0 || (target = ksm_promote(mm, fpn, page, sum)) >= 0)
+		ksm_add_mapper(target, m, mm, pgn);
+	else
+	{
+		ksm_fr[fpn].unstable_next = ksm_unstable[sum & (KSM_HASH_SZ - 1)];
+		ksm_unstable[sum & (KSM_HASH_SZ - 1)] = fpn;
+		pthread_mutex_unlock(&ksm_lock);
+		pthread_mutex_unlock(&mm->lock);
+		free(m);
+		return;
+	}
+	ksm_account();
+	pthread_mutex_unlock(&ksm_lock);
+
+	/* The page now maps the shared frame, its own frame goes away */
+	pte = pte_ptr(mm, pgn);
+	pte_set_fpn(pte, target);
+	SETBIT(*pte, PAGING_PTE_COW_MASK);
+#ifdef MM_TLB
+	tlb_flush_page(mm->pid, pgn);
+#endif
+	if (MEMPHY_get_swpcopy(mram, fpn, &typ, &off) == 0)
+		swap_slot_free(&ksm_pcb, typ, off);
+	MEMPHY_put_freefp(mram, fpn);
+	pg_stat_inc(PG_STAT_MERGE);
+	pthread_mutex_unlock(&mm->lock);
+}
+
+static void *ksm_routine(void *arg)
+{
+	struct memphy_struct *mram = ksm_pcb.mram;
+	struct timespec deadline;
+	int hand = 0, n;
+
+	pthread_mutex_lock(&ksm_lock);
+	while (!ksm_stopping)
+	{
+		pthread_mutex_unlock(&ksm_lock);
+		for (n = 0; n < KSM_SCAN_BATCH; n++)
+		{
+			if (hand != ksm_zero_fpn)
+				ksm_scan_frame(hand);
+			if (++hand == mram->numfp)
+			{ /* New pass, new unstable table */
+				hand = 0;
+				memset(ksm_unstable, -1, sizeof(ksm_unstable));
+				ksm_passes++;
+			}
+		}
+
+		pthread_mutex_lock(&ksm_lock);
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += KSM_SLEEP_USEC * 1000L;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+		if (!ksm_stopping)
+			pthread_cond_timedwait(&ksm_wake, &ksm_lock, &deadline);
+	}
+	pthread_mutex_unlock(&ksm_lock);
+
+	return NULL;
+}
+
+/*
+ * ksm_init - set up the shared frame tables of MEMRAM
+ * @mram       : MEMRAM device
+ * @mswp       : swap devices
+ * @active_mswp: swap device tried first
+ */
+int ksm_init(struct memphy_struct *mram, struct memphy_struct **mswp,
+			 struct memphy_struct *active_mswp)
+{
+	BYTE zero[PAGING_PAGESZ];
+	int i;
+
+	if (mram->rmap == NULL)
+		return -1;
+
+	memset(&ksm_pcb, 0, sizeof(ksm_pcb));
+	ksm_pcb.mram = mram;
+	ksm_pcb.mswp = mswp;
+	ksm_pcb.active_mswp = active_mswp;
+
+	ksm_fr = calloc(mram->numfp, sizeof(struct ksm_frame));
+	memset(ksm_stable, -1, sizeof(ksm_stable));
+	memset(ksm_unstable, -1, sizeof(ksm_unstable));
+
+	memset(zero, 0, sizeof(zero));
+	ksm_zero_sum = ksm_checksum(zero);
+	for (i = 0; i < mram->numfp; i++)
+		ksm_fr[i].sum = ~ksm_zero_sum; /* nothing is stable before a scan */
+
+	return 0;
+}
+
+/*
+ * ksm_start - set the zero frame aside and start the scanner
+ */
+int ksm_start(void)
+{
+	struct memphy_struct *mram = ksm_pcb.mram;
+	BYTE zero[PAGING_PAGESZ];
+
+	if (ksm_fr == NULL || MEMPHY_get_freefp(mram, &ksm_zero_fpn) < 0)
+		return -1;
+
+	memset(zero, 0, sizeof(zero));
+	MEMPHY_write_page(mram, ksm_zero_fpn, zero);
+	ksm_fr[ksm_zero_fpn].refcnt = 1; /* never unshared */
+	ksm_stable_insert(ksm_zero_fpn, ksm_zero_sum);
+
+	ksm_stopping = 0;
+	ksm_enabled = 1;
+	if (pthread_create(&ksm_thread, NULL, ksm_routine, NULL) != 0)
+		return -1;
+	ksm_running = 1;
+
+	return 0;
+}
+
+/*
+ * ksm_stop - stop the scanner and wait for it
+ */
+void ksm_stop(void)
+{
+	if (!ksm_running)
+		return;
+
+	pthread_mutex_lock(&ksm_lock);
+	ksm_stopping = 1;
+	pthread_cond_signal(&ksm_wake);
+	pthread_mutex_unlock(&ksm_lock);
+
+	pthread_join(ksm_thread, NULL);
+	ksm_running = 0;
+}
+
+/*
+ * ksm_map_zero - map a page that has never been written to the zero frame
+ * @mm : owner of the page, locked
+ * @pgn: page
+ */
+int ksm_map_zero(struct mm_struct *mm, int pgn)
+{
+	uint32_t *pte;
+
+	if ((pte = pte_ptr(mm, pgn)) == NULL)
+		return -1;
+
+	pthread_mutex_lock(&ksm_lock);
+	ksm_zero_refs++;
+	ksm_account();
+	pthread_mutex_unlock(&ksm_lock);
+
+	pte_set_fpn(pte, ksm_zero_fpn);
+	SETBIT(*pte, PAGING_PTE_COW_MASK);
+	pg_stat_inc(PG_STAT_ZEROMAP);
+
+	return 0;
+}
+
+/*
+ * ksm_share - map a frame once more, copy-on-write
+ * @mm : process of the new mapping, locked
+ * @pgn: its page
+ * @fpn: frame, a private one becomes shared between its page and the
+ *       new mapping. The owner of a private frame is locked
+ *
+ * Return -1 if out of memory, nothing is changed then
+ */
+int ksm_share(struct mm_struct *mm, int pgn, int fpn)
+{
+	struct ksm_mapper *m = NULL;
+
+	if (fpn != ksm_zero_fpn && (m = malloc(sizeof(*m))) == NULL)
+		return -1;
+
+	pthread_mutex_lock(&ksm_lock);
+	if (fpn == ksm_zero_fpn)
+		ksm_zero_refs++;
+	else if (ksm_fr[fpn].refcnt > 0 || ksm_make_shared(fpn) == 0)
+		ksm_add_mapper(fpn, m, mm, pgn);
+	else
+	{
+		pthread_mutex_unlock(&ksm_lock);
+		free(m);
+		return -1;
+	}
+	ksm_account();
+	pthread_mutex_unlock(&ksm_lock);
+
+	return 0;
+}
+
+/*
+ * ksm_unshare - take a shared frame back as a private one if the caller
+ * holds its only mapping
+ * @mm : process of the mapping, locked
+ * @pgn: its page
+ * @fpn: shared frame
+ *
+ * Return 0 if the caller now owns the frame alone, it is charged for it
+ * again through the reverse map, -1 if it has to copy
+ */
+int ksm_unshare(struct mm_struct *mm, int pgn, int fpn)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&ksm_lock);
+	if (fpn != ksm_zero_fpn && ksm_fr[fpn].refcnt == 1)
+		ret = ksm_del_mapper(fpn, mm, pgn) ? 0 : -1;
+	pthread_mutex_unlock(&ksm_lock);
+
+	return ret;
+}
+
+/*
+ * ksm_put - drop a mapping of a shared frame, the last one frees it
+ * @mm : process of the mapping, locked
+ * @pgn: its page
+ * @fpn: shared frame
+ */
+void ksm_put(struct mm_struct *mm, int pgn, int fpn)
+{
+	int freed = 0;
+
+	pthread_mutex_lock(&ksm_lock);
+	if (fpn == ksm_zero_fpn)
+		ksm_zero_refs--;
+	else
+		freed = ksm_del_mapper(fpn, mm, pgn);
+	pthread_mutex_unlock(&ksm_lock);
+
+	if (freed)
+		MEMPHY_put_freefp(ksm_pcb.mram, fpn);
+}
+
+/*
+ * ksm_is_zero - whether @fpn is the zero frame, whose pages hold no
+ * memory of their own and are never moved out
+ */
+int ksm_is_zero(int fpn)
+{
+	return fpn >= 0 && fpn == ksm_zero_fpn;
+}
+
+/*
+ * ksm_lock_mapper - lock the process of a mapping unless it is the
+ * caller's, try-locked since ksm_lock is held
+ */
+static int ksm_lock_mapper(struct pcb_t *caller, struct mm_struct *mm)
+{
+	return mm == caller->mm || pthread_mutex_trylock(&mm->lock) == 0;
+}
+
+static void ksm_unlock_mapper(struct pcb_t *caller, struct mm_struct *mm)
+{
+	if (mm != caller->mm)
+		pthread_mutex_unlock(&mm->lock);
+}
+
+/*
+ * ksm_swap_out - move the pages mapping a shared frame out to swap
+ * @caller: caller, its mm locked if it has one
+ * @only  : the one process whose pages go, NULL for all of them
+ * @fpn   : frame
+ * @clock : give pages accessed since the last call another round
+ *
+ * Each page gets a swap slot of its own, as a swapped page does at
+ * fork. Pages of processes busy in a memory operation stay, and so do
+ * those that cannot be moved out for lack of swap or swap quota. Return
+ * 0 if the frame is free now, it is handed to the caller rather than
+ * put back, -1 otherwise
+ */
+int ksm_swap_out(struct pcb_t *caller, struct mm_struct *only, int fpn, int clock)
+{
+	struct ksm_mapper *m, *next;
+	struct mm_struct *mm;
+	uint32_t *pte;
+	int young = 0, ret = -1, pgn;
+
+	pthread_mutex_lock(&ksm_lock);
+	if (ksm_fr == NULL || fpn == ksm_zero_fpn || ksm_fr[fpn].refcnt == 0)
+	{
+		pthread_mutex_unlock(&ksm_lock);
+		return -1;
+	}
+
+	for (m = ksm_fr[fpn].mappers; clock && m != NULL; m = m->next)
+	{
+		if ((only != NULL && m->mm != only) || !ksm_lock_mapper(caller, m->mm))
+			continue;
+		pte = pte_ptr(m->mm, m->pgn);
+		if (*pte & PAGING_PTE_ACCESSED_MASK)
+		{
+			CLRBIT(*pte, PAGING_PTE_ACCESSED_MASK);
+			young = 1;
+		}
+		ksm_unlock_mapper(caller, m->mm);
+	}
+
+	for (m = ksm_fr[fpn].mappers; !young && m != NULL; m = next)
+	{
+		next = m->next;
+		mm = m->mm;
+		pgn = m->pgn;
+		if ((only != NULL && mm != only) || !ksm_lock_mapper(caller, mm))
+			continue;
+		if (swap_out_shared(caller, mm, pgn) == 0)
+			ret = ksm_del_mapper(fpn, mm, pgn) ? 0 : -1;
+		ksm_unlock_mapper(caller, mm);
+	}
+
+	pthread_mutex_unlock(&ksm_lock);
+	return ret;
+}
+
+/*
+ * ksm_report - print the frames saved by sharing
+ */
+void ksm_report(void)
+{
+	printf("Sharing: %d frames saved at peak, %d now (%d pages on the zero frame, "
+		   "%d on %d shared frames), %lu scanner passes\n",
+		   ksm_saved_peak, ksm_zero_refs + ksm_shared_refs - ksm_shared_frames,
+		   ksm_zero_refs, ksm_shared_refs, ksm_shared_frames, ksm_passes);
+}
+
+// #endif
@@ -0,0 +1,119 @@
+// #ifdef MM_PAGING
+/*
+ * PAGING based Memory Management
+ * Background page reclaim mm/mm-kswapd.c
+ *
+ * kswapd sleeps until an allocation leaves fewer than low_wmark free
+ * frames in MEMRAM, then moves cold pages of any process out to swap
+ * until high_wmark frames are free again, so that faults and
+ * allocations rarely have to reclaim a frame themselves.
+ */
+
+#include "mm.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+static pthread_t kswapd_thread;
+static int kswapd_running;
+static int kswapd_stopping; /* under mram->lock */
+
+/* kswapd is a kernel thread: it has no mm of its own and only uses the
+ * memory devices of the system */
+static struct pcb_t kswapd_pcb;
+
+static void *kswapd_routine(void *arg)
+{
+	struct memphy_struct *mram = kswapd_pcb.mram;
+	int fpn, progress = 1;
+
+	pthread_mutex_lock(&mram->lock);
+	for (;;)
+	{
+		/* After a fruitless round wait for the next allocation */
+		while (!kswapd_stopping &&
+			   (!progress || mram->free_top >= mram->low_wmark))
+		{
+			pthread_cond_wait(&mram->reclaim, &mram->lock);
+			progress = 1;
+		}
+		if (kswapd_stopping)
+			break;
+
+		while (mram->free_top < mram->high_wmark)
+		{
+			pthread_mutex_unlock(&mram->lock);
+			progress = (swap_out_global(&kswapd_pcb, &fpn) == 0);
+			if (progress)
+			{
+				MEMPHY_put_freefp(mram, fpn);
+				pg_stat_inc(PG_STAT_KSWAPD);
+			}
+			pthread_mutex_lock(&mram->lock);
+			if (!progress || kswapd_stopping)
+				break;
+		}
+	}
+	pthread_mutex_unlock(&mram->lock);
+
+	return NULL;
+}
+
+/*
+ * kswapd_start - set the MEMRAM watermarks and start reclaiming
+ * @mram       : MEMRAM device
+ * @mswp       : swap devices
+ * @active_mswp: swap device tried first
+ *
+ * Replacement has to be global (pg_global), the pages kswapd takes
+ * belong to any process
+ */
+int kswapd_start(struct memphy_struct *mram, struct memphy_struct **mswp,
+				 struct memphy_struct *active_mswp)
+{
+	int low = mram->numfp * KSWAPD_LOW_PCT / 100;
+	int high = mram->numfp * KSWAPD_HIGH_PCT / 100;
+
+	if (mram->numfp <= 0)
+		return -1;
+
+	memset(&kswapd_pcb, 0, sizeof(kswapd_pcb));
+	kswapd_pcb.mram = mram;
+	kswapd_pcb.mswp = mswp;
+	kswapd_pcb.active_mswp = active_mswp;
+
+	pthread_mutex_lock(&mram->lock);
+	mram->low_wmark = (low > 0) ? low : 1;
+	mram->high_wmark = (high > mram->low_wmark) ? high : mram->low_wmark + 1;
+	pthread_mutex_unlock(&mram->lock);
+
+	kswapd_stopping = 0;
+	if (pthread_create(&kswapd_thread, NULL, kswapd_routine, NULL) != 0)
+		return -1;
+	kswapd_running = 1;
+
+	return 0;
+}
+
+/*
+ * kswapd_stop - wake kswapd up for good and wait for it
+ */
+void kswapd_stop(void)
+{
+	struct memphy_struct *mram = kswapd_pcb.mram;
+
+	if (!kswapd_running)
+		return;
+
+	pthread_mutex_lock(&mram->lock);
+	kswapd_stopping = 1;
+	mram->low_wmark = 0;
+	pthread_cond_signal(&mram->reclaim);
+	pthread_mutex_unlock(&mram->lock);
+
+	pthread_join(kswapd_thread, NULL);
+	kswapd_running = 0;
+}
+
+// #endif
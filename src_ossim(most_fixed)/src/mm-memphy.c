@@ -9,6 +9,9 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 
 /*
  *  MEMPHY_mv_csr - move MEMPHY cursor
@@ -41,7 +44,7 @@ int MEMPHY_seq_read(struct memphy_struct *mp, int addr, BYTE *value)
 	if (mp == NULL)
 		return -1;
 
-	if (!mp->rdmflg)
+	if (mp->rdmflg)
 		return -1; /* Not compatible mode for sequential read */
 
 	MEMPHY_mv_csr(mp, addr);
@@ -61,6 +64,8 @@ int MEMPHY_read(struct memphy_struct *mp, int addr, BYTE *value)
 	if (mp == NULL)
 		return -1;
 
+	if (mp->kind == MEMPHY_FILE)
+		return (pread(mp->fd, value, 1, addr) == 1) ? 0 : -1;
 	if (mp->rdmflg)
 		*value = mp->storage[addr];
 	else /* Sequential access device */
@@ -81,7 +86,7 @@ int MEMPHY_seq_write(struct memphy_struct *mp, int addr, BYTE value)
 	if (mp == NULL)
 		return -1;
 
-	if (!mp->rdmflg)
+	if (mp->rdmflg)
 		return -1; /* Not compatible mode for sequential read */
 
 	MEMPHY_mv_csr(mp, addr);
@@ -101,6 +106,8 @@ int MEMPHY_write(struct memphy_struct *mp, int addr, BYTE data)
 	if (mp == NULL)
 		return -1;
 
+	if (mp->kind == MEMPHY_FILE)
+		return (pwrite(mp->fd, &data, 1, addr) == 1) ? 0 : -1;
 	if (mp->rdmflg)
 		mp->storage[addr] = data;
 	else /* Sequential access device */
@@ -109,33 +116,266 @@ int MEMPHY_write(struct memphy_struct *mp, int addr, BYTE data)
 	return 0;
 }
 
+/*
+ *  MEMPHY_read_page - read a whole frame of a MEMPHY device
+ *  @mp: memphy struct
+ *  @fpn: frame
+ *  @buf: PAGING_PAGESZ bytes of obtained data
+ *
+ *  One copy for random access devices; sequential devices seek to the
+ *  frame once and stream it
+ */
+int MEMPHY_read_page(struct memphy_struct *mp, int fpn, BYTE *buf)
+{
+	long addr = (long)fpn * PAGING_PAGESZ;
+	int cellidx;
+
+	if (mp == NULL || addr < 0 || addr + PAGING_PAGESZ > mp->maxsz)
+		return -1;
+
+	if (mp->kind == MEMPHY_FILE)
+		return (pread(mp->fd, buf, PAGING_PAGESZ, addr) == PAGING_PAGESZ) ? 0 : -1;
+	if (mp->rdmflg)
+	{
+		memcpy(buf, &mp->storage[addr], PAGING_PAGESZ);
+		return 0;
+	}
+
+	MEMPHY_mv_csr(mp, addr);
+	for (cellidx = 0; cellidx < PAGING_PAGESZ; cellidx++)
+	{
+		buf[cellidx] = mp->storage[mp->cursor];
+		mp->cursor = (mp->cursor + 1) % mp->maxsz;
+	}
+
+	return 0;
+}
+
+/*
+ *  MEMPHY_write_page - write a whole frame of a MEMPHY device
+ *  @mp: memphy struct
+ *  @fpn: frame
+ *  @buf: PAGING_PAGESZ bytes of written data
+ */
+int MEMPHY_write_page(struct memphy_struct *mp, int fpn, const BYTE *buf)
+{
+	long addr = (long)fpn * PAGING_PAGESZ;
+	int cellidx;
+
+	if (mp == NULL || addr < 0 || addr + PAGING_PAGESZ > mp->maxsz)
+		return -1;
+
+	if (mp->kind == MEMPHY_FILE)
+		return (pwrite(mp->fd, buf, PAGING_PAGESZ, addr) == PAGING_PAGESZ) ? 0 : -1;
+	if (mp->rdmflg)
+	{
+		memcpy(&mp->storage[addr], buf, PAGING_PAGESZ);
+		return 0;
+	}
+
+	MEMPHY_mv_csr(mp, addr);
+	for (cellidx = 0; cellidx < PAGING_PAGESZ; cellidx++)
+	{
+		mp->storage[mp->cursor] = buf[cellidx];
+		mp->cursor = (mp->cursor + 1) % mp->maxsz;
+	}
+
+	return 0;
+}
+
+/* Frame usage bitmap helpers */
+#define MEMPHY_MAP_WORD(fpn) ((fpn) >> 5)
+#define MEMPHY_MAP_BIT(fpn) (1U << ((fpn) & 31))
+
+/*
+ *  MEMPHY_take_fp - move a free frame to the used set
+ *  @mp: memphy struct
+ *  @fpn: free frame
+ */
+static void MEMPHY_take_fp(struct memphy_struct *mp, int fpn)
+{
+	int slot = mp->free_pos[fpn];
+	int last = mp->free_stack[--mp->free_top];
+
+	/* Fill the hole with the top of the stack */
+	mp->free_stack[slot] = last;
+	mp->free_pos[last] = slot;
+	mp->free_pos[fpn] = -1;
+
+	mp->used_map[MEMPHY_MAP_WORD(fpn)] |= MEMPHY_MAP_BIT(fpn);
+}
+
+/*
+ *  Buddy mode
+ *  A block of 2^order frames starting at fpn has its buddy at
+ *  fpn ^ 2^order. An allocation splits the smallest free block large
+ *  enough, a freed frame merges with its buddy for as long as the buddy
+ *  is a free block of the same order
+ */
+static void buddy_link(struct memphy_struct *mp, int fpn, int order)
+{
+	mp->buddy_order[fpn] = order;
+	mp->buddy_prev[fpn] = -1;
+	mp->buddy_next[fpn] = mp->buddy_head[order];
+	if (mp->buddy_head[order] >= 0)
+		mp->buddy_prev[mp->buddy_head[order]] = fpn;
+	mp->buddy_head[order] = fpn;
+}
+
+static void buddy_unlink(struct memphy_struct *mp, int fpn)
+{
+	int prev = mp->buddy_prev[fpn], next = mp->buddy_next[fpn];
+
+	if (prev >= 0)
+		mp->buddy_next[prev] = next;
+	else
+		mp->buddy_head[mp->buddy_order[fpn]] = next;
+	if (next >= 0)
+		mp->buddy_prev[next] = prev;
+	mp->buddy_order[fpn] = -1;
+}
+
+/*
+ *  buddy_take - take a free block of 2^order frames
+ *  Return its first frame, -1 if no free block is large enough
+ */
+static int buddy_take(struct memphy_struct *mp, int order)
+{
+	int k = order, fpn, iter;
+
+	while (k <= MEMPHY_BUDDY_MAX_ORDER && mp->buddy_head[k] < 0)
+		k++;
+	if (k > MEMPHY_BUDDY_MAX_ORDER)
+		return -1;
+
+	fpn = mp->buddy_head[k];
+	buddy_unlink(mp, fpn);
+	while (k > order) /* the upper halves stay free */
+	{
+		k--;
+		buddy_link(mp, fpn + (1 << k), k);
+	}
+
+	for (iter = fpn; iter < fpn + (1 << order); iter++)
+		mp->used_map[MEMPHY_MAP_WORD(iter)] |= MEMPHY_MAP_BIT(iter);
+	mp->free_top -= 1 << order;
+	return fpn;
+}
+
+/*
+ *  buddy_put - give a frame back, merged with its free buddies
+ *  The frame is already cleared in used_map
+ */
+static void buddy_put(struct memphy_struct *mp, int fpn)
+{
+	int order = 0, buddy;
+
+	while (order < MEMPHY_BUDDY_MAX_ORDER)
+	{
+		buddy = fpn ^ (1 << order);
+		if (buddy >= mp->numfp || mp->buddy_order[buddy] != order)
+			break;
+		buddy_unlink(mp, buddy);
+		fpn &= ~(1 << order);
+		order++;
+	}
+
+	buddy_link(mp, fpn, order);
+	mp->free_top++;
+}
+
+/*
+ *  MEMPHY_buddy_init - switch a freshly formatted device to buddy mode
+ *  @mp: memphy struct, none of its frames handed out yet
+ */
+int MEMPHY_buddy_init(struct memphy_struct *mp)
+{
+	int fpn, order;
+
+	if (mp == NULL || mp->numfp <= 0 || mp->free_top != mp->numfp)
+		return -1;
+
+	mp->buddy_next = malloc(mp->numfp * sizeof(int));
+	mp->buddy_prev = malloc(mp->numfp * sizeof(int));
+	mp->buddy_order = malloc(mp->numfp);
+	memset(mp->buddy_order, -1, mp->numfp);
+	for (order = 0; order <= MEMPHY_BUDDY_MAX_ORDER; order++)
+		mp->buddy_head[order] = -1;
+
+	/* Largest aligned blocks first, the tail of a device whose size is
+	 * not a power of two ends up in smaller ones */
+	for (fpn = 0; fpn < mp->numfp; fpn += 1 << order)
+	{
+		order = MEMPHY_BUDDY_MAX_ORDER;
+		while (order > 0 && ((fpn & ((1 << order) - 1)) || fpn + (1 << order) > mp->numfp))
+			order--;
+		buddy_link(mp, fpn, order);
+	}
+
+	mp->buddy = 1;
+	return 0;
+}
+
 /*
  *  MEMPHY_format-format MEMPHY device
  *  @mp: memphy struct
+ *
+ *  A device has at most PAGING_MAX_SWPFPN frames, read_config() turns
+ *  larger ones down
  */
 int MEMPHY_format(struct memphy_struct *mp, int pagesz)
 {
 	/* This setting come with fixed constant PAGESZ */
-	int numfp = mp->maxsz / pagesz;
-	struct framephy_struct *newfst, *fst;
-	int iter = 0;
-
-	if (numfp <= 0)
+	long numfp = mp->maxsz / pagesz;
+	int iter;
+
+	mp->numfp = 0;
+	mp->free_top = 0;
+	mp->free_stack = NULL;
+	mp->free_pos = NULL;
+	mp->used_map = NULL;
+	mp->rmap = NULL;
+	mp->rmap_hand = 0;
+	mp->buddy = 0;
+	mp->buddy_next = mp->buddy_prev = NULL;
+	mp->buddy_order = NULL;
+	if (numfp <= 0 || numfp > PAGING_MAX_SWPFPN)
 		return -1;
 
-	/* Init head of free framephy list */
-	fst = malloc(sizeof(struct framephy_struct));
-	fst->fpn = iter;
-	mp->free_fp_list = fst;
+	mp->numfp = numfp;
+	mp->free_stack = malloc(numfp * sizeof(int));
+	mp->free_pos = malloc(numfp * sizeof(int));
+	mp->used_map = calloc(DIV_ROUND_UP(numfp, 32), sizeof(uint32_t));
 
-	/* We have list with first element, fill in the rest num-1 element member*/
-	for (iter = 1; iter < numfp; iter++)
+	/* Lowest frame on top so frames are handed out in ascending order */
+	for (iter = 0; iter < numfp; iter++)
 	{
-		newfst = malloc(sizeof(struct framephy_struct));
-		newfst->fpn = iter;
-		newfst->fp_next = NULL;
-		fst->fp_next = newfst;
-		fst = newfst;
+		mp->free_stack[iter] = numfp - 1 - iter;
+		mp->free_pos[numfp - 1 - iter] = iter;
+	}
+	mp->free_top = numfp;
+
+	return 0;
+}
+
+/*
+ *  MEMPHY_rmap_init - give a freshly formatted device a reverse map
+ *  @mp: memphy struct, MEMRAM: swap devices are never scanned by frame
+ */
+int MEMPHY_rmap_init(struct memphy_struct *mp)
+{
+	int iter;
+
+	if (mp->numfp <= 0)
+		return -1;
+
+	mp->rmap = calloc(mp->numfp, sizeof(struct framephy_struct));
+	if (mp->rmap == NULL)
+		return -1;
+	for (iter = 0; iter < mp->numfp; iter++)
+	{
+		mp->rmap[iter].fpn = iter;
+		mp->rmap[iter].swptyp = -1;
 	}
 
 	return 0;
@@ -145,22 +385,173 @@ int MEMPHY_get_freefp(struct memphy_struct *mp, int *retfpn)
 {
 	if (mp == NULL)
 		return -1;
-	
-	struct framephy_struct *fp = mp->free_fp_list;
 
-	if (fp == NULL)
+	pthread_mutex_lock(&mp->lock);
+	if (mp->free_top == 0)
+	{
+		if (mp->low_wmark > 0)
+			pthread_cond_signal(&mp->reclaim);
+		pthread_mutex_unlock(&mp->lock);
 		return -1;
+	}
 
-	*retfpn = fp->fpn;
-	mp->free_fp_list = fp->fp_next;
+	if (mp->buddy)
+		*retfpn = buddy_take(mp, 0);
+	else
+	{
+		*retfpn = mp->free_stack[mp->free_top - 1];
+		MEMPHY_take_fp(mp, *retfpn);
+	}
+	if (mp->free_top < mp->low_wmark)
+		pthread_cond_signal(&mp->reclaim);
 
-	/* MEMPHY is iteratively used up until its exhausted
-	 * No garbage collector acting then it not been released
-	 */
-	free(fp);
+	pthread_mutex_unlock(&mp->lock);
+	return 0;
+}
+
+/*
+ *  MEMPHY_get_freerun - get npages contiguous free frames
+ *  @mp: memphy struct
+ *  @npages: run length
+ *  @retfpn: first frame of the run
+ *
+ *  First fit over the usage bitmap, fully used words are skipped. In
+ *  buddy mode the run comes from a block of the next power of two and
+ *  the frames past npages go back, runs larger than a block fail
+ */
+int MEMPHY_get_freerun(struct memphy_struct *mp, int npages, int *retfpn)
+{
+	int fpn = 0, run = 0, iter;
+
+	if (mp == NULL || npages <= 0)
+		return -1;
+
+	pthread_mutex_lock(&mp->lock);
+	if (mp->buddy)
+	{
+		int order = 0;
+
+		while ((1 << order) < npages)
+			order++;
+		if (order > MEMPHY_BUDDY_MAX_ORDER || (fpn = buddy_take(mp, order)) < 0)
+		{
+			pthread_mutex_unlock(&mp->lock);
+			return -1;
+		}
+		for (iter = fpn + npages; iter < fpn + (1 << order); iter++)
+		{
+			mp->used_map[MEMPHY_MAP_WORD(iter)] &= ~MEMPHY_MAP_BIT(iter);
+			buddy_put(mp, iter);
+		}
+		*retfpn = fpn;
+		if (mp->free_top < mp->low_wmark)
+			pthread_cond_signal(&mp->reclaim);
+		pthread_mutex_unlock(&mp->lock);
+		return 0;
+	}
+
+	while (mp->free_top >= npages && fpn < mp->numfp)
+	{
+		if (mp->used_map[MEMPHY_MAP_WORD(fpn)] == ~0U)
+		{
+			run = 0;
+			fpn = (MEMPHY_MAP_WORD(fpn) + 1) << 5;
+			continue;
+		}
+
+		if (mp->used_map[MEMPHY_MAP_WORD(fpn)] & MEMPHY_MAP_BIT(fpn))
+			run = 0;
+		else if (++run == npages)
+		{
+			*retfpn = fpn - npages + 1;
+			for (iter = *retfpn; iter <= fpn; iter++)
+				MEMPHY_take_fp(mp, iter);
+			if (mp->free_top < mp->low_wmark)
+				pthread_cond_signal(&mp->reclaim);
+			pthread_mutex_unlock(&mp->lock);
+			return 0;
+		}
+		fpn++;
+	}
+
+	pthread_mutex_unlock(&mp->lock);
+	return -1;
+}
+
+int MEMPHY_is_used(struct memphy_struct *mp, int fpn)
+{
+	if (mp == NULL || fpn < 0 || fpn >= mp->numfp)
+		return 0;
+
+	return (mp->used_map[MEMPHY_MAP_WORD(fpn)] & MEMPHY_MAP_BIT(fpn)) != 0;
+}
+
+/*
+ *  MEMPHY_set_owner - record which page is mapped to a used frame
+ *  @mp: memphy struct
+ *  @fpn: frame
+ *  @owner: mm mapping the frame, NULL once it is unmapped
+ *  @pgn: page of owner
+ */
+int MEMPHY_set_owner(struct memphy_struct *mp, int fpn, struct mm_struct *owner, int pgn)
+{
+	if (mp == NULL || mp->rmap == NULL || fpn < 0 || fpn >= mp->numfp)
+		return -1;
+
+	pthread_mutex_lock(&mp->lock);
+	/* The owner is charged for the frame, see mm-oom.c */
+	if (mp->rmap[fpn].owner != NULL)
+		mm_charge_rss(mp->rmap[fpn].owner, -1);
+	if (owner != NULL)
+		mm_charge_rss(owner, 1);
+	mp->rmap[fpn].owner = owner;
+	mp->rmap[fpn].pgn = pgn;
+	mp->rmap[fpn].swptyp = -1;
+	pthread_mutex_unlock(&mp->lock);
+	return 0;
+}
+
+/*
+ *  MEMPHY_set_swpcopy - record the swap slot holding a copy of a frame
+ *  @mp: memphy struct
+ *  @fpn: frame
+ *  @swptyp: swap type of the slot, -1 to forget it
+ *  @swpoff: frame number on that swap
+ */
+int MEMPHY_set_swpcopy(struct memphy_struct *mp, int fpn, int swptyp, int swpoff)
+{
+	if (mp == NULL || mp->rmap == NULL || fpn < 0 || fpn >= mp->numfp)
+		return -1;
+
+	pthread_mutex_lock(&mp->lock);
+	mp->rmap[fpn].swptyp = swptyp;
+	mp->rmap[fpn].swpoff = swpoff;
+	pthread_mutex_unlock(&mp->lock);
 	return 0;
 }
 
+/*
+ *  MEMPHY_get_swpcopy - find the swap slot holding a copy of a frame
+ *  Return -1 if the frame has no swap copy
+ */
+int MEMPHY_get_swpcopy(struct memphy_struct *mp, int fpn, int *swptyp, int *swpoff)
+{
+	int ret = -1;
+
+	if (mp == NULL || mp->rmap == NULL || fpn < 0 || fpn >= mp->numfp)
+		return -1;
+
+	pthread_mutex_lock(&mp->lock);
+	if (mp->rmap[fpn].swptyp >= 0)
+	{
+		*swptyp = mp->rmap[fpn].swptyp;
+		*swpoff = mp->rmap[fpn].swpoff;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&mp->lock);
+	return ret;
+}
+
 int MEMPHY_dump(struct memphy_struct *mp)
 {
 	/*TODO dump memphy contnt mp->storage
@@ -170,53 +561,65 @@ int MEMPHY_dump(struct memphy_struct *mp)
 	return 0;
 #endif
 
-	char *message = calloc(mp->maxsz, sizeof(char));
-	char *format_str = calloc(256, sizeof(char));
-
-	for (int idx = 0; idx < 64; ++idx)
-		message[idx] = '*';
+	if (mp->storage == NULL)
+		return -1;
 
-	sprintf(format_str, "\nDumping Memory Content (size = %d bytes):\n", mp->maxsz);
-	strcat(message, format_str);
-	format_str[0] = '\0';
+	/* Written straight to stdout, callers serialize whole dumps */
+	printf("****************************************************************");
+	printf("\nDumping Memory Content (size = %ld bytes):\n", mp->maxsz);
 
 	for (int addr = 0; addr < mp->maxsz; ++addr)
 		if (mp->storage[addr])
-		{
-			sprintf(format_str, "address=%08d - value=%d\n", addr, mp->storage[addr]);
-			strcat(message, format_str);
-			format_str[0] = '\0';
-		}
+			printf("address=%08d - value=%d\n", addr, mp->storage[addr]);
 
-	for (int idx = 0; idx < 64; ++idx)
-		strcat(message, "*");
-
-	puts(message);
-	free(message);
-	free(format_str);
+	printf("****************************************************************\n");
 
 	return 0;
 }
 
 int MEMPHY_put_freefp(struct memphy_struct *mp, int fpn)
 {
-	struct framephy_struct *fp = mp->free_fp_list;
-	struct framephy_struct *newnode = malloc(sizeof(struct framephy_struct));
+	if (mp == NULL || fpn < 0 || fpn >= mp->numfp)
+		return -1;
+
+	pthread_mutex_lock(&mp->lock);
+	if (!MEMPHY_is_used(mp, fpn))
+	{
+		pthread_mutex_unlock(&mp->lock);
+		return -1; /* Already free */
+	}
 
-	/* Create new node with value fpn */
-	newnode->fpn = fpn;
-	newnode->fp_next = fp;
-	mp->free_fp_list = newnode;
+	mp->used_map[MEMPHY_MAP_WORD(fpn)] &= ~MEMPHY_MAP_BIT(fpn);
+	if (mp->rmap != NULL)
+	{
+		if (mp->rmap[fpn].owner != NULL)
+			mm_charge_rss(mp->rmap[fpn].owner, -1);
+		mp->rmap[fpn].owner = NULL;
+		mp->rmap[fpn].swptyp = -1;
+	}
+	if (mp->buddy)
+		buddy_put(mp, fpn);
+	else
+	{
+		mp->free_pos[fpn] = mp->free_top;
+		mp->free_stack[mp->free_top++] = fpn;
+	}
+	pthread_mutex_unlock(&mp->lock);
 	return 0;
 }
 
 /*
  *  Init MEMPHY struct
  */
-int init_memphy(struct memphy_struct *mp, int max_size, int randomflg)
+int init_memphy(struct memphy_struct *mp, long max_size, int randomflg)
 {
 	mp->storage = (BYTE *)malloc(max_size * sizeof(BYTE));
 	mp->maxsz = max_size;
+	mp->kind = MEMPHY_MEM;
+	mp->fd = -1;
+	pthread_mutex_init(&mp->lock, NULL);
+	pthread_cond_init(&mp->reclaim, NULL);
+	mp->low_wmark = mp->high_wmark = 0;
 
 	MEMPHY_format(mp, PAGING_PAGESZ);
 
@@ -228,4 +631,55 @@ int init_memphy(struct memphy_struct *mp, int max_size, int randomflg)
 	return 0;
 }
 
+/*
+ *  Init MEMPHY struct stored in a host file
+ *  @mp: memphy struct
+ *  @max_size: device size, the file is sparse so this costs no host memory
+ *  @kind: MEMPHY_MMAP maps the file, MEMPHY_FILE uses pread/pwrite and
+ *         lets the host page cache do the caching
+ *
+ *  The file is unlinked at once so it goes away with the simulator
+ */
+int init_memphy_file(struct memphy_struct *mp, long max_size, enum memphy_kind kind)
+{
+	char path[] = MEMPHY_FILE_DIR "/ossim-swap-XXXXXX";
+
+	mp->storage = NULL;
+	mp->maxsz = max_size;
+	mp->kind = kind;
+	mp->fd = mkstemp(path);
+	if (mp->fd < 0)
+		return -1;
+	unlink(path);
+
+	if (ftruncate(mp->fd, max_size) < 0)
+		goto fail;
+	if (kind == MEMPHY_MMAP)
+	{
+		mp->storage = mmap(NULL, max_size, PROT_READ | PROT_WRITE, MAP_SHARED, mp->fd, 0);
+		if (mp->storage == MAP_FAILED)
+		{
+			mp->storage = NULL;
+			goto fail;
+		}
+	}
+
+	pthread_mutex_init(&mp->lock, NULL);
+	pthread_cond_init(&mp->reclaim, NULL);
+	mp->low_wmark = mp->high_wmark = 0;
+
+	MEMPHY_format(mp, PAGING_PAGESZ);
+
+	/* Files are random access */
+	mp->rdmflg = 1;
+	mp->cursor = 0;
+
+	return 0;
+
+fail:
+	close(mp->fd);
+	mp->fd = -1;
+	return -1;
+}
+
 // #endif
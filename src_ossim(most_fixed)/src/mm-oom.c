@@ -0,0 +1,207 @@
+// #ifdef MM_PAGING
+/*
+ * PAGING based Memory Management
+ * Memory quotas and the OOM killer mm/mm-oom.c
+ *
+ * A process may be given a resident and a swap limit on its line of the
+ * configure file. It is charged for the MEMRAM frames it owns in the
+ * reverse map or shares with other processes (mm-ksm.c), and for its
+ * swapped pages: at its resident limit a new frame comes from one of
+ * its own pages, at its swap limit none of its pages goes out to swap
+ * anymore.
+ *
+ * When MEMRAM and swap are both full the OOM killer picks the process
+ * with the highest badness, its resident plus swapped pages, and reaps
+ * it: its private pages and swap slots are given back at once, shared
+ * memory it attached stays until it exits. Its memory operations fail
+ * from then on, and the CPU running it ends it at its next step. A
+ * victim that was busy in a memory operation is reaped by the next OOM
+ * instead, and nobody else is killed until then.
+ */
+
+#include "mm.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+/* mm_struct::oom_state */
+#define OOM_NONE 0
+#define OOM_KILLED 1 /* picked, its pages are still there */
+#define OOM_REAPED 2 /* nothing left to take from it */
+
+/* Protects the list of processes and their oom_state, it comes after
+ * any mm_struct::lock, those of the list are only try-locked */
+static pthread_mutex_t oom_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mm_struct *oom_list;
+
+void mm_charge_rss(struct mm_struct *mm, int npages)
+{
+	__atomic_add_fetch(&mm->rss, npages, __ATOMIC_RELAXED);
+}
+
+void mm_charge_swap(struct mm_struct *mm, int npages)
+{
+	__atomic_add_fetch(&mm->swap_pages, npages, __ATOMIC_RELAXED);
+}
+
+/*
+ * mm_rss_room - whether @npages more frames keep @mm within its
+ * resident limit
+ */
+int mm_rss_room(struct mm_struct *mm, int npages)
+{
+	return mm->rss_limit == 0 ||
+		   __atomic_load_n(&mm->rss, __ATOMIC_RELAXED) + npages <= mm->rss_limit;
+}
+
+/*
+ * mm_swap_room - whether @npages more swapped pages keep @mm within
+ * its swap limit
+ */
+int mm_swap_room(struct mm_struct *mm, int npages)
+{
+	return mm->swap_limit == 0 ||
+		   __atomic_load_n(&mm->swap_pages, __ATOMIC_RELAXED) + npages <= mm->swap_limit;
+}
+
+/*
+ * oom_register - make the address space of a process a candidate victim
+ * Shared memory segments and a child still being forked are not
+ */
+void oom_register(struct mm_struct *mm)
+{
+	pthread_mutex_lock(&oom_lock);
+	mm->oom_prev = NULL;
+	mm->oom_next = oom_list;
+	if (oom_list != NULL)
+		oom_list->oom_prev = mm;
+	oom_list = mm;
+	mm->oom_listed = 1;
+	pthread_mutex_unlock(&oom_lock);
+}
+
+void oom_unregister(struct mm_struct *mm)
+{
+	pthread_mutex_lock(&oom_lock);
+	if (mm->oom_listed)
+	{
+		if (mm->oom_prev != NULL)
+			mm->oom_prev->oom_next = mm->oom_next;
+		else
+			oom_list = mm->oom_next;
+		if (mm->oom_next != NULL)
+			mm->oom_next->oom_prev = mm->oom_prev;
+		mm->oom_listed = 0;
+	}
+	pthread_mutex_unlock(&oom_lock);
+}
+
+/*
+ * oom_killed - whether the OOM killer picked @mm, its process is to end
+ */
+int oom_killed(struct mm_struct *mm)
+{
+	return mm != NULL && __atomic_load_n(&mm->oom_state, __ATOMIC_RELAXED) != OOM_NONE;
+}
+
+static long oom_badness(struct mm_struct *mm)
+{
+	return __atomic_load_n(&mm->rss, __ATOMIC_RELAXED) +
+		   __atomic_load_n(&mm->swap_pages, __ATOMIC_RELAXED);
+}
+
+/*
+ * oom_reap - give back the private pages of a victim
+ * @caller: caller, whose memory devices are used
+ * @mm    : victim, locked
+ * Called under oom_lock
+ */
+static void oom_reap(struct pcb_t *caller, struct mm_struct *mm)
+{
+	long before = oom_badness(mm);
+	int i;
+
+	for (i = 0; i < mm->map_count; i++)
+		reap_pte_range(caller, mm, mm->mmap[i]->vm_start / PAGING_PAGESZ,
+					   mm->mmap[i]->vm_end / PAGING_PAGESZ);
+#ifdef MM_TLB
+	tlb_flush_pid(mm->pid);
+#endif
+
+	__atomic_store_n(&mm->oom_state, OOM_REAPED, __ATOMIC_RELAXED);
+	pg_stat_add(PG_STAT_OOMREAP, before - oom_badness(mm));
+}
+
+/*
+ * oom_try_reap - reap a victim unless it is busy in a memory operation
+ * Return 0 if it is reaped, -1 otherwise. Called under oom_lock
+ */
+static int oom_try_reap(struct pcb_t *caller, struct mm_struct *mm)
+{
+	if (mm != caller->mm && pthread_mutex_trylock(&mm->lock) != 0)
+		return -1;
+
+	oom_reap(caller, mm);
+	if (mm != caller->mm)
+		pthread_mutex_unlock(&mm->lock);
+	return 0;
+}
+
+/*
+ * oom_kill - kill the process with the highest badness to get memory
+ * @caller: caller, its mm locked
+ * @only  : the one process to pick from, NULL for any
+ *
+ * Return 0 if the memory of another process was given back and the
+ * allocation may be tried again, -1 if not or if the caller itself was
+ * killed
+ */
+int oom_kill(struct pcb_t *caller, struct mm_struct *only)
+{
+	struct mm_struct *mm, *victim = NULL;
+	long badness, worst = 0;
+	int ret;
+
+	pthread_mutex_lock(&oom_lock);
+	for (mm = oom_list; mm != NULL; mm = mm->oom_next)
+	{
+		if (only != NULL && mm != only)
+			continue;
+
+		/* A victim still holding its pages comes first */
+		if (mm->oom_state == OOM_KILLED)
+		{
+			ret = oom_try_reap(caller, mm);
+			pthread_mutex_unlock(&oom_lock);
+			return (ret == 0 && mm != caller->mm) ? 0 : -1;
+		}
+		if (mm->oom_state == OOM_REAPED)
+			continue;
+
+		if ((badness = oom_badness(mm)) > worst)
+		{
+			worst = badness;
+			victim = mm;
+		}
+	}
+	if (victim == NULL)
+	{
+		pthread_mutex_unlock(&oom_lock);
+		return -1;
+	}
+
+#ifdef MMDBG
+	printf("OOM: killed process %d, badness %ld (%d resident %d swapped pages)\n",
+		   victim->pid, worst, __atomic_load_n(&victim->rss, __ATOMIC_RELAXED),
+		   __atomic_load_n(&victim->swap_pages, __ATOMIC_RELAXED));
+#endif
+	__atomic_store_n(&victim->oom_state, OOM_KILLED, __ATOMIC_RELAXED);
+	pg_stat_inc(PG_STAT_OOMKILL);
+
+	ret = oom_try_reap(caller, victim);
+	pthread_mutex_unlock(&oom_lock);
+
+	return (ret == 0 && victim != caller->mm) ? 0 : -1;
+}
+
+// #endif
@@ -0,0 +1,252 @@
+// #ifdef MM_PAGING
+/*
+ * PAGING based Memory Management
+ * Page tables mm/mm-pgtbl.c
+ *
+ * With MM_PGTBL_RADIX the page table of a process is a radix tree of
+ * PGTBL_LEVELS levels of tables of PGTBL_NENT entries. The top table
+ * comes with the mm, a lower one only once a page in its range gets a
+ * PTE, and they all stay until the mm goes away: a page that had a PTE
+ * once always finds its table. A missing table stands for a whole range
+ * of empty PTEs, which pte_next skips at once. Without MM_PGTBL_RADIX
+ * the page table is one flat array of PAGING_MAX_PGN PTEs.
+ *
+ * Everything here runs under the mm_struct::lock of the owner.
+ */
+
+#include "mm.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+/* Host memory held by the page tables of all processes */
+static long pgtbl_bytes;
+static long pgtbl_peak;
+
+static void pgtbl_account(long bytes)
+{
+	long now = __atomic_add_fetch(&pgtbl_bytes, bytes, __ATOMIC_RELAXED);
+	long peak = __atomic_load_n(&pgtbl_peak, __ATOMIC_RELAXED);
+
+	while (now > peak &&
+		   !__atomic_compare_exchange_n(&pgtbl_peak, &peak, now, 0,
+										__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+#ifdef MM_PGTBL_RADIX
+/* Entry of the table at @level (0 is the top) on the way to @pgn */
+#define PGTBL_SHIFT(level) ((PGTBL_LEVELS - 1 - (level)) * PGTBL_BITS)
+#define PGTBL_INDEX(pgn, level) (((pgn) >> PGTBL_SHIFT(level)) & (PGTBL_NENT - 1))
+#define PGTBL_LEAF (PGTBL_LEVELS - 1)
+
+static size_t pgtbl_size(int level)
+{
+	return PGTBL_NENT * ((level == PGTBL_LEAF) ? sizeof(uint32_t) : sizeof(void *));
+}
+
+static void *pgtbl_alloc(int level)
+{
+	void *tbl = calloc(1, pgtbl_size(level));
+
+	if (tbl != NULL)
+		pgtbl_account(pgtbl_size(level));
+	return tbl;
+}
+
+static void pgtbl_release(void **tbl, int level)
+{
+	int i;
+
+	if (level < PGTBL_LEAF)
+		for (i = 0; i < PGTBL_NENT; i++)
+			if (tbl[i] != NULL)
+				pgtbl_release(tbl[i], level + 1);
+
+	pgtbl_account(-(long)pgtbl_size(level));
+	free(tbl);
+}
+
+/*
+ * pgtbl_leaf - walk down to the table holding the PTE of a page
+ * @mm   : owner
+ * @pgn  : page
+ * @alloc: allocate the missing tables on the way, or return NULL
+ *
+ * Also return NULL if a table cannot be allocated
+ */
+static uint32_t *pgtbl_leaf(struct mm_struct *mm, int pgn, int alloc)
+{
+	void **tbl = mm->pgd;
+	int level;
+
+	for (level = 0; level < PGTBL_LEAF; level++)
+	{
+		void **ent = &tbl[PGTBL_INDEX(pgn, level)];
+
+		if (*ent == NULL)
+		{
+			if (!alloc || (*ent = pgtbl_alloc(level + 1)) == NULL)
+				return NULL;
+		}
+		tbl = *ent;
+	}
+
+	return (uint32_t *)tbl;
+}
+
+int pgtbl_init(struct mm_struct *mm)
+{
+	mm->pgd = pgtbl_alloc(0);
+	return (mm->pgd != NULL) ? 0 : -1;
+}
+
+void pgtbl_free(struct mm_struct *mm)
+{
+	if (mm->pgd == NULL)
+		return;
+	pgtbl_release(mm->pgd, 0);
+	mm->pgd = NULL;
+}
+
+/*
+ * pte_get - the PTE of a page
+ * Return 0 (not mapped) if its table was never allocated
+ */
+uint32_t pte_get(struct mm_struct *mm, int pgn)
+{
+	uint32_t *leaf = pgtbl_leaf(mm, pgn, 0);
+
+	return (leaf != NULL) ? leaf[PGTBL_INDEX(pgn, PGTBL_LEAF)] : 0;
+}
+
+/*
+ * pte_ptr - where the PTE of a page is kept, its tables are allocated
+ * if they are not there yet
+ * Return NULL if they cannot be. Tables are never freed before the mm,
+ * so this cannot fail for a page that had a PTE once or whose range
+ * went through pgtbl_populate
+ */
+uint32_t *pte_ptr(struct mm_struct *mm, int pgn)
+{
+	uint32_t *leaf = pgtbl_leaf(mm, pgn, 1);
+
+	return (leaf != NULL) ? &leaf[PGTBL_INDEX(pgn, PGTBL_LEAF)] : NULL;
+}
+
+/*
+ * pgtbl_populate - allocate the tables of a range of pages about to get
+ * their PTEs, before anything is mapped
+ * @mm    : owner
+ * @pgn   : first page
+ * @endpgn: page after the last one
+ *
+ * Return 0 on success, -1 if the host is out of memory
+ */
+int pgtbl_populate(struct mm_struct *mm, int pgn, int endpgn)
+{
+	/* One leaf table per PGTBL_NENT pages */
+	for (; pgn < endpgn; pgn = (pgn | (PGTBL_NENT - 1)) + 1)
+		if (pgtbl_leaf(mm, pgn, 1) == NULL)
+			return -1;
+
+	return 0;
+}
+
+/*
+ * pte_next - present-range iterator
+ * @mm    : owner
+ * @pgn   : first page to look at, return the page of the PTE found
+ * @endpgn: page after the last one to look at
+ *
+ * Return the first PTE that is not empty from @pgn on, NULL if there is
+ * none before @endpgn. Missing tables are skipped as a whole
+ */
+uint32_t *pte_next(struct mm_struct *mm, int *pgn, int endpgn)
+{
+	void **tbl;
+	uint32_t *leaf;
+	int level;
+
+	while (*pgn < endpgn)
+	{
+		tbl = mm->pgd;
+		for (level = 0; level < PGTBL_LEAF && tbl != NULL; level++)
+			tbl = tbl[PGTBL_INDEX(*pgn, level)];
+		if (tbl == NULL)
+		{ /* Nothing below the entry of level - 1, go to the next one */
+			*pgn = ((*pgn >> PGTBL_SHIFT(level - 1)) + 1) << PGTBL_SHIFT(level - 1);
+			continue;
+		}
+
+		leaf = (uint32_t *)tbl;
+		do
+		{
+			if (leaf[PGTBL_INDEX(*pgn, PGTBL_LEAF)] != 0)
+				return &leaf[PGTBL_INDEX(*pgn, PGTBL_LEAF)];
+			(*pgn)++;
+		} while (*pgn < endpgn && PGTBL_INDEX(*pgn, PGTBL_LEAF) != 0);
+	}
+
+	return NULL;
+}
+
+#else /* Flat page table */
+
+int pgtbl_init(struct mm_struct *mm)
+{
+	mm->pgd = calloc(PAGING_MAX_PGN, sizeof(uint32_t));
+	if (mm->pgd == NULL)
+		return -1;
+	pgtbl_account(PAGING_MAX_PGN * sizeof(uint32_t));
+	return 0;
+}
+
+void pgtbl_free(struct mm_struct *mm)
+{
+	if (mm->pgd == NULL)
+		return;
+	free(mm->pgd);
+	mm->pgd = NULL;
+	pgtbl_account(-(long)(PAGING_MAX_PGN * sizeof(uint32_t)));
+}
+
+uint32_t pte_get(struct mm_struct *mm, int pgn)
+{
+	return mm->pgd[pgn];
+}
+
+uint32_t *pte_ptr(struct mm_struct *mm, int pgn)
+{
+	return &mm->pgd[pgn];
+}
+
+int pgtbl_populate(struct mm_struct *mm, int pgn, int endpgn)
+{
+	return 0;
+}
+
+uint32_t *pte_next(struct mm_struct *mm, int *pgn, int endpgn)
+{
+	for (; *pgn < endpgn; (*pgn)++)
+		if (mm->pgd[*pgn] != 0)
+			return &mm->pgd[*pgn];
+
+	return NULL;
+}
+
+#endif
+
+/*
+ * pgtbl_report - print the host memory the page tables took
+ */
+void pgtbl_report(void)
+{
+#ifdef MM_PGTBL_RADIX
+	printf("Paging tables: %d levels, %ld bytes at peak, %ld now\n",
+		   PGTBL_LEVELS, pgtbl_peak, pgtbl_bytes);
+#else
+	printf("Paging tables: flat, %ld bytes at peak, %ld now\n", pgtbl_peak, pgtbl_bytes);
+#endif
+}
+
+// #endif
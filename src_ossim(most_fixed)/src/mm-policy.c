@@ -0,0 +1,319 @@
+// #ifdef MM_PAGING
+/*
+ * PAGING based Memory Management
+ * Page replacement policies mm/mm-policy.c
+ *
+ *  fifo  - evict the page that has been online the longest
+ *  clock - second chance: a page accessed since the hand last passed
+ *          gets its accessed bit cleared and goes round again
+ *  2q    - new pages go through a small FIFO (fifo_pgn); a page faulted
+ *          back in while its number is still on the ghost queue was
+ *          evicted too early and joins the hot queue (hot_pgn), which
+ *          is run as a clock. Scanning a region once thus only cycles
+ *          through the FIFO side and cannot flush the hot pages
+ */
+
+#include "mm.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Counters of the whole run, updated by every CPU */
+static unsigned long pg_stat[PG_STAT_NEV];
+
+/*
+ * pgn_queue_push - append a page at the tail of a queue
+ * Return -1 if no node is left, right after a pop it cannot fail
+ */
+static int pgn_queue_push(struct mm_struct *mm, struct pgn_queue *q, int pgn)
+{
+	struct pgn_t *pnode = mm_node_alloc(mm, MM_NODE_PGN);
+
+	if (pnode == NULL)
+		return -1;
+
+	pnode->pgn = pgn;
+	pnode->pg_next = NULL;
+	if (q->tail != NULL)
+		q->tail->pg_next = pnode;
+	else
+		q->head = pnode;
+	q->tail = pnode;
+	q->size++;
+
+	return 0;
+}
+
+/*
+ * pgn_queue_pop - take the page at the head of a queue
+ */
+static int pgn_queue_pop(struct mm_struct *mm, struct pgn_queue *q, int *pgn)
+{
+	struct pgn_t *pnode = q->head;
+
+	if (pnode == NULL)
+		return -1;
+
+	*pgn = pnode->pgn;
+	q->head = pnode->pg_next;
+	if (q->head == NULL)
+		q->tail = NULL;
+	q->size--;
+	mm_node_free(mm, MM_NODE_PGN, pnode);
+
+	return 0;
+}
+
+/*
+ * pgn_queue_remove - drop a page from a queue
+ * Return 0 if the page was on it, -1 otherwise
+ */
+static int pgn_queue_remove(struct mm_struct *mm, struct pgn_queue *q, int pgn)
+{
+	struct pgn_t *prev = NULL, *pnode;
+
+	for (pnode = q->head; pnode != NULL; prev = pnode, pnode = pnode->pg_next)
+	{
+		if (pnode->pgn != pgn)
+			continue;
+
+		if (prev != NULL)
+			prev->pg_next = pnode->pg_next;
+		else
+			q->head = pnode->pg_next;
+		if (q->tail == pnode)
+			q->tail = prev;
+		q->size--;
+		mm_node_free(mm, MM_NODE_PGN, pnode);
+		return 0;
+	}
+
+	return -1;
+}
+
+/*
+ * pgn_queue_forget - drop the pages of [pgn, endpgn) from a queue
+ */
+static void pgn_queue_forget(struct mm_struct *mm, struct pgn_queue *q, int pgn, int endpgn)
+{
+	struct pgn_t **it = &q->head, *pnode;
+
+	q->tail = NULL;
+	while ((pnode = *it) != NULL)
+	{
+		if (pnode->pgn >= pgn && pnode->pgn < endpgn)
+		{
+			*it = pnode->pg_next;
+			q->size--;
+			mm_node_free(mm, MM_NODE_PGN, pnode);
+			continue;
+		}
+		q->tail = pnode;
+		it = &pnode->pg_next;
+	}
+}
+
+/*
+ * clock_scan - pop the first page of @q not accessed since the last scan
+ * Accessed pages are rotated to the tail with the bit cleared, so the
+ * scan ends within one round of the queue. A page global reclaim took
+ * out meanwhile is popped as it is, its swap entry has no accessed bit
+ */
+static int clock_scan(struct mm_struct *mm, struct pgn_queue *q, int *retpgn)
+{
+	uint32_t *pte;
+	int pgn;
+
+	while (pgn_queue_pop(mm, q, &pgn) == 0)
+	{
+		pte = pte_ptr(mm, pgn);
+		if (!PAGING_PAGE_ONLINE(*pte) || !(*pte & PAGING_PTE_ACCESSED_MASK))
+		{
+			*retpgn = pgn;
+			return 0;
+		}
+
+		CLRBIT(*pte, PAGING_PTE_ACCESSED_MASK);
+		pgn_queue_push(mm, q, pgn);
+	}
+
+	return -1;
+}
+
+static int fifo_admit(struct mm_struct *mm, int pgn)
+{
+	return pgn_queue_push(mm, &mm->fifo_pgn, pgn);
+}
+
+static int fifo_victim(struct mm_struct *mm, int *retpgn)
+{
+	return pgn_queue_pop(mm, &mm->fifo_pgn, retpgn);
+}
+
+static int clock_victim(struct mm_struct *mm, int *retpgn)
+{
+	return clock_scan(mm, &mm->fifo_pgn, retpgn);
+}
+
+static int twoq_admit(struct mm_struct *mm, int pgn)
+{
+	if (pgn_queue_remove(mm, &mm->ghost_pgn, pgn) == 0)
+		return pgn_queue_push(mm, &mm->hot_pgn, pgn);
+	return pgn_queue_push(mm, &mm->fifo_pgn, pgn);
+}
+
+static int twoq_victim(struct mm_struct *mm, int *retpgn)
+{
+	int online = mm->fifo_pgn.size + mm->hot_pgn.size;
+	int kin = online * PG_2Q_KIN / 100;
+	int kout = online * PG_2Q_KOUT / 100;
+	int pgn;
+
+	if (mm->fifo_pgn.size > kin || mm->hot_pgn.size == 0)
+	{
+		if (pgn_queue_pop(mm, &mm->fifo_pgn, retpgn) < 0)
+			return -1;
+
+		/* Remember it, a fault on it soon means it is hot */
+		pgn_queue_push(mm, &mm->ghost_pgn, *retpgn);
+		while (mm->ghost_pgn.size > kout && mm->ghost_pgn.size > 1)
+			pgn_queue_pop(mm, &mm->ghost_pgn, &pgn);
+		return 0;
+	}
+
+	return clock_scan(mm, &mm->hot_pgn, retpgn);
+}
+
+static struct pg_policy pg_policies[] = {
+	{"fifo", fifo_admit, fifo_victim},
+	{"clock", fifo_admit, clock_victim},
+	{"2q", twoq_admit, twoq_victim},
+};
+
+struct pg_policy *pg_policy = &pg_policies[0];
+int pg_global = 0;
+int pg_demand = 0;
+
+/*
+ * pg_policy_forget - drop unmapped pages from the replacement queues
+ * @mm    : memory region, locked
+ * @pgn   : first page
+ * @endpgn: page after the last one
+ *
+ * Their numbers may be mapped again, and a stale entry would make the
+ * new page a victim twice over or before its time. Ghost entries go
+ * too, the next page there is a new one
+ */
+void pg_policy_forget(struct mm_struct *mm, int pgn, int endpgn)
+{
+	pgn_queue_forget(mm, &mm->fifo_pgn, pgn, endpgn);
+	pgn_queue_forget(mm, &mm->hot_pgn, pgn, endpgn);
+	pgn_queue_forget(mm, &mm->ghost_pgn, pgn, endpgn);
+}
+
+/*
+ * pg_policy_select - choose the page replacement policy of this run
+ * @name: policy name
+ *
+ * Return 0 on success, -1 if there is no such policy
+ */
+int pg_policy_select(const char *name)
+{
+	int i;
+
+	for (i = 0; i < sizeof(pg_policies) / sizeof(pg_policies[0]); i++)
+		if (strcmp(pg_policies[i].name, name) == 0)
+		{
+			pg_policy = &pg_policies[i];
+			return 0;
+		}
+
+	return -1;
+}
+
+void pg_stat_inc(enum pg_stat_ev ev)
+{
+	__atomic_add_fetch(&pg_stat[ev], 1, __ATOMIC_RELAXED);
+}
+
+void pg_stat_add(enum pg_stat_ev ev, unsigned long n)
+{
+	__atomic_add_fetch(&pg_stat[ev], n, __ATOMIC_RELAXED);
+}
+
+/*
+ * pg_policy_report - print the paging activity of the run
+ */
+void pg_policy_report(void)
+{
+	unsigned long refs = pg_stat[PG_STAT_REF];
+
+	printf("Paging %s%s: %lu references %lu faults %lu evictions (fault rate %.2f%%)\n",
+		   pg_global ? "global clock" : pg_policy->name,
+		   pg_global ? "" : " (local)", refs, pg_stat[PG_STAT_FAULT],
+		   pg_stat[PG_STAT_EVICT],
+		   refs ? 100.0 * pg_stat[PG_STAT_FAULT] / refs : 0.0);
+	printf("Paging swap: %lu write-backs, %lu avoided for clean pages\n",
+		   pg_stat[PG_STAT_WRITEBACK], pg_stat[PG_STAT_WBSKIP]);
+	printf("Paging reclaim: %lu direct, %lu background\n",
+		   pg_stat[PG_STAT_DIRECT], pg_stat[PG_STAT_KSWAPD]);
+	if (zswap_enabled)
+	{
+		unsigned long loads = pg_stat[PG_STAT_ZLOAD] + pg_stat[PG_STAT_DEVLOAD];
+
+		printf("Paging zswap: %lu stored %lu rejected, %lu loads from the pool "
+			   "%lu from swap devices (hit rate %.2f%%)\n",
+			   pg_stat[PG_STAT_ZSTORE], pg_stat[PG_STAT_ZREJECT],
+			   pg_stat[PG_STAT_ZLOAD], pg_stat[PG_STAT_DEVLOAD],
+			   loads ? 100.0 * pg_stat[PG_STAT_ZLOAD] / loads : 0.0);
+		zswap_report();
+	}
+	if (ksm_enabled || pg_stat[PG_STAT_FORK])
+	{
+		printf("Paging sharing: %lu forks, %lu pages mapped to the zero frame, "
+			   "%lu merged, %lu copied on write\n",
+			   pg_stat[PG_STAT_FORK], pg_stat[PG_STAT_ZEROMAP],
+			   pg_stat[PG_STAT_MERGE], pg_stat[PG_STAT_COW]);
+		ksm_report();
+	}
+	if (pg_stat[PG_STAT_SHMGET])
+	{
+		printf("Paging shared memory: %lu segments created, %lu attached, %lu detached\n",
+			   pg_stat[PG_STAT_SHMGET], pg_stat[PG_STAT_SHMAT], pg_stat[PG_STAT_SHMDT]);
+		shm_report();
+	}
+	if (pg_stat[PG_STAT_RGREUSE] + pg_stat[PG_STAT_RGBRK])
+		printf("Paging heap: %lu allocations from free regions, %lu from the break "
+			   "(%lu mapping new pages, %lu fragmented), %lu merges, %lu trims\n",
+			   pg_stat[PG_STAT_RGREUSE], pg_stat[PG_STAT_RGBRK],
+			   pg_stat[PG_STAT_RGGROW], pg_stat[PG_STAT_RGFRAG],
+			   pg_stat[PG_STAT_RGMERGE], pg_stat[PG_STAT_RGTRIM]);
+	if (pg_stat[PG_STAT_ALLOCA] + pg_stat[PG_STAT_MMAP])
+		printf("Paging areas: %lu stack allocations, %lu areas mapped %lu unmapped\n",
+			   pg_stat[PG_STAT_ALLOCA], pg_stat[PG_STAT_MMAP], pg_stat[PG_STAT_MUNMAP]);
+	if (pg_stat[PG_STAT_RUN])
+		printf("Paging buddy: %lu frames mapped in %lu contiguous runs (%.2f frames per run)\n",
+			   pg_stat[PG_STAT_RUNPG], pg_stat[PG_STAT_RUN],
+			   (double)pg_stat[PG_STAT_RUNPG] / pg_stat[PG_STAT_RUN]);
+	if (pg_stat[PG_STAT_HUGEMAP])
+		printf("Paging huge pages: %lu mapped, %lu evicted, %lu faulted back whole, %lu split\n",
+			   pg_stat[PG_STAT_HUGEMAP], pg_stat[PG_STAT_HUGEEVICT],
+			   pg_stat[PG_STAT_HUGEFAULT], pg_stat[PG_STAT_HUGESPLIT]);
+	if (pg_stat[PG_STAT_VSZ])
+		printf("Paging resident set: %lu of %lu virtual pages online at exit (%.2f%%), "
+			   "%lu given a frame on first touch\n",
+			   pg_stat[PG_STAT_RSS], pg_stat[PG_STAT_VSZ],
+			   100.0 * pg_stat[PG_STAT_RSS] / pg_stat[PG_STAT_VSZ], pg_stat[PG_STAT_DEMAND]);
+	if (pg_stat[PG_STAT_QUOTA] + pg_stat[PG_STAT_SWAPQUOTA] + pg_stat[PG_STAT_OOMKILL])
+		printf("Paging quotas: %lu pages swapped out at the resident limit, %lu kept online "
+			   "at the swap limit, %lu processes killed out of memory (%lu pages reaped)\n",
+			   pg_stat[PG_STAT_QUOTA], pg_stat[PG_STAT_SWAPQUOTA],
+			   pg_stat[PG_STAT_OOMKILL], pg_stat[PG_STAT_OOMREAP]);
+	pgtbl_report();
+	printf("Paging readahead: %lu pages, %lu used (%.2f%%)\n",
+		   pg_stat[PG_STAT_RA], pg_stat[PG_STAT_RAHIT],
+		   pg_stat[PG_STAT_RA] ? 100.0 * pg_stat[PG_STAT_RAHIT] / pg_stat[PG_STAT_RA] : 0.0);
+	psi_report();
+}
+
+// #endif
@@ -0,0 +1,109 @@
+// #ifdef MM_PAGING
+/*
+ * PAGING based Memory Management
+ * Pressure stall information mm/mm-psi.c
+ *
+ * Like the memory PSI of Linux: a CPU is stalled on memory while its
+ * process reclaims a frame or waits for a page to come back from swap.
+ * Host time with at least one CPU stalled counts as "some", time with
+ * every CPU stalled as "full", both against the time since psi_init.
+ */
+
+#include "mm.h"
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+
+/* Protects everything below but the per thread nesting */
+static pthread_mutex_t psi_lock = PTHREAD_MUTEX_INITIALIZER;
+static int psi_ncpus;
+static int psi_nstalled; /* CPUs stalled right now */
+static long psi_start;
+static long psi_changed; /* last change of psi_nstalled */
+static long psi_some;
+static long psi_full;
+static long psi_longest;
+static unsigned long psi_stalls;
+
+/* A stall inside a stall, a fault reclaiming a frame, counts once */
+static __thread int psi_depth;
+static __thread long psi_entered;
+
+static long psi_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* Account the time since psi_nstalled last changed, under psi_lock */
+static void psi_update(long now)
+{
+	if (psi_nstalled > 0)
+		psi_some += now - psi_changed;
+	if (psi_ncpus > 0 && psi_nstalled >= psi_ncpus)
+		psi_full += now - psi_changed;
+	psi_changed = now;
+}
+
+/*
+ * psi_init - start measuring
+ * @ncpus: CPUs running processes
+ */
+void psi_init(int ncpus)
+{
+	pthread_mutex_lock(&psi_lock);
+	psi_ncpus = ncpus;
+	psi_start = psi_changed = psi_now();
+	pthread_mutex_unlock(&psi_lock);
+}
+
+void psi_memstall_enter(void)
+{
+	if (psi_depth++ > 0)
+		return;
+
+	psi_entered = psi_now();
+	pthread_mutex_lock(&psi_lock);
+	psi_update(psi_entered);
+	psi_nstalled++;
+	psi_stalls++;
+	pthread_mutex_unlock(&psi_lock);
+}
+
+void psi_memstall_leave(void)
+{
+	long now;
+
+	if (--psi_depth > 0)
+		return;
+
+	now = psi_now();
+	pthread_mutex_lock(&psi_lock);
+	psi_update(now);
+	psi_nstalled--;
+	if (now - psi_entered > psi_longest)
+		psi_longest = now - psi_entered;
+	pthread_mutex_unlock(&psi_lock);
+}
+
+/*
+ * psi_report - print the share of the run spent stalled on memory
+ */
+void psi_report(void)
+{
+	long total;
+
+	pthread_mutex_lock(&psi_lock);
+	psi_update(psi_now());
+	total = psi_changed - psi_start;
+	printf("Memory pressure: some %.2f%% full %.2f%% of %.3f s, %lu stalls, "
+		   "longest %ld us\n",
+		   total ? 100.0 * psi_some / total : 0.0,
+		   total ? 100.0 * psi_full / total : 0.0,
+		   total / 1e9, psi_stalls, psi_longest / 1000);
+	pthread_mutex_unlock(&psi_lock);
+}
+
+// #endif
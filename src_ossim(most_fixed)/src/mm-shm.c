@@ -0,0 +1,397 @@
+// #ifdef MM_PAGING
+/*
+ * PAGING based Memory Management
+ * Shared memory segments mm/mm-shm.c
+ *
+ * A segment is a run of pages named by a key, created by shmget and
+ * attached by any number of processes with shmat. Its pages belong to
+ * an address space of their own: the mm_struct of a pseudo process owns
+ * their frames in the reverse map, so global replacement, kswapd, zswap
+ * and merging handle them like the pages of any process. An attached
+ * process page holds no frame, only the segment and the page within it
+ * (PAGING_PTE_SHM_MASK), and every access goes through the page table
+ * of the segment. That page table is thus the one place where a swap
+ * out or a fault of the page is recorded, for all of its mappers.
+ *
+ * Every process PTE attached to a segment holds a reference on it, and
+ * so does the process that created it until it exits. The last one
+ * dropped frees its pages.
+ */
+
+#include "mm.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+struct shm_seg
+{
+	int used;
+	uint32_t key;
+	int size;		  /* bytes */
+	int npages;
+	int nmaps;		  /* process PTEs attached to the segment */
+	struct mm_struct *creator; /* holds one more reference, NULL once gone */
+	struct pcb_t pcb; /* owner of the pages, pcb.mm maps them */
+};
+
+/* Protects the table and the counts, it comes after the mm_struct::lock
+ * of a process and before the one of any segment */
+static pthread_mutex_t shm_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct shm_seg shm_segs[SHM_MAX_SEGS];
+
+static int shm_pages; /* pages of the segments alive */
+static int shm_pages_peak;
+static int shm_maps; /* process PTEs attached to them */
+
+/* Look a segment up by key, under shm_lock */
+static struct shm_seg *shm_find(uint32_t key)
+{
+	int i;
+
+	for (i = 0; i < SHM_MAX_SEGS; i++)
+		if (shm_segs[i].used && shm_segs[i].key == key)
+			return &shm_segs[i];
+
+	return NULL;
+}
+
+/*
+ * shm_unref - drop a reference on a segment, the last one frees it with
+ * all its pages, online or swapped
+ * Called under shm_lock
+ */
+static void shm_unref(struct shm_seg *seg)
+{
+	if (--seg->nmaps > 0)
+		return;
+
+	shm_pages -= seg->npages;
+	pthread_mutex_lock(&seg->pcb.mm->lock);
+	free_pcb_memph(&seg->pcb);
+	pthread_mutex_unlock(&seg->pcb.mm->lock);
+	free_mm(seg->pcb.mm);
+	seg->pcb.mm = NULL;
+	seg->used = 0;
+}
+
+/*
+ * shm_populate - give every page of a new segment a frame
+ * @seg : segment, its mm is locked
+ * @proc: process creating it, frames are reclaimed on its behalf
+ */
+static int shm_populate(struct shm_seg *seg, struct pcb_t *proc)
+{
+	struct framephy_struct *frm_lst;
+	struct vm_rg_struct rg;
+	int pgn;
+
+	/* Pages are mapped when an attached process first touches them */
+	if (pg_demand)
+		return 0;
+
+	if (pgtbl_populate(seg->pcb.mm, 0, seg->npages) < 0)
+		return -1;
+
+	if (ksm_enabled)
+	{ /* Nothing is written there yet, every page maps the zero frame */
+		for (pgn = 0; pgn < seg->npages; pgn++)
+			ksm_map_zero(seg->pcb.mm, pgn);
+		return 0;
+	}
+
+	if (alloc_pages_range(proc, seg->npages, &frm_lst) < 0)
+		return -1;
+	vmap_page_range(&seg->pcb, 0, seg->npages, frm_lst, &rg);
+	free_frame_list(proc, frm_lst, 0);
+
+	return 0;
+}
+
+/*
+ * shm_create - set up a segment in a free entry of the table
+ * Called under shm_lock with the mm of @proc locked
+ */
+static int shm_create(struct pcb_t *proc, uint32_t key, uint32_t size)
+{
+	struct vm_area_struct *vma;
+	struct shm_seg *seg;
+	int i, ret;
+
+	for (i = 0; i < SHM_MAX_SEGS && shm_segs[i].used; i++)
+		;
+	if (i == SHM_MAX_SEGS)
+		return -1;
+
+	seg = &shm_segs[i];
+	memset(&seg->pcb, 0, sizeof(seg->pcb));
+	seg->pcb.mram = proc->mram;
+	seg->pcb.mswp = proc->mswp;
+	seg->pcb.active_mswp = proc->active_mswp;
+	if ((seg->pcb.mm = malloc(sizeof(struct mm_struct))) == NULL)
+		return -1;
+	if (init_mm(seg->pcb.mm, &seg->pcb) < 0)
+	{
+		free_mm(seg->pcb.mm);
+		seg->pcb.mm = NULL;
+		return -1;
+	}
+
+	seg->npages = DIV_ROUND_UP(size, PAGING_PAGESZ);
+	vma = get_vma_by_num(seg->pcb.mm, VMA_HEAP);
+	vma->vm_end = vma->sbrk = seg->npages * PAGING_PAGESZ;
+
+	/* Global replacement may find the pages as soon as they are mapped */
+	pthread_mutex_lock(&seg->pcb.mm->lock);
+	ret = shm_populate(seg, proc);
+	pthread_mutex_unlock(&seg->pcb.mm->lock);
+	if (ret < 0)
+	{
+		free_mm(seg->pcb.mm);
+		seg->pcb.mm = NULL;
+		return -1;
+	}
+
+	seg->used = 1;
+	seg->key = key;
+	seg->size = size;
+	seg->nmaps = 1;
+	seg->creator = proc->mm;
+	shm_pages += seg->npages;
+	if (shm_pages > shm_pages_peak)
+		shm_pages_peak = shm_pages;
+
+	return 0;
+}
+
+/*pgshmget - create a shared memory segment
+ *@proc: Process executing the instruction
+ *@key: name of the segment
+ *@size: size in bytes
+ *
+ * Nothing is done if the segment exists and is large enough
+ */
+int pgshmget(struct pcb_t *proc, uint32_t key, uint32_t size)
+{
+	struct shm_seg *seg;
+	int ret;
+
+	if (size == 0 || DIV_ROUND_UP(size, PAGING_PAGESZ) > PAGING_MAX_PGN)
+		return -1;
+
+	pthread_mutex_lock(&proc->mm->lock);
+	pthread_mutex_lock(&shm_lock);
+	if ((seg = shm_find(key)) != NULL)
+		ret = (size <= seg->size) ? 0 : -1;
+	else if ((ret = shm_create(proc, key, size)) == 0)
+		pg_stat_inc(PG_STAT_SHMGET);
+	pthread_mutex_unlock(&shm_lock);
+	pthread_mutex_unlock(&proc->mm->lock);
+
+#ifdef MMDBG
+	if (ret < 0)
+		printf("//////// Can't execute 'shmget key=%d size=%d'\n", key, size);
+#endif
+	return ret;
+}
+
+/*pgshmat - attach a shared memory segment
+ *@proc: Process executing the instruction
+ *@key: name of the segment
+ *@reg_index: memory region ID (used to identify variable in symbole table)
+ *
+ * The segment gets an area of its own among those mapped by mmap
+ */
+int pgshmat(struct pcb_t *proc, uint32_t key, uint32_t reg_index)
+{
+	struct mm_struct *mm = proc->mm;
+	struct vm_rg_struct *rg = get_symrg_byid(mm, reg_index);
+	struct vm_area_struct *vma = NULL;
+	struct shm_seg *seg;
+	int start, end, pgn, id;
+	uint32_t *pte;
+
+	if (rg == NULL)
+		return -1;
+
+	/* Like alloc, whatever the register held is released first */
+	if (rg->rg_start < rg->rg_end)
+		pgfree_data(proc, reg_index);
+
+	pthread_mutex_lock(&mm->lock);
+	pthread_mutex_lock(&shm_lock);
+	seg = shm_find(key);
+	if (seg != NULL && (start = get_unmapped_area(mm, seg->npages * PAGING_PAGESZ)) >= 0 &&
+		pgtbl_populate(mm, start / PAGING_PAGESZ, start / PAGING_PAGESZ + seg->npages) == 0)
+		vma = init_vma(mm, mm->vm_next_id, start, VM_MAPPING);
+	if (vma == NULL)
+	{
+		pthread_mutex_unlock(&shm_lock);
+		pthread_mutex_unlock(&mm->lock);
+#ifdef MMDBG
+		printf("//////// Can't execute 'shmat key=%d region=%d'\n", key, reg_index);
+#endif
+		return -1;
+	}
+
+	mm->vm_next_id++;
+	end = start + seg->npages * PAGING_PAGESZ;
+	id = seg - shm_segs;
+	for (pgn = 0; pgn < seg->npages; pgn++)
+	{
+		pte = pte_ptr(mm, start / PAGING_PAGESZ + pgn);
+		*pte = PAGING_PTE_SHM_MASK;
+		SETVAL(*pte, id, PAGING_PTE_SHMID_MASK, PAGING_PTE_SHMID_LOBIT);
+		SETVAL(*pte, pgn, PAGING_PTE_SHMPGN_MASK, PAGING_PTE_SHMPGN_LOBIT);
+	}
+	seg->nmaps += seg->npages;
+	shm_maps += seg->npages;
+	pthread_mutex_unlock(&shm_lock);
+
+	vma->vm_end = vma->sbrk = end;
+	rg->rg_start = start;
+	rg->rg_end = start + seg->size;
+	pthread_mutex_unlock(&mm->lock);
+
+	pg_stat_inc(PG_STAT_SHMAT);
+	return 0;
+}
+
+/*pgshmdt - detach the shared memory segment a region is attached to
+ *@proc: Process executing the instruction
+ *@reg_index: memory region ID (used to identify variable in symbole table)
+ */
+int pgshmdt(struct pcb_t *proc, uint32_t reg_index)
+{
+	struct vm_rg_struct *rg = get_symrg_byid(proc->mm, reg_index);
+
+	if (rg == NULL)
+		return -1;
+
+	pthread_mutex_lock(&proc->mm->lock);
+	if (rg->rg_start >= rg->rg_end ||
+		!(pte_get(proc->mm, PAGING_PGN(rg->rg_start)) & PAGING_PTE_SHM_MASK))
+	{
+		pthread_mutex_unlock(&proc->mm->lock);
+#ifdef MMDBG
+		printf("//////// Can't execute 'shmdt region=%d'\n", reg_index);
+		printf("//////// since region %d of process %d is not shared memory\n", reg_index, proc->pid);
+#endif
+		return -1;
+	}
+
+	shm_detach(proc, rg);
+	rg->rg_start = rg->rg_end = 0;
+	rg->rg_next = NULL;
+	pthread_mutex_unlock(&proc->mm->lock);
+
+	return 0;
+}
+
+/*
+ * shm_detach - drop the area of a region attached to a segment
+ * @caller: caller, its mm is locked
+ * @rg    : region given by shmat
+ */
+int shm_detach(struct pcb_t *caller, struct vm_rg_struct *rg)
+{
+	/* Each attached PTE drops its segment reference on the way */
+	vm_unmap_area(caller, find_vma(caller->mm, rg->rg_start));
+	pg_stat_inc(PG_STAT_SHMDT);
+
+	return 0;
+}
+
+/*
+ * shm_getval - read a byte of a page attached to a segment
+ * @pte   : PTE of the attached page in the caller's page table
+ * @off   : offset in the page
+ * @data  : return the byte
+ * @caller: caller, its mm is locked
+ *
+ * The segment cannot go away while the caller has it attached
+ */
+int shm_getval(uint32_t pte, int off, BYTE *data, struct pcb_t *caller)
+{
+	struct mm_struct *mm = shm_segs[PAGING_PTE_SHMID(pte)].pcb.mm;
+	int ret;
+
+	pthread_mutex_lock(&mm->lock);
+	ret = pg_getval(mm, PAGING_PTE_SHMPGN(pte) * PAGING_PAGESZ + off, data, caller);
+	pthread_mutex_unlock(&mm->lock);
+
+	return ret;
+}
+
+/*
+ * shm_setval - write a byte of a page attached to a segment
+ * @pte   : PTE of the attached page in the caller's page table
+ * @off   : offset in the page
+ * @value : byte to write
+ * @caller: caller, its mm is locked
+ */
+int shm_setval(uint32_t pte, int off, BYTE value, struct pcb_t *caller)
+{
+	struct mm_struct *mm = shm_segs[PAGING_PTE_SHMID(pte)].pcb.mm;
+	int ret;
+
+	pthread_mutex_lock(&mm->lock);
+	ret = pg_setval(mm, PAGING_PTE_SHMPGN(pte) * PAGING_PAGESZ + off, value, caller);
+	pthread_mutex_unlock(&mm->lock);
+
+	return ret;
+}
+
+/*
+ * shm_dup - take one more reference for a copy of an attached PTE
+ * @pte: attached PTE, copied by fork
+ */
+void shm_dup(uint32_t pte)
+{
+	pthread_mutex_lock(&shm_lock);
+	shm_segs[PAGING_PTE_SHMID(pte)].nmaps++;
+	shm_maps++;
+	pthread_mutex_unlock(&shm_lock);
+}
+
+/*
+ * shm_put - drop the reference of an attached PTE
+ * @pte: attached PTE going away
+ */
+void shm_put(uint32_t pte)
+{
+	pthread_mutex_lock(&shm_lock);
+	shm_maps--;
+	shm_unref(&shm_segs[PAGING_PTE_SHMID(pte)]);
+	pthread_mutex_unlock(&shm_lock);
+}
+
+/*
+ * shm_exit - drop the references of an exiting process on the segments
+ * it created, those nobody attached go away with it
+ * @mm: its address space
+ */
+void shm_exit(struct mm_struct *mm)
+{
+	int i;
+
+	pthread_mutex_lock(&shm_lock);
+	for (i = 0; i < SHM_MAX_SEGS; i++)
+		if (shm_segs[i].used && shm_segs[i].creator == mm)
+		{
+			shm_segs[i].creator = NULL;
+			shm_unref(&shm_segs[i]);
+		}
+	pthread_mutex_unlock(&shm_lock);
+}
+
+/*
+ * shm_report - print the pages held in shared memory segments
+ */
+void shm_report(void)
+{
+	printf("Shared memory: %d pages at peak, %d now in segments attached by %d process pages\n",
+		   shm_pages_peak, shm_pages, shm_maps);
+}
+
+// #endif
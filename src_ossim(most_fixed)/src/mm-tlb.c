@@ -0,0 +1,177 @@
+// #ifdef MM_PAGING
+/*
+ * PAGING based Memory Management
+ * Software TLB mm/mm-tlb.c
+ */
+
+#include "mm.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#ifdef MM_TLB
+
+static struct tlb_struct *tlb_cpus;
+static int tlb_ncpu;
+
+/* TLB of the CPU the calling thread simulates, NULL outside CPU threads */
+static __thread struct tlb_struct *tlb_cur;
+
+/* Spread the same page of different processes over different sets */
+#define TLB_SET(pid, pgn) ((((uint32_t)(pgn)) ^ ((pid) * 7)) % TLB_SETS)
+
+/*
+ * tlb_init - create one empty TLB per CPU
+ * @ncpu: number of CPUs
+ */
+int tlb_init(int ncpu)
+{
+	tlb_cpus = calloc(ncpu, sizeof(struct tlb_struct));
+	if (tlb_cpus == NULL)
+		return -1;
+
+	tlb_ncpu = ncpu;
+	for (int cpu = 0; cpu < ncpu; cpu++)
+		pthread_mutex_init(&tlb_cpus[cpu].lock, NULL);
+	return 0;
+}
+
+/*
+ * tlb_bind_cpu - make the calling thread use the TLB of CPU @id
+ */
+void tlb_bind_cpu(int id)
+{
+	tlb_cur = &tlb_cpus[id];
+}
+
+/*
+ * tlb_lookup - translate a page of a process through the current TLB
+ * @pid : address space tag
+ * @pgn : page number
+ * @fpn : return frame number on hit
+ *
+ * Return 0 on hit, -1 on miss
+ */
+int tlb_lookup(uint32_t pid, int pgn, int *fpn)
+{
+	struct tlb_struct *tlb = tlb_cur;
+	struct tlb_entry *set;
+	int way;
+
+	if (tlb == NULL)
+		return -1;
+
+	pthread_mutex_lock(&tlb->lock);
+	set = tlb->ent[TLB_SET(pid, pgn)];
+	for (way = 0; way < TLB_WAYS; way++)
+		if (set[way].valid && set[way].pid == pid && set[way].pgn == pgn)
+		{
+			set[way].used = ++tlb->tick;
+			*fpn = set[way].fpn;
+			tlb->hits++;
+			pthread_mutex_unlock(&tlb->lock);
+			return 0;
+		}
+
+	tlb->misses++;
+	pthread_mutex_unlock(&tlb->lock);
+	return -1;
+}
+
+/*
+ * tlb_insert - cache a translation in the current TLB, replacing the
+ * least recently used way of its set
+ */
+void tlb_insert(uint32_t pid, int pgn, int fpn)
+{
+	struct tlb_struct *tlb = tlb_cur;
+	struct tlb_entry *set, *victim;
+	int way;
+
+	if (tlb == NULL)
+		return;
+
+	pthread_mutex_lock(&tlb->lock);
+	set = tlb->ent[TLB_SET(pid, pgn)];
+	victim = &set[0];
+	for (way = 0; way < TLB_WAYS; way++)
+	{
+		if (!set[way].valid)
+		{
+			victim = &set[way];
+			break;
+		}
+		if (set[way].used < victim->used)
+			victim = &set[way];
+	}
+
+	victim->valid = 1;
+	victim->pid = pid;
+	victim->pgn = pgn;
+	victim->fpn = fpn;
+	victim->used = ++tlb->tick;
+	pthread_mutex_unlock(&tlb->lock);
+}
+
+/*
+ * tlb_flush_page - drop a translation from every CPU, the process may
+ * have run on any of them
+ */
+void tlb_flush_page(uint32_t pid, int pgn)
+{
+	int cpu, way;
+
+	for (cpu = 0; cpu < tlb_ncpu; cpu++)
+	{
+		struct tlb_entry *set = tlb_cpus[cpu].ent[TLB_SET(pid, pgn)];
+		pthread_mutex_lock(&tlb_cpus[cpu].lock);
+		for (way = 0; way < TLB_WAYS; way++)
+			if (set[way].valid && set[way].pid == pid && set[way].pgn == pgn)
+				set[way].valid = 0;
+		pthread_mutex_unlock(&tlb_cpus[cpu].lock);
+	}
+}
+
+/*
+ * tlb_flush_pid - drop every translation of an address space
+ */
+void tlb_flush_pid(uint32_t pid)
+{
+	int cpu, set, way;
+
+	for (cpu = 0; cpu < tlb_ncpu; cpu++)
+	{
+		pthread_mutex_lock(&tlb_cpus[cpu].lock);
+		for (set = 0; set < TLB_SETS; set++)
+			for (way = 0; way < TLB_WAYS; way++)
+				if (tlb_cpus[cpu].ent[set][way].pid == pid)
+					tlb_cpus[cpu].ent[set][way].valid = 0;
+		pthread_mutex_unlock(&tlb_cpus[cpu].lock);
+	}
+}
+
+/*
+ * tlb_report - print hit and miss rates of every CPU
+ */
+void tlb_report(void)
+{
+	unsigned long hits = 0, misses = 0;
+	int cpu;
+
+	for (cpu = 0; cpu < tlb_ncpu; cpu++)
+	{
+		struct tlb_struct *tlb = &tlb_cpus[cpu];
+		unsigned long total = tlb->hits + tlb->misses;
+
+		printf("TLB CPU %d: %lu hits %lu misses (hit rate %.2f%%)\n", cpu,
+			   tlb->hits, tlb->misses, total ? 100.0 * tlb->hits / total : 0.0);
+		hits += tlb->hits;
+		misses += tlb->misses;
+	}
+	printf("TLB total: %lu hits %lu misses (hit rate %.2f%%)\n", hits, misses,
+		   (hits + misses) ? 100.0 * hits / (hits + misses) : 0.0);
+}
+
+#endif
+
+// #endif
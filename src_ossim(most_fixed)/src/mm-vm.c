@@ -9,30 +9,221 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#ifdef IODUMP
+/* Keeps the dump of one access from interleaving with another one */
+static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/*
+ * Free regions
+ * A free region is on the list of its size class and in the boundary
+ * tag buckets of its two ends, so that a freed region finds its free
+ * neighbours without walking the lists and is merged with them
+ */
+#define VM_FREERG_TAG(addr) (((uint32_t)(addr) * 2654435761U) >> (32 - VM_FREERG_TAG_BITS))
+
+static int freerg_class(unsigned long size)
+{
+	int c = 0;
+
+	while (c < VM_FREERG_NCLASS - 1 && size >= (2UL << c))
+		c++;
+	return c;
+}
+
+static void freerg_insert(struct vm_area_struct *vma, struct vm_rg_struct *rg)
+{
+	int c = freerg_class(rg->rg_end - rg->rg_start);
+	struct vm_rg_struct **stag = &vma->vm_freerg_start[VM_FREERG_TAG(rg->rg_start)];
+	struct vm_rg_struct **etag = &vma->vm_freerg_end[VM_FREERG_TAG(rg->rg_end)];
+
+	rg->rg_prev = NULL;
+	rg->rg_next = vma->vm_freerg_list[c];
+	if (rg->rg_next != NULL)
+		rg->rg_next->rg_prev = rg;
+	vma->vm_freerg_list[c] = rg;
+	vma->vm_freerg_map |= 1U << c;
+
+	rg->rg_snext = *stag;
+	*stag = rg;
+	rg->rg_enext = *etag;
+	*etag = rg;
+
+	vma->vm_freerg_bytes += rg->rg_end - rg->rg_start;
+}
+
+static void freerg_remove(struct vm_area_struct *vma, struct vm_rg_struct *rg)
+{
+	int c = freerg_class(rg->rg_end - rg->rg_start);
+	struct vm_rg_struct **it;
+
+	if (rg->rg_prev != NULL)
+		rg->rg_prev->rg_next = rg->rg_next;
+	else
+		vma->vm_freerg_list[c] = rg->rg_next;
+	if (rg->rg_next != NULL)
+		rg->rg_next->rg_prev = rg->rg_prev;
+	if (vma->vm_freerg_list[c] == NULL)
+		vma->vm_freerg_map &= ~(1U << c);
+
+	for (it = &vma->vm_freerg_start[VM_FREERG_TAG(rg->rg_start)]; *it != rg; it = &(*it)->rg_snext)
+		;
+	*it = rg->rg_snext;
+	for (it = &vma->vm_freerg_end[VM_FREERG_TAG(rg->rg_end)]; *it != rg; it = &(*it)->rg_enext)
+		;
+	*it = rg->rg_enext;
+
+	vma->vm_freerg_bytes -= rg->rg_end - rg->rg_start;
+}
+
+/* The free region ending at @addr, NULL if there is none */
+static struct vm_rg_struct *freerg_ending_at(struct vm_area_struct *vma, unsigned long addr)
+{
+	struct vm_rg_struct *rg = vma->vm_freerg_end[VM_FREERG_TAG(addr)];
+
+	while (rg != NULL && rg->rg_end != addr)
+		rg = rg->rg_enext;
+	return rg;
+}
+
+/* The free region starting at @addr, NULL if there is none */
+static struct vm_rg_struct *freerg_starting_at(struct vm_area_struct *vma, unsigned long addr)
+{
+	struct vm_rg_struct *rg = vma->vm_freerg_start[VM_FREERG_TAG(addr)];
+
+	while (rg != NULL && rg->rg_start != addr)
+		rg = rg->rg_snext;
+	return rg;
+}
+
 /*enlist_vm_freerg_list - add new rg to freerg_list
- *@mm: memory region
+ *@vma: vm area the region belongs to
  *@rg_elmt: new region
  *
+ * The region is merged with the free regions around it, and given back
+ * to the area if it ends at the break (starts at it, on the stack): the
+ * pages stay mapped and the next allocations take them again. Return -1
+ * if a node is needed and none is left, nothing is changed then
  */
-int enlist_vm_freerg_list(struct mm_struct *mm, struct vm_rg_struct rg_elmt)
+int enlist_vm_freerg_list(struct vm_area_struct *vma, struct vm_rg_struct rg_elmt)
 {
-	struct vm_rg_struct *rg_node = mm->mmap->vm_freerg_list;
-	struct vm_rg_struct *new_rg = malloc(sizeof(struct vm_rg_struct));
+	struct mm_struct *mm = vma->vm_mm;
+	struct vm_rg_struct *nb;
 
 	if (rg_elmt.rg_start >= rg_elmt.rg_end)
 		return -1;
-	rg_elmt.rg_next = rg_node;
 
-	new_rg->rg_start = rg_elmt.rg_start;
-	new_rg->rg_end = rg_elmt.rg_end;
-	new_rg->rg_next = rg_elmt.rg_next;
+	if ((nb = freerg_ending_at(vma, rg_elmt.rg_start)) != NULL)
+	{
+		freerg_remove(vma, nb);
+		rg_elmt.rg_start = nb->rg_start;
+		mm_node_free(mm, MM_NODE_RG, nb);
+		pg_stat_inc(PG_STAT_RGMERGE);
+	}
+	if ((nb = freerg_starting_at(vma, rg_elmt.rg_end)) != NULL)
+	{
+		freerg_remove(vma, nb);
+		rg_elmt.rg_end = nb->rg_end;
+		mm_node_free(mm, MM_NODE_RG, nb);
+		pg_stat_inc(PG_STAT_RGMERGE);
+	}
 
-	/* Enlist the new region */
-	mm->mmap->vm_freerg_list = new_rg;
+	if ((vma->vm_flags & VM_GROWSDOWN) ? rg_elmt.rg_start == vma->sbrk : rg_elmt.rg_end == vma->sbrk)
+	{
+		vma->sbrk = (vma->vm_flags & VM_GROWSDOWN) ? rg_elmt.rg_end : rg_elmt.rg_start;
+		pg_stat_inc(PG_STAT_RGTRIM);
+		return 0;
+	}
 
+	if ((nb = init_vm_rg(mm, rg_elmt.rg_start, rg_elmt.rg_end)) == NULL)
+		return -1;
+	freerg_insert(vma, nb);
 	return 0;
 }
 
+/*
+ * VMA index
+ * mm->mmap holds the VMAs by start address and mm->mmap_byid the same
+ * ones by id, so that finding one either way is a bisection. Ties on
+ * vm_start only happen with an empty heap or stack, which comes first
+ */
+
+/* Number of VMAs starting at or below @addr */
+static int vma_addr_upper(struct mm_struct *mm, unsigned long addr)
+{
+	int lo = 0, hi = mm->map_count, mid;
+
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if (mm->mmap[mid]->vm_start <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Number of VMAs whose id is below @id */
+static int vma_id_lower(struct mm_struct *mm, unsigned long id)
+{
+	int lo = 0, hi = mm->map_count, mid;
+
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if (mm->mmap_byid[mid]->vm_id < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*vma_insert - index a new VMA
+ *@mm: memory region
+ *@vma: new VMA, not overlapping any other
+ *
+ * Return -1 if @mm has VM_MAX_AREAS already
+ */
+int vma_insert(struct mm_struct *mm, struct vm_area_struct *vma)
+{
+	int i;
+
+	if (mm->map_count == VM_MAX_AREAS)
+		return -1;
+
+	i = vma_addr_upper(mm, vma->vm_start);
+	memmove(&mm->mmap[i + 1], &mm->mmap[i], (mm->map_count - i) * sizeof(mm->mmap[0]));
+	mm->mmap[i] = vma;
+
+	i = vma_id_lower(mm, vma->vm_id);
+	memmove(&mm->mmap_byid[i + 1], &mm->mmap_byid[i], (mm->map_count - i) * sizeof(mm->mmap_byid[0]));
+	mm->mmap_byid[i] = vma;
+
+	mm->map_count++;
+	return 0;
+}
+
+/*vma_remove - drop a VMA from the index
+ *@mm: memory region
+ *@vma: indexed VMA
+ *
+ */
+void vma_remove(struct mm_struct *mm, struct vm_area_struct *vma)
+{
+	int i;
+
+	for (i = vma_addr_upper(mm, vma->vm_start) - 1; mm->mmap[i] != vma; i--)
+		;
+	memmove(&mm->mmap[i], &mm->mmap[i + 1], (mm->map_count - i - 1) * sizeof(mm->mmap[0]));
+
+	i = vma_id_lower(mm, vma->vm_id);
+	memmove(&mm->mmap_byid[i], &mm->mmap_byid[i + 1], (mm->map_count - i - 1) * sizeof(mm->mmap_byid[0]));
+
+	mm->map_count--;
+}
+
 /*get_vma_by_num - get vm area by numID
  *@mm: memory region
  *@vmaid: ID vm area to alloc memory region
@@ -40,23 +231,55 @@ int enlist_vm_freerg_list(struct mm_struct *mm, struct vm_rg_struct rg_elmt)
  */
 struct vm_area_struct *get_vma_by_num(struct mm_struct *mm, int vmaid)
 {
-	struct vm_area_struct *pvma = mm->mmap;
+	int i;
 
-	if (mm->mmap == NULL)
+	if (vmaid < 0)
 		return NULL;
 
-	int vmait = 0;
+	i = vma_id_lower(mm, vmaid);
+	if (i == mm->map_count || mm->mmap_byid[i]->vm_id != vmaid)
+		return NULL;
 
-	while (vmait < vmaid)
-	{
-		if (pvma == NULL)
-			return NULL;
+	return mm->mmap_byid[i];
+}
+
+/*find_vma - get the vm area an address belongs to
+ *@mm: memory region
+ *@addr: virtual address
+ *
+ */
+struct vm_area_struct *find_vma(struct mm_struct *mm, unsigned long addr)
+{
+	int i = vma_addr_upper(mm, addr) - 1;
 
-		pvma = pvma->vm_next;
-		++vmait;
+	if (i < 0 || addr >= mm->mmap[i]->vm_end)
+		return NULL;
+
+	return mm->mmap[i];
+}
+
+/*get_unmapped_area - find room for a new mapped area
+ *@mm: memory region
+ *@len: page aligned size
+ *
+ * The highest gap below PAGING_MMAP_BASE that fits, and below the stack
+ * if it grew past there. Return its start, -1 if there is none
+ */
+int get_unmapped_area(struct mm_struct *mm, int len)
+{
+	unsigned long end = PAGING_MMAP_BASE;
+	struct vm_area_struct *vma;
+	int i;
+
+	for (i = vma_addr_upper(mm, end - 1) - 1; i >= 0; i--)
+	{
+		vma = mm->mmap[i];
+		if (vma->vm_end <= end && end - vma->vm_end >= len)
+			break;
+		end = vma->vm_start;
 	}
 
-	return pvma;
+	return (end >= len) ? end - len : -1;
 }
 
 /*get_symrg_byid - get mem region by region ID
@@ -86,7 +309,7 @@ int __alloc(struct pcb_t *caller, int vmaid, int rgid, int size, int *alloc_addr
 	if (caller->mm->symrgtbl[rgid].rg_start < caller->mm->symrgtbl[rgid].rg_end)
 		pgfree_data(caller, rgid); // free region if there are some data in it
 
-	pthread_mutex_lock(&mem_lock);
+	pthread_mutex_lock(&caller->mm->lock);
 	struct vm_rg_struct rgnode;
 
 	if (get_free_vmrg_area(caller, vmaid, size, &rgnode) == 0)
@@ -95,8 +318,9 @@ int __alloc(struct pcb_t *caller, int vmaid, int rgid, int size, int *alloc_addr
 		caller->mm->symrgtbl[rgid].rg_end = rgnode.rg_end;
 
 		*alloc_addr = rgnode.rg_start;
+		pg_stat_inc(PG_STAT_RGREUSE);
 
-		pthread_mutex_unlock(&mem_lock);
+		pthread_mutex_unlock(&caller->mm->lock);
 		return 0;
 	}
 
@@ -106,56 +330,105 @@ int __alloc(struct pcb_t *caller, int vmaid, int rgid, int size, int *alloc_addr
 	struct vm_area_struct *cur_vma = get_vma_by_num(caller->mm, vmaid);
 	int inc_sz = PAGING_PAGE_ALIGNSZ(size);
 	// int inc_limit_ret
-	int old_sbrk = cur_vma->sbrk;
-	int new_sbrk = old_sbrk + size;
+	int old_sbrk, new_sbrk, down;
+
+	/* Mapped areas are sized once by mmap or shmat */
+	if (cur_vma == NULL || (cur_vma->vm_flags & VM_MAPPING))
+	{
+		pthread_mutex_unlock(&caller->mm->lock);
+		return -1;
+	}
+
+	/* The stack gives the bytes right below its break */
+	down = cur_vma->vm_flags & VM_GROWSDOWN;
+	old_sbrk = cur_vma->sbrk;
+	new_sbrk = down ? old_sbrk - size : old_sbrk + size;
 
 	/* TODO IMPLEMENTED: increase the limit
 	 * inc_vma_limit(caller, vmaid, inc_sz)
 	 */
-	if (new_sbrk > cur_vma->vm_end)
+	if (down ? new_sbrk < (int)cur_vma->vm_start : new_sbrk > cur_vma->vm_end)
+	{
 		if (inc_vma_limit(caller, vmaid, inc_sz) < 0)
 		{
-			pthread_mutex_unlock(&mem_lock);
+			pthread_mutex_unlock(&caller->mm->lock);
 			return -1; // Fail to increase limit
 		}
+		pg_stat_inc(PG_STAT_RGGROW);
+	}
+
+	pg_stat_inc(PG_STAT_RGBRK);
+	/* Enough free bytes, but no free region large enough */
+	if (cur_vma->vm_freerg_bytes >= size)
+		pg_stat_inc(PG_STAT_RGFRAG);
 
 	/*Successful increase limit */
 	cur_vma->sbrk = new_sbrk;
-	caller->mm->symrgtbl[rgid].rg_start = old_sbrk;
-	caller->mm->symrgtbl[rgid].rg_end = new_sbrk;
-
-	*alloc_addr = old_sbrk;
+	*alloc_addr = down ? new_sbrk : old_sbrk;
+	caller->mm->symrgtbl[rgid].rg_start = *alloc_addr;
+	caller->mm->symrgtbl[rgid].rg_end = *alloc_addr + size;
 
-	pthread_mutex_unlock(&mem_lock);
+	pthread_mutex_unlock(&caller->mm->lock);
 	return 0;
 }
 
 /*__free - remove a region memory
  *@caller: caller
- *@vmaid: ID vm area to alloc memory region
+ *@vmaid: ID vm area of the region, -1 for whichever it is in
  *@rgid: memory region ID (used to identify variable in symbole table)
  *@size: allocated size
  *
+ * A region of the heap or the stack goes to the free regions of its
+ * area, a region given by mmap or shmat takes its whole area away
  */
 int __free(struct pcb_t *caller, int vmaid, int rgid)
 {
 	struct vm_rg_struct *rgnode;
+	struct vm_area_struct *vma;
 
 	if (rgid < 0 || rgid >= PAGING_MAX_SYMTBL_SZ)
 		return -1;
 
-	pthread_mutex_lock(&mem_lock);
+	pthread_mutex_lock(&caller->mm->lock);
 
 	/* TODO IMPLEMENTED: Manage the collect freed region to freerg_list */
 	rgnode = get_symrg_byid(caller->mm, rgid);
+	if (rgnode->rg_start >= rgnode->rg_end)
+	{ /* Nothing allocated there */
+		pthread_mutex_unlock(&caller->mm->lock);
+		return 0;
+	}
 
-	/* Enlist the obsoleted memory region */
-	enlist_vm_freerg_list(caller->mm, *rgnode);
+	vma = find_vma(caller->mm, rgnode->rg_start);
+	if (vma == NULL || (vmaid >= 0 && vma->vm_id != vmaid))
+	{
+		pthread_mutex_unlock(&caller->mm->lock);
+		return -1;
+	}
+
+	/* Enlist the obsoleted memory region, a shared memory one is
+	 * detached from its segment instead. Without a node to enlist it
+	 * the register keeps it */
+	if (!(vma->vm_flags & VM_MAPPING))
+	{
+		if (enlist_vm_freerg_list(vma, *rgnode) < 0)
+		{
+			pthread_mutex_unlock(&caller->mm->lock);
+			return -1;
+		}
+	}
+	else if (pte_get(caller->mm, PAGING_PGN(rgnode->rg_start)) & PAGING_PTE_SHM_MASK)
+		shm_detach(caller, rgnode);
+	else
+	{
+		vm_unmap_area(caller, vma);
+		pg_stat_inc(PG_STAT_MUNMAP);
+	}
 
 	rgnode->rg_start = rgnode->rg_end = 0;
 	rgnode->rg_next = NULL;
 
-	pthread_mutex_unlock(&mem_lock);
+	pthread_mutex_unlock(&caller->mm->lock);
 	return 0;
 }
 
@@ -168,8 +441,23 @@ int pgalloc(struct pcb_t *proc, uint32_t size, uint32_t reg_index)
 {
 	int addr;
 
-	/* By default using vmaid = 0 */
-	return __alloc(proc, 0, reg_index, size, &addr);
+	return __alloc(proc, VMA_HEAP, reg_index, size, &addr);
+}
+
+/*pgalloca - PAGING-based allocate a region memory on the stack
+ *@proc:  Process executing the instruction
+ *@size: allocated size
+ *@reg_index: memory region ID (used to identify variable in symbole table)
+ */
+int pgalloca(struct pcb_t *proc, uint32_t size, uint32_t reg_index)
+{
+	int addr;
+
+	if (__alloc(proc, VMA_STACK, reg_index, size, &addr) < 0)
+		return -1;
+
+	pg_stat_inc(PG_STAT_ALLOCA);
+	return 0;
 }
 
 /*pgfree - PAGING-based free a region memory
@@ -180,86 +468,589 @@ int pgalloc(struct pcb_t *proc, uint32_t size, uint32_t reg_index)
 
 int pgfree_data(struct pcb_t *proc, uint32_t reg_index)
 {
-	return __free(proc, 0, reg_index);
+	return __free(proc, -1, reg_index);
 }
 
-/*pg_getpage - get the page in ram
- *@mm: memory region
- *@pagenum: PGN
- *@framenum: return FPN
- *@caller: caller
+/*pgmmap - PAGING-based map an anonymous area
+ *@proc: Process executing the instruction
+ *@size: size in bytes
+ *@reg_index: memory region ID (used to identify variable in symbole table)
  *
+ * The area gets pages of its own, apart from the heap and the stack,
+ * and goes away as a whole with munmap or free of the region
  */
-int pg_getpage(struct mm_struct *mm, int pgn, int *fpn, struct pcb_t *caller)
+int pgmmap(struct pcb_t *proc, uint32_t size, uint32_t reg_index)
 {
-	uint32_t pte = mm->pgd[pgn];
+	struct mm_struct *mm = proc->mm;
+	struct vm_rg_struct *rg = get_symrg_byid(mm, reg_index);
+	struct vm_area_struct *vma = NULL;
+	struct vm_rg_struct ret_rg;
+	int len = PAGING_PAGE_ALIGNSZ(size), start;
 
-	if (!PAGING_PAGE_PRESENT(pte))
-	{ /* Page is not online, make it actively living */
-		// int vicfpn;
-		// uint32_t vicpte;
+	if (rg == NULL || size == 0 || len > PAGING_MMAP_BASE)
+		return -1;
+
+	/* Like alloc, whatever the register held is released first */
+	if (rg->rg_start < rg->rg_end)
+		pgfree_data(proc, reg_index);
+
+	pthread_mutex_lock(&mm->lock);
+	if ((start = get_unmapped_area(mm, len)) >= 0 &&
+		(vma = init_vma(mm, mm->vm_next_id, start, VM_MAPPING)) != NULL)
+	{
+		vma->vm_end = vma->sbrk = start + len;
+		if (vm_map_ram(proc, start, start + len, start, len / PAGING_PAGESZ, &ret_rg) < 0)
+		{
+			vma_remove(mm, vma);
+			mm_node_free(mm, MM_NODE_VMA, vma);
+			vma = NULL;
+		}
+	}
+	if (vma == NULL)
+	{
+		pthread_mutex_unlock(&mm->lock);
+#ifdef MMDBG
+		printf("//////// Can't execute 'mmap size=%d region=%d'\n", size, reg_index);
+#endif
+		return -1;
+	}
 
-		// int tgtfpn = PAGING_SWP(pte); // the target frame storing our variable
+	mm->vm_next_id++;
+	rg->rg_start = start;
+	rg->rg_end = start + size;
+	pthread_mutex_unlock(&mm->lock);
 
-		/* TODO IMPLEMENTED: Play with your paging theory here */
+	pg_stat_inc(PG_STAT_MMAP);
+	return 0;
+}
 
-		/* Find victim page */
-		int vicpgn;
-		if (find_victim_page(caller->mm, &vicpgn) < 0)
-			return -1;		  // There's no available page in page table
-		while (vicpgn == pgn) // In case the page is not usuable
-			if (find_victim_page(caller->mm, &vicpgn) < 0)
-				return -1;
+/*pgmunmap - PAGING-based unmap the area of a region given by mmap
+ *@proc: Process executing the instruction
+ *@reg_index: memory region ID (used to identify variable in symbole table)
+ */
+int pgmunmap(struct pcb_t *proc, uint32_t reg_index)
+{
+	struct vm_rg_struct *rg = get_symrg_byid(proc->mm, reg_index);
+	struct vm_area_struct *vma = NULL;
+
+	if (rg == NULL)
+		return -1;
+
+	pthread_mutex_lock(&proc->mm->lock);
+	if (rg->rg_start < rg->rg_end)
+		vma = find_vma(proc->mm, rg->rg_start);
+	pthread_mutex_unlock(&proc->mm->lock);
+
+	if (vma == NULL || !(vma->vm_flags & VM_MAPPING))
+	{
+#ifdef MMDBG
+		printf("//////// Can't execute 'munmap region=%d'\n", reg_index);
+		printf("//////// since region %d of process %d is not a mapped area\n", reg_index, proc->pid);
+#endif
+		return -1;
+	}
+
+	return __free(proc, vma->vm_id, reg_index);
+}
+
+/*vm_unmap_area - drop a mapped area and every page of it
+ *@caller: caller, its mm locked
+ *@vma: area given by mmap or shmat
+ *
+ */
+void vm_unmap_area(struct pcb_t *caller, struct vm_area_struct *vma)
+{
+	int pgn = vma->vm_start / PAGING_PAGESZ;
+	int endpgn = vma->vm_end / PAGING_PAGESZ;
 
-		int tgtfpn = PAGING_SWPOFF(pte); // target swap offset
-		int tgttyp = PAGING_SWPTYP(pte); // target swap type
+	free_pte_range(caller, pgn, endpgn);
+#ifdef MM_TLB
+	for (; pgn < endpgn; pgn++)
+		tlb_flush_page(caller->pid, pgn);
+#endif
 
-		/* Get swap type where victim frame goes to */
+	vma_remove(caller->mm, vma);
+	mm_node_free(caller->mm, MM_NODE_VMA, vma);
+}
 
-		int swptyp = tgttyp;
-		int swpfpn;
-		if (caller->mswp[swptyp]->maxsz <= 0)
+/*swap_slot_dup - give the child of a fork its own copy of a swapped page
+ *@caller: caller
+ *@swptyp: swap type of the page
+ *@swpoff: swap offset of the page
+ *@ntyp: return swap type of the copy
+ *@noff: return swap offset of the copy
+ *
+ * Swap slots are never shared, a page in the zswap pool is copied there
+ * still compressed if the pool has room for it
+ */
+static int swap_slot_dup(struct pcb_t *caller, int swptyp, int swpoff, int *ntyp, int *noff)
+{
+	BYTE buf[PAGING_PAGESZ];
+
+	if (swptyp == ZSWAP_SWPTYP)
+	{
+		if (zswap_dup(swpoff, noff) == 0)
+		{
+			*ntyp = ZSWAP_SWPTYP;
+			return 0;
+		}
+		if (zswap_load(swpoff, buf) < 0)
 			return -1;
+	}
+	else if (MEMPHY_read_page(caller->mswp[swptyp], swpoff, buf) < 0)
+		return -1;
 
-		if (MEMPHY_get_freefp(caller->mswp[swptyp], &swpfpn) < 0 || swpfpn == tgtfpn)
-			for (swptyp = 0; swptyp < PAGING_MAX_MMSWP; ++swptyp)
-			{
-				if (swptyp == tgttyp || caller->mswp[swptyp]->maxsz <= 0)
-					continue;
+	if (get_swap_slot(caller, ntyp, noff) < 0)
+		return -1;
+	return MEMPHY_write_page(caller->mswp[*ntyp], *noff, buf);
+}
 
-				if (MEMPHY_get_freefp(caller->mswp[swptyp], &swpfpn) == 0)
+/*pg_split_huge - turn a huge page into base pages
+ *@mm: owner, locked
+ *@pgn: any page of it
+ *
+ * The frames stay where they are. Its first page is already known to
+ * the replacement policy, the others online are handed to it now
+ */
+static void pg_split_huge(struct mm_struct *mm, int pgn)
+{
+	int head = PAGING_HPAGE_HEAD(pgn), i;
+	uint32_t *pte;
+
+	for (i = 0; i < PAGING_HPAGE_NR; i++)
+	{
+		pte = pte_ptr(mm, head + i);
+		CLRBIT(*pte, PAGING_PTE_HUGE_MASK);
+		if (i > 0 && PAGING_PAGE_ONLINE(*pte))
+			enlist_pgn_node(mm, head + i);
+	}
+	pg_stat_inc(PG_STAT_HUGESPLIT);
+}
+
+/*pgfork - PAGING-based duplicate the address space of a process
+ *@proc: Process executing the instruction
+ *@child: new process cloned from proc, without address space yet
+ *
+ * Online pages are not copied: both page tables map the same frame
+ * copy-on-write until either side writes the page. Swapped pages get a
+ * swap copy of their own, shared memory is attached to the child too.
+ * Huge pages are split first, copy-on-write works on base pages
+ */
+int pgfork(struct pcb_t *proc, struct pcb_t *child)
+{
+	struct mm_struct *mm = proc->mm;
+	struct mm_struct *cmm = malloc(sizeof(struct mm_struct));
+	struct vm_area_struct *vma, *cvma;
+	struct vm_rg_struct *rg, *crg;
+	uint32_t pte, *ppte, *cpte;
+	int pgn, typ, off, c, i, err = 0;
+
+	if (cmm == NULL)
+		return -1;
+	child->mm = cmm;
+	if (init_mm(cmm, child) < 0)
+	{
+		free_pcb_mm(child);
+		return -1;
+	}
+
+	pthread_mutex_lock(&mm->lock);
+
+	/* Same layout: VMAs with their free regions, and symbol table */
+	while (cmm->map_count > 0)
+	{
+		vma = cmm->mmap[0];
+		vma_remove(cmm, vma);
+		mm_node_free(cmm, MM_NODE_VMA, vma);
+	}
+	for (i = 0; i < mm->map_count && err == 0; i++)
+	{
+		vma = mm->mmap[i];
+		if ((cvma = mm_node_alloc(cmm, MM_NODE_VMA)) == NULL)
+		{
+			err = -1;
+			break;
+		}
+		*cvma = *vma;
+		cvma->vm_mm = cmm;
+		cvma->ra_next = -1;
+		cvma->ra_win = cvma->ra_issued = cvma->ra_hits = 0;
+
+		init_vm_freerg(cvma);
+		for (c = 0; c < VM_FREERG_NCLASS && err == 0; c++)
+			for (rg = vma->vm_freerg_list[c]; rg != NULL; rg = rg->rg_next)
+			{
+				if ((crg = init_vm_rg(cmm, rg->rg_start, rg->rg_end)) == NULL)
+				{
+					err = -1;
 					break;
-				else
-					swpfpn = -1;
+				}
+				freerg_insert(cvma, crg);
 			}
+		vma_insert(cmm, cvma);
+	}
+	cmm->vm_next_id = mm->vm_next_id;
+	memcpy(cmm->symrgtbl, mm->symrgtbl, sizeof(cmm->symrgtbl));
+	cmm->rss_limit = mm->rss_limit;
+	cmm->swap_limit = mm->swap_limit;
+
+	for (pgn = 0; err == 0 && (ppte = pte_next(mm, &pgn, PAGING_MAX_PGN)) != NULL; pgn++)
+	{
+		pte = *ppte;
+		if ((cpte = pte_ptr(cmm, pgn)) == NULL)
+		{
+			err = -1;
+			break;
+		}
+		if (pte & PAGING_PTE_SHM_MASK)
+		{ /* Attached shared memory stays attached in the child */
+			shm_dup(pte);
+			*cpte = pte;
+			continue;
+		}
+		if (!PAGING_PAGE_PRESENT(pte))
+			continue;
+		if (pte & PAGING_PTE_HUGE_MASK)
+			pg_split_huge(mm, pgn);
+
+		if (!PAGING_PAGE_SWAPPED(pte))
+		{
+			if (ksm_share(cmm, pgn, PAGING_PTE_FPN(pte)) < 0)
+			{
+				err = -1;
+				break;
+			}
+			SETBIT(*ppte, PAGING_PTE_COW_MASK);
+			*cpte = *ppte;
+			enlist_pgn_node(cmm, pgn);
+		}
+		else if (swap_slot_dup(proc, PAGING_SWPTYP(pte), PAGING_SWPOFF(pte), &typ, &off) == 0)
+		{
+			pte_set_swap(cpte, typ, off);
+			mm_charge_swap(cmm, 1);
+		}
+		else
+			err = -1;
+	}
+	pthread_mutex_unlock(&mm->lock);
+
+	if (err < 0)
+	{ /* Out of swap, nodes or page tables, undo what the child got so far */
+		free_pcb_mm(child);
+		return -1;
+	}
+
+	oom_register(cmm);
+	pg_stat_inc(PG_STAT_FORK);
+	return 0;
+}
+
+/*swap_load_page - copy a swap slot (or zswap entry) into a MEMRAM frame
+ *@caller: caller
+ *@swptyp: swap type
+ *@swpoff: swap offset
+ *@fpn: MEMRAM frame
+ *
+ */
+static void swap_load_page(struct pcb_t *caller, int swptyp, int swpoff, int fpn)
+{
+	if (swptyp == ZSWAP_SWPTYP)
+	{
+		BYTE buf[PAGING_PAGESZ];
+
+		zswap_load(swpoff, buf);
+		MEMPHY_write_page(caller->mram, fpn, buf);
+	}
+	else
+	{
+		__swap_cp_page(caller->mswp[swptyp], swpoff, caller->mram, fpn);
+		pg_stat_inc(PG_STAT_DEVLOAD);
+	}
+}
+
+/*swap_in_huge - bring a swapped huge page back online in one go
+ *@caller: caller
+ *@mm: memory region
+ *@pgn: any page of it
+ *
+ * Its slots are given back, a huge page is written whole when it goes
+ * out again. Without a free run of frames as many victims as it has
+ * pages are moved out to make one, and -1 is returned if that fails or
+ * would take @mm over its resident limit
+ */
+static int swap_in_huge(struct pcb_t *caller, struct mm_struct *mm, int pgn)
+{
+	int head = PAGING_HPAGE_HEAD(pgn), fpn, i;
+	uint32_t *pte;
+
+	if (!mm_rss_room(mm, PAGING_HPAGE_NR))
+		return -1;
+
+	for (i = 0; MEMPHY_get_freerun(caller->mram, PAGING_HPAGE_NR, &fpn) < 0; i++)
+	{
+		if (i == PAGING_HPAGE_NR || swap_out_victim(caller, &fpn) < 0)
+			return -1;
+		MEMPHY_put_freefp(caller->mram, fpn);
+	}
+
+	for (i = 0; i < PAGING_HPAGE_NR; i++)
+	{
+		pte = pte_ptr(mm, head + i);
+		swap_load_page(caller, PAGING_SWPTYP(*pte), PAGING_SWPOFF(*pte), fpn + i);
+		swap_slot_free(caller, PAGING_SWPTYP(*pte), PAGING_SWPOFF(*pte));
+		pte_set_fpn(pte, fpn + i);
+		MEMPHY_set_owner(caller->mram, fpn + i, mm, head + i);
+	}
+	mm_charge_swap(mm, -PAGING_HPAGE_NR);
+	enlist_pgn_node(mm, head);
+
+	pg_stat_inc(PG_STAT_HUGEFAULT);
+	return 0;
+}
+
+/*swap_in_page - bring a swapped page back online
+ *@caller: caller
+ *@mm: memory region
+ *@pgn: swapped page
+ *@fpn: free MEMRAM frame to put it in
+ *
+ */
+static void swap_in_page(struct pcb_t *caller, struct mm_struct *mm, int pgn, int fpn)
+{
+	uint32_t *pte = pte_ptr(mm, pgn);
+	int tgtfpn = PAGING_SWPOFF(*pte); // target swap offset
+	int tgttyp = PAGING_SWPTYP(*pte); // target swap type
+
+	/* Copy target frame from swap to mem, the slot keeps a copy
+	 * that saves writing the page back while it stays clean */
+	swap_load_page(caller, tgttyp, tgtfpn, fpn);
+
+	/* Update its online status of the target page */
+	pte_set_fpn(pte, fpn);
+	MEMPHY_set_owner(caller->mram, fpn, mm, pgn);
+	MEMPHY_set_swpcopy(caller->mram, fpn, tgttyp, tgtfpn);
+	mm_charge_swap(mm, -1);
+
+	enlist_pgn_node(mm, pgn);
+}
+
+#ifdef MM_SWAP_RA
+/*swap_readahead - bring in the swapped pages following a fault
+ *@caller: caller
+ *@mm: memory region
+ *@pgn: faulting page, already back online
+ *
+ * Only a fault on the page right after the ones last brought in counts
+ * as sequential. Readahead never evicts anything: it stops at the first
+ * page that would need a frame when none is free, or that would take
+ * @mm over its resident limit
+ */
+static void swap_readahead(struct pcb_t *caller, struct mm_struct *mm, int pgn)
+{
+	struct vm_area_struct *vma = find_vma(mm, pgn * PAGING_PAGESZ);
+	int endpgn, pgit, fpn;
+
+	if (vma == NULL)
+		return;
+
+	if (pgn != vma->ra_next)
+		vma->ra_win /= 2;
+	else if (vma->ra_win == 0)
+		vma->ra_win = SWAP_RA_MIN;
+	else if (2 * vma->ra_hits >= vma->ra_issued)
+		vma->ra_win = (2 * vma->ra_win < SWAP_RA_MAX) ? 2 * vma->ra_win : SWAP_RA_MAX;
+	else
+		vma->ra_win /= 2;
+
+	vma->ra_issued = vma->ra_hits = 0;
+	vma->ra_next = pgn + 1;
+	endpgn = DIV_ROUND_UP(vma->vm_end, PAGING_PAGESZ);
+
+	for (pgit = pgn + 1; pgit <= pgn + vma->ra_win && pgit < endpgn; pgit++)
+	{
+		uint32_t pte = pte_get(mm, pgit);
+
+		if (!PAGING_PAGE_PRESENT(pte) || (pte & PAGING_PTE_HUGE_MASK))
+			break;
+		if (PAGING_PAGE_SWAPPED(pte))
+		{
+			if (!mm_rss_room(mm, 1) || MEMPHY_get_freefp(caller->mram, &fpn) < 0)
+				break;
+			swap_in_page(caller, mm, pgit, fpn);
+			SETBIT(*pte_ptr(mm, pgit), PAGING_PTE_READAHEAD_MASK);
+			vma->ra_issued++;
+			pg_stat_inc(PG_STAT_RA);
+		}
+		vma->ra_next = pgit + 1;
+	}
+}
+
+/*swap_readahead_hit - account the first access to a page read ahead
+ *@mm: memory region
+ *@pgn: accessed page
+ *
+ */
+static void swap_readahead_hit(struct mm_struct *mm, int pgn)
+{
+	struct vm_area_struct *vma;
+	uint32_t *pte = pte_ptr(mm, pgn);
+
+	if (!(*pte & PAGING_PTE_READAHEAD_MASK))
+		return;
+
+	CLRBIT(*pte, PAGING_PTE_READAHEAD_MASK);
+	if ((vma = find_vma(mm, pgn * PAGING_PAGESZ)) != NULL)
+		vma->ra_hits++;
+	pg_stat_inc(PG_STAT_RAHIT);
+}
+#endif
+
+/*pg_demand_fault - give a page touched for the first time a frame
+ *@mm: memory region
+ *@pgn: page, its PTE is empty
+ *@caller: caller
+ *
+ * Only pages of a VMA are mapped. With same-page merging a page maps
+ * the zero frame and a write copies it, or it gets a zero filled frame
+ */
+static int pg_demand_fault(struct mm_struct *mm, int pgn, struct pcb_t *caller)
+{
+	BYTE zero[PAGING_PAGESZ];
+	uint32_t *pte;
+	int fpn;
+
+	if (find_vma(mm, pgn * PAGING_PAGESZ) == NULL || (pte = pte_ptr(mm, pgn)) == NULL)
+		return -1;
+
+	pg_stat_inc(PG_STAT_DEMAND);
+	if (ksm_enabled)
+		return ksm_map_zero(mm, pgn);
+
+	if (pg_get_frame(caller, mm, &fpn) < 0)
+		return -1;
+
+	memset(zero, 0, sizeof(zero));
+	MEMPHY_write_page(caller->mram, fpn, zero);
+	pte_set_fpn(pte, fpn);
+	MEMPHY_set_owner(caller->mram, fpn, mm, pgn);
+	enlist_pgn_node(mm, pgn);
+
+	return 0;
+}
+
+/*pg_getpage - get the page in ram
+ *@mm: memory region
+ *@pagenum: PGN
+ *@framenum: return FPN
+ *@caller: caller
+ *
+ */
+int pg_getpage(struct mm_struct *mm, int pgn, int *fpn, struct pcb_t *caller)
+{
+	/* A process killed out of memory has nothing left to access */
+	if (oom_killed(caller->mm))
+		return -1;
+
+#ifdef MM_TLB
+	/* Only the caller's own pages are cached, not those of a segment */
+	if (mm == caller->mm && tlb_lookup(caller->pid, pgn, fpn) == 0)
+		return 0;
+#endif
+
+	uint32_t pte = pte_get(mm, pgn);
 
-		if (swpfpn == -1)
+	/* Demand paging: the page was only reserved so far */
+	if (pte == 0 && pg_demand)
+	{
+		if (pg_demand_fault(mm, pgn, caller) < 0)
 			return -1;
+		pte = pte_get(mm, pgn);
+	}
 
-		/* Do swap frame from MEMRAM to MEMSWP and vice versa*/
+	if (!PAGING_PAGE_PRESENT(pte))
+		return -1; /* Page is not mapped */
 
-		/* Copy victim frame to swap */
-		int vicfpn = PAGING_FPN(mm->pgd[vicpgn]);
-		__swap_cp_page(caller->mram, vicfpn, caller->mswp[swptyp], swpfpn);
+	if (PAGING_PAGE_SWAPPED(pte))
+	{ /* Page is not online, make it actively living */
+		int newfpn;
 
-		/* Copy target frame from swap to mem */
-		__swap_cp_page(caller->mswp[tgttyp], tgtfpn, caller->mram, vicfpn);
+		pg_stat_inc(PG_STAT_FAULT);
+		psi_memstall_enter();
 
-		/* Update page table */
+		/* A huge page comes back whole, or as base pages if MEMRAM
+		 * has no run of frames left for it */
+		if ((pte & PAGING_PTE_HUGE_MASK) && swap_in_huge(caller, mm, pgn) == 0)
+			goto online;
+		if (pte & PAGING_PTE_HUGE_MASK)
+			pg_split_huge(mm, pgn);
 
-		// pte_set_swap() &mm->pgd[vicpgn];
-		pte_set_swap(&mm->pgd[vicpgn], swptyp, swpfpn);
+		/* Take a free frame, or the frame of a victim page moved out */
+		if (pg_get_frame(caller, mm, &newfpn) < 0)
+		{
+			psi_memstall_leave();
+			return -1;
+		}
 
-		/* Update its online status of the target page */
-		// pte_set_fpn() & mm->pgd[pgn];
-		pte_set_fpn(&mm->pgd[pgn], vicfpn);
+		swap_in_page(caller, mm, pgn, newfpn);
+#ifdef MM_SWAP_RA
+		swap_readahead(caller, mm, pgn);
+#endif
+online:
+		psi_memstall_leave();
+		pte = pte_get(mm, pgn);
+	}
 
-		enlist_pgn_node(&caller->mm->fifo_pgn, pgn);
-		pte = mm->pgd[pgn];
+	*fpn = PAGING_PTE_FPN(pte);
+#ifdef MM_TLB
+	if (mm == caller->mm)
+		tlb_insert(caller->pid, pgn, *fpn);
+#endif
+
+	return 0;
+}
+
+/*pg_cow_break - give a page mapping a shared frame its own frame
+ *@mm: memory region
+ *@pgn: page about to be written
+ *@fpn: return its new frame
+ *@caller: caller
+ *
+ * The last page mapping a shared frame takes it back without a copy
+ */
+static int pg_cow_break(struct mm_struct *mm, int pgn, int *fpn, struct pcb_t *caller)
+{
+	uint32_t *pte = pte_ptr(mm, pgn);
+	int oldfpn = PAGING_PTE_FPN(*pte), newfpn;
+
+	if (ksm_unshare(mm, pgn, oldfpn) == 0)
+		newfpn = oldfpn;
+	else
+	{
+		if (pg_get_frame(caller, mm, &newfpn) < 0)
+			return -1;
+		if (!PAGING_PAGE_ONLINE(*pte) || !(*pte & PAGING_PTE_COW_MASK))
+		{ /* Reclaim moved the page out to get the frame, it comes
+		   * back as a private page */
+			MEMPHY_put_freefp(caller->mram, newfpn);
+			return pg_getpage(mm, pgn, fpn, caller);
+		}
+		__swap_cp_page(caller->mram, oldfpn, caller->mram, newfpn);
+		ksm_put(mm, pgn, oldfpn);
+		pg_stat_inc(PG_STAT_COW);
 	}
 
-	*fpn = PAGING_FPN(pte);
+	pte_set_fpn(pte, newfpn);
+	MEMPHY_set_owner(caller->mram, newfpn, mm, pgn);
+	enlist_pgn_node(mm, pgn);
+#ifdef MM_TLB
+	if (mm == caller->mm)
+	{
+		tlb_flush_page(caller->pid, pgn);
+		tlb_insert(caller->pid, pgn, newfpn);
+	}
+#endif
 
+	*fpn = newfpn;
 	return 0;
 }
 
@@ -273,8 +1064,17 @@ int pg_getval(struct mm_struct *mm, int addr, BYTE *data, struct pcb_t *caller)
 {
 	int pgn = PAGING_PGN(addr);
 	int off = PAGING_OFFST(addr);
+	uint32_t *pte = pte_ptr(mm, pgn);
 	int fpn;
 
+	/* No table for it and no host memory left for one */
+	if (pte == NULL)
+		return -1;
+
+	/* A page attached to shared memory is reached through its segment */
+	if (*pte & PAGING_PTE_SHM_MASK)
+		return shm_getval(*pte, off, data, caller);
+
 	/* Get the page to MEMRAM, swap from MEMSWAP if needed */
 	if (pg_getpage(mm, pgn, &fpn, caller) != 0)
 	{
@@ -284,6 +1084,16 @@ int pg_getval(struct mm_struct *mm, int addr, BYTE *data, struct pcb_t *caller)
 		return -1; /* invalid page access */
 	}
 
+#ifdef MM_SWAP_RA
+	swap_readahead_hit(mm, pgn);
+#endif
+	/* Seen by the replacement policy even when the TLB translated it,
+	 * which looks at the first page of a huge page only */
+	SETBIT(*pte, PAGING_PTE_ACCESSED_MASK);
+	if (*pte & PAGING_PTE_HUGE_MASK)
+		SETBIT(*pte_ptr(mm, PAGING_HPAGE_HEAD(pgn)), PAGING_PTE_ACCESSED_MASK);
+	pg_stat_inc(PG_STAT_REF);
+
 	int phyaddr = (fpn << PAGING_ADDR_FPN_LOBIT) + off;
 
 	return MEMPHY_read(caller->mram, phyaddr, data);
@@ -299,8 +1109,17 @@ int pg_setval(struct mm_struct *mm, int addr, BYTE value, struct pcb_t *caller)
 {
 	int pgn = PAGING_PGN(addr);
 	int off = PAGING_OFFST(addr);
+	uint32_t *pte = pte_ptr(mm, pgn);
 	int fpn;
 
+	/* No table for it and no host memory left for one */
+	if (pte == NULL)
+		return -1;
+
+	/* A page attached to shared memory is reached through its segment */
+	if (*pte & PAGING_PTE_SHM_MASK)
+		return shm_setval(*pte, off, value, caller);
+
 	/* Get the page to MEMRAM, swap from MEMSWAP if needed */
 	if (pg_getpage(mm, pgn, &fpn, caller) != 0)
 	{
@@ -310,6 +1129,21 @@ int pg_setval(struct mm_struct *mm, int addr, BYTE value, struct pcb_t *caller)
 		return -1; /* invalid page access */
 	}
 
+	if ((*pte & PAGING_PTE_COW_MASK) &&
+		pg_cow_break(mm, pgn, &fpn, caller) < 0)
+		return -1;
+
+#ifdef MM_SWAP_RA
+	swap_readahead_hit(mm, pgn);
+#endif
+	/* Seen by the replacement policy even when the TLB translated it,
+	 * which looks at the first page of a huge page only */
+	SETBIT(*pte, PAGING_PTE_ACCESSED_MASK);
+	if (*pte & PAGING_PTE_HUGE_MASK)
+		SETBIT(*pte_ptr(mm, PAGING_HPAGE_HEAD(pgn)), PAGING_PTE_ACCESSED_MASK);
+	PAGING_PTE_SET_DIRTY(*pte);
+	pg_stat_inc(PG_STAT_REF);
+
 	int phyaddr = (fpn << PAGING_ADDR_FPN_LOBIT) + off;
 
 	return MEMPHY_write(caller->mram, phyaddr, value);
@@ -317,7 +1151,7 @@ int pg_setval(struct mm_struct *mm, int addr, BYTE value, struct pcb_t *caller)
 
 /*__read - read value in region memory
  *@caller: caller
- *@vmaid: ID vm area to alloc memory region
+ *@vmaid: ID vm area of the region, -1 for whichever it is in
  *@offset: offset to acess in memory region
  *@rgid: memory region ID (used to identify variable in symbole table)
  *@size: allocated size
@@ -326,10 +1160,9 @@ int pg_setval(struct mm_struct *mm, int addr, BYTE value, struct pcb_t *caller)
 int __read(struct pcb_t *caller, int vmaid, int rgid, int offset, BYTE *data)
 {
 	struct vm_rg_struct *currg = get_symrg_byid(caller->mm, rgid);
+	struct vm_area_struct *cur_vma;
 
-	struct vm_area_struct *cur_vma = get_vma_by_num(caller->mm, vmaid);
-
-	if (currg == NULL || cur_vma == NULL) /* Invalid memory identify */
+	if (currg == NULL) /* Invalid memory identify */
 		return -1;
 
 	if (currg->rg_start >= currg->rg_end) /* Region hasn't been allocated */
@@ -348,7 +1181,13 @@ int __read(struct pcb_t *caller, int vmaid, int rgid, int offset, BYTE *data)
 		printf("//////// since address is out of range in register %d of process %d\n", rgid, caller->pid);
 #endif
 		return -1;
-	}
+	}
+
+	/* The region has to lie in the area it was given from */
+	cur_vma = find_vma(caller->mm, currg->rg_start);
+	if (cur_vma == NULL || currg->rg_end > cur_vma->vm_end ||
+		(vmaid >= 0 && cur_vma->vm_id != vmaid))
+		return -1;
 
 	if (pg_getval(caller->mm, currg->rg_start + offset, data, caller) < 0)
 	{
@@ -369,32 +1208,31 @@ int pgread(
 	uint32_t offset,	// Source address = [source] + [offset]
 	uint32_t destination)
 {
-	pthread_mutex_lock(&mem_lock);
+	pthread_mutex_lock(&proc->mm->lock);
 
 	BYTE data;
-	int val = __read(proc, 0, source, offset, &data);
+	int val = __read(proc, -1, source, offset, &data);
+	pthread_mutex_unlock(&proc->mm->lock);
 	if (val < 0)
-	{
-		pthread_mutex_unlock(&mem_lock);
 		return val;
-	}
 	
 	destination = (uint32_t)data;
 #ifdef IODUMP
+	pthread_mutex_lock(&dump_lock);
 	printf("read region=%d offset=%d value=%d\n", source, offset, data);
 #ifdef PAGETBL_DUMP
 	print_pgtbl(proc, 0, -1); // print max TBL
 #endif
 	MEMPHY_dump(proc->mram);
+	pthread_mutex_unlock(&dump_lock);
 #endif
 
-	pthread_mutex_unlock(&mem_lock);
 	return val;
 }
 
 /*__write - write a region memory
  *@caller: caller
- *@vmaid: ID vm area to alloc memory region
+ *@vmaid: ID vm area of the region, -1 for whichever it is in
  *@offset: offset to acess in memory region
  *@rgid: memory region ID (used to identify variable in symbole table)
  *@size: allocated size
@@ -403,10 +1241,9 @@ int pgread(
 int __write(struct pcb_t *caller, int vmaid, int rgid, int offset, BYTE value)
 {
 	struct vm_rg_struct *currg = get_symrg_byid(caller->mm, rgid);
+	struct vm_area_struct *cur_vma;
 
-	struct vm_area_struct *cur_vma = get_vma_by_num(caller->mm, vmaid);
-
-	if (currg == NULL || cur_vma == NULL) /* Invalid memory identify */
+	if (currg == NULL) /* Invalid memory identify */
 		return -1;
 
 	if (currg->rg_start >= currg->rg_end) /* Region hasn't been allocated */
@@ -427,6 +1264,12 @@ int __write(struct pcb_t *caller, int vmaid, int rgid, int offset, BYTE value)
 		return -1;
 	}
 
+	/* The region has to lie in the area it was given from */
+	cur_vma = find_vma(caller->mm, currg->rg_start);
+	if (cur_vma == NULL || currg->rg_end > cur_vma->vm_end ||
+		(vmaid >= 0 && cur_vma->vm_id != vmaid))
+		return -1;
+
 	if (pg_setval(caller->mm, currg->rg_start + offset, value, caller) < 0)
 	{
 #ifdef MMDBG
@@ -446,111 +1289,249 @@ int pgwrite(
 	uint32_t destination, // Index of destination register
 	uint32_t offset)
 {
-	pthread_mutex_lock(&mem_lock);
+	pthread_mutex_lock(&proc->mm->lock);
 
-	int val = __write(proc, 0, destination, offset, data);
+	int val = __write(proc, -1, destination, offset, data);
+	pthread_mutex_unlock(&proc->mm->lock);
 	if (val < 0)
-	{
-		pthread_mutex_unlock(&mem_lock);
 		return val;
-	}
 
 #ifdef IODUMP
+	pthread_mutex_lock(&dump_lock);
 	printf("write region=%d offset=%d value=%d\n", destination, offset, data);
 #ifdef PAGETBL_DUMP
 	print_pgtbl(proc, 0, -1); // print max TBL
 #endif
 	MEMPHY_dump(proc->mram);
+	pthread_mutex_unlock(&dump_lock);
 #endif
 
-	pthread_mutex_unlock(&mem_lock);
 	return val;
 }
 
-/*free_pcb_memphy - collect all memphy of pcb
+/*swap_slot_free - give back the swap slot (or zswap entry) of a page
  *@caller: caller
- *@vmaid: ID vm area to alloc memory region
- *@incpgnum: number of page
+ *@swptyp: swap type
+ *@swpoff: swap offset
+ *
  */
-int free_pcb_memph(struct pcb_t *caller)
+void swap_slot_free(struct pcb_t *caller, int swptyp, int swpoff)
+{
+	if (swptyp == ZSWAP_SWPTYP)
+		zswap_free(swpoff);
+	else
+		MEMPHY_put_freefp(caller->mswp[swptyp], swpoff);
+}
+
+/*free_pte - unmap a page that is not attached to shared memory
+ *@caller: caller, whose memory devices are used
+ *@mm: owner of the page, locked
+ *@pgn: the page
+ *@ppte: its PTE, cleared
+ *
+ * An online frame goes back to MEMRAM, or loses a mapping if it is
+ * shared, and a swapped page gives its slot back to the MEMSWP it
+ * lives on
+ */
+static void free_pte(struct pcb_t *caller, struct mm_struct *mm, int pgn, uint32_t *ppte)
 {
-	int pagenum, fpn, typ;
-	uint32_t pte;
+	uint32_t pte = *ppte;
+	int fpn, typ, swpoff;
+
+	if (!PAGING_PAGE_PRESENT(pte))
+		return;
 
-	for (pagenum = 0; pagenum < PAGING_MAX_PGN; pagenum++)
+	if (pte & PAGING_PTE_COW_MASK)
+		ksm_put(mm, pgn, PAGING_PTE_FPN(pte));
+	else if (!PAGING_PAGE_SWAPPED(pte))
+	{
+		fpn = PAGING_PTE_FPN(pte);
+		if (MEMPHY_get_swpcopy(caller->mram, fpn, &typ, &swpoff) == 0)
+			swap_slot_free(caller, typ, swpoff);
+		MEMPHY_put_freefp(caller->mram, fpn);
+	}
+	else
 	{
-		pte = caller->mm->pgd[pagenum];
+		swap_slot_free(caller, PAGING_SWPTYP(pte), PAGING_SWPOFF(pte));
+		mm_charge_swap(mm, -1);
+	}
+	*ppte = 0;
+}
+
+/*free_pte_range - unmap a range of pages of the caller
+ *@caller: caller, its mm locked
+ *@pgn: first page
+ *@endpgn: page after the last one
+ *
+ * Pages attached to shared memory drop their segment reference, the
+ * others are forgotten by the replacement policy
+ */
+void free_pte_range(struct pcb_t *caller, int pgn, int endpgn)
+{
+	int pagenum;
+	uint32_t *ppte;
+
+	pg_policy_forget(caller->mm, pgn, endpgn);
 
-		if (PAGING_PAGE_PRESENT(pte))
+	/* Only the PTEs that are there, whole missing tables are skipped */
+	for (pagenum = pgn; (ppte = pte_next(caller->mm, &pagenum, endpgn)) != NULL; pagenum++)
+	{
+		if (*ppte & PAGING_PTE_SHM_MASK)
 		{
-			fpn = PAGING_FPN(pte);
-			MEMPHY_put_freefp(caller->mram, fpn);
+			shm_put(*ppte);
+			*ppte = 0;
 		}
 		else
-		{
-			fpn = PAGING_SWPOFF(pte);
-			typ = PAGING_SWPTYP(pte);
-			MEMPHY_put_freefp(caller->mswp[typ], fpn);
-		}
+			free_pte(caller, caller->mm, pagenum, ppte);
+	}
+}
+
+/*reap_pte_range - unmap the private pages of a range of another process
+ *@caller: caller
+ *@mm: memory region, locked
+ *@pgn: first page
+ *@endpgn: page after the last one
+ *
+ * Pages attached to shared memory are left to the exit of the process,
+ * their segment may be the one the caller is using
+ */
+void reap_pte_range(struct pcb_t *caller, struct mm_struct *mm, int pgn, int endpgn)
+{
+	uint32_t *ppte;
+
+	pg_policy_forget(mm, pgn, endpgn);
+	for (; (ppte = pte_next(mm, &pgn, endpgn)) != NULL; pgn++)
+		if (!(*ppte & PAGING_PTE_SHM_MASK))
+			free_pte(caller, mm, pgn, ppte);
+}
+
+/*free_pcb_memphy - collect all memphy of pcb
+ *@caller: caller
+ *
+ */
+int free_pcb_memph(struct pcb_t *caller)
+{
+	struct mm_struct *mm = caller->mm;
+	int i;
+
+	/* Nothing is mapped outside of the VMAs */
+	for (i = 0; i < mm->map_count; i++)
+		free_pte_range(caller, mm->mmap[i]->vm_start / PAGING_PAGESZ,
+					   mm->mmap[i]->vm_end / PAGING_PAGESZ);
+	return 0;
+}
+
+/*mm_rss_account - count the pages of an address space going away
+ *@mm: memory region, locked
+ *
+ * Pages of its VMAs against those online, frames shared with other
+ * pages included
+ */
+static void mm_rss_account(struct mm_struct *mm)
+{
+	unsigned long vsz = 0, rss = 0;
+	int i, pgn, endpgn;
+	uint32_t *ppte;
+
+	for (i = 0; i < mm->map_count; i++)
+	{
+		pgn = mm->mmap[i]->vm_start / PAGING_PAGESZ;
+		endpgn = mm->mmap[i]->vm_end / PAGING_PAGESZ;
+		vsz += endpgn - pgn;
+		for (; (ppte = pte_next(mm, &pgn, endpgn)) != NULL; pgn++)
+			if (PAGING_PAGE_ONLINE(*ppte))
+				rss++;
 	}
 
+	pg_stat_add(PG_STAT_VSZ, vsz);
+	pg_stat_add(PG_STAT_RSS, rss);
+}
+
+/*free_pcb_mm - tear down the address space of an exiting process
+ *@caller: caller
+ *
+ */
+int free_pcb_mm(struct pcb_t *caller)
+{
+	if (caller->mm == NULL)
+		return 0;
+
+	/* The process is not running anymore, but global replacement may
+	 * still be looking at its pages until they are all given back */
+#ifdef MM_TLB
+	tlb_flush_pid(caller->pid);
+#endif
+	pthread_mutex_lock(&caller->mm->lock);
+	mm_rss_account(caller->mm);
+	free_pcb_memph(caller);
+	pthread_mutex_unlock(&caller->mm->lock);
+	shm_exit(caller->mm);
+	free_mm(caller->mm);
+	caller->mm = NULL;
+
 	return 0;
 }
 
 /*get_vm_area_node - get vm area for a number of pages
  *@caller: caller
  *@vmaid: ID vm area to alloc memory region
- *@incpgnum: number of page
- *@vmastart: vma end
- *@vmaend: vma end
+ *@size: size to add
+ *@alignedsz: page aligned size to add
  *
+ * The pages right after the area, or right below it for the stack.
+ * Return NULL if they are not in the address space or no node is left
  */
 struct vm_rg_struct *get_vm_area_node_at_brk(struct pcb_t *caller, int vmaid, int size, int alignedsz)
 {
 	struct vm_rg_struct *newrg;
 	struct vm_area_struct *cur_vma = get_vma_by_num(caller->mm, vmaid);
+	long start;
+
+	if (cur_vma->vm_flags & VM_GROWSDOWN)
+		start = (long)cur_vma->vm_start - alignedsz;
+	else
+		start = cur_vma->vm_end;
+	if (start < 0 || start + alignedsz > PAGING_STACK_TOP)
+		return NULL;
 
-	newrg = malloc(sizeof(struct vm_rg_struct));
+	if ((newrg = mm_node_alloc(caller->mm, MM_NODE_RG)) == NULL)
+		return NULL;
 
-	newrg->rg_start = cur_vma->sbrk;
-	newrg->rg_end = newrg->rg_start + size;
+	newrg->rg_start = start;
+	newrg->rg_end = newrg->rg_start + alignedsz;
 
 	return newrg;
 }
 
 /*validate_overlap_vm_area
  *@caller: caller
- *@vmaid: ID vm area to alloc memory region
+ *@vmaid: ID vm area to alloc memory region, -1 for a new one
  *@vmastart: vma end
  *@vmaend: vma end
  *
+ * Areas do not overlap and are sorted, so only the last one starting
+ * below @vmaend (other than @vmaid) may reach into the range
  */
 int validate_overlap_vm_area(struct pcb_t *caller, int vmaid, int vmastart, int vmaend)
 {
-	// struct vm_area_struct *vma = caller->mm->mmap;
-	struct vm_area_struct *cur_vma = get_vma_by_num(caller->mm, vmaid);
+	struct mm_struct *mm = caller->mm;
+	struct vm_area_struct *cur_vma = get_vma_by_num(mm, vmaid);
+	int i;
 
 	/* TODO IMPLEMENTED: validate the planned memory area is not overlapped */
+	if (vmastart >= vmaend)
+		return 0;
 
-	/* Iterate through vma list to do the checking */
-	struct vm_area_struct *vmait;
-	for (vmait = caller->mm->mmap; vmait != NULL; vmait = vmait->vm_next)
+	for (i = vma_addr_upper(mm, vmaend - 1) - 1; i >= 0; i--)
 	{
 		/* Only do the checking for other vma */
-		if (vmait == cur_vma)
+		if (mm->mmap[i] == cur_vma)
 			continue;
 
 		/* It's fine if intervals have only 1 endpoint overlapped */
-		if (vmastart == vmait->vm_end && vmaend != vmait->vm_start)
-			continue;
-		if (vmaend == vmait->vm_start && vmastart != vmait->vm_end)
-			continue;
-
-		/* If above cases are not happening, intervals have overlapped */
-		return -1;
+		return (mm->mmap[i]->vm_end > vmastart) ? -1 : 0;
 	}
 
-	/* After the loop end, intervals are guaranteed to be not overlapped */
 	return 0;
 }
 
@@ -562,34 +1543,45 @@ int validate_overlap_vm_area(struct pcb_t *caller, int vmaid, int vmastart, int
  */
 int inc_vma_limit(struct pcb_t *caller, int vmaid, int inc_sz)
 {
-	struct vm_rg_struct *newrg = malloc(sizeof(struct vm_rg_struct));
+	struct vm_rg_struct *newrg;
 	int inc_amt = PAGING_PAGE_ALIGNSZ(inc_sz);
 	int incnumpage = inc_amt / PAGING_PAGESZ;
 
 	struct vm_rg_struct *area = get_vm_area_node_at_brk(caller, vmaid, inc_sz, inc_amt);
 	struct vm_area_struct *cur_vma = get_vma_by_num(caller->mm, vmaid);
 
-	int old_end = cur_vma->vm_end;
-
 	/* Validate overlap of obtained region */
+	if (area == NULL)
+		return -1;
 	if (validate_overlap_vm_area(caller, vmaid, area->rg_start, area->rg_end) < 0)
 	{ /* Overlap and failed allocation */
-		free(newrg);
-		free(area);
+		mm_node_free(caller->mm, MM_NODE_RG, area);
 		return -1;
 	}
 
 	/* The obtained vm area (only)
 	 * now will be alloc real ram region */
-	cur_vma->vm_end += inc_sz;
+	newrg = mm_node_alloc(caller->mm, MM_NODE_RG);
+	if (newrg == NULL)
+	{
+		mm_node_free(caller->mm, MM_NODE_RG, area);
+		return -1;
+	}
 	if (vm_map_ram(caller, area->rg_start, area->rg_end,
-				   old_end, incnumpage, newrg) < 0) /* Map the memory to MEMRAM */
-	{												/* Failed to map mem */
-		free(newrg);
-		free(area);
+				   area->rg_start, incnumpage, newrg) < 0) /* Map the memory to MEMRAM */
+	{													   /* Failed to map mem */
+		mm_node_free(caller->mm, MM_NODE_RG, newrg);
+		mm_node_free(caller->mm, MM_NODE_RG, area);
 		return -1;
 	}
 
+	if (cur_vma->vm_flags & VM_GROWSDOWN)
+		cur_vma->vm_start = area->rg_start;
+	else
+		cur_vma->vm_end = area->rg_end;
+
+	mm_node_free(caller->mm, MM_NODE_RG, newrg);
+	mm_node_free(caller->mm, MM_NODE_RG, area);
 	return 0;
 }
 
@@ -600,82 +1592,458 @@ int inc_vma_limit(struct pcb_t *caller, int vmaid, int inc_sz)
  */
 int find_victim_page(struct mm_struct *mm, int *retpgn)
 {
-	struct pgn_t *pg = mm->fifo_pgn;
-
 	/* TODO IMPLEMENTED: Implement the theorical mechanism to find the victim page */
-	if (pg == NULL)
+	return pg_policy->victim(mm, retpgn);
+}
+
+/*get_swap_slot - get a free frame on a swap device
+ *@caller: caller
+ *@swptyp: return swap type (index in caller->mswp)
+ *@swpfpn: return frame number on that swap
+ *
+ * The active swap is tried first, then every other configured one
+ */
+int get_swap_slot(struct pcb_t *caller, int *swptyp, int *swpfpn)
+{
+	int i;
+
+	for (i = 0; i < PAGING_MAX_MMSWP; i++)
+		if (caller->mswp[i] == caller->active_mswp &&
+			MEMPHY_get_freefp(caller->mswp[i], swpfpn) == 0)
+		{
+			*swptyp = i;
+			return 0;
+		}
+
+	for (i = 0; i < PAGING_MAX_MMSWP; i++)
+	{
+		if (caller->mswp[i] == caller->active_mswp || caller->mswp[i]->maxsz <= 0)
+			continue;
+		if (MEMPHY_get_freefp(caller->mswp[i], swpfpn) == 0)
+		{
+			*swptyp = i;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/*swap_write_back - move an online page out to swap
+ *@caller: caller, whose swap devices are used
+ *@mm: owner of the page, locked
+ *@pte: PTE of the page
+ *@fpn: MEMRAM frame of the page
+ *@swptyp: swap type of the copy kept since the last swap in, -1 if none
+ *@swpfpn: frame of that copy on its swap
+ *
+ * A clean page with a copy is not written at all, a dirty one is
+ * written over its copy on a swap device. Any other goes to the zswap
+ * pool if enabled and the page fits there, or to a new swap slot. An
+ * owner at its swap limit keeps the page online
+ */
+static int swap_write_back(struct pcb_t *caller, struct mm_struct *mm, uint32_t *pte,
+						   int fpn, int swptyp, int swpfpn)
+{
+	BYTE buf[PAGING_PAGESZ];
+	int oldtyp = swptyp, oldoff = swpfpn;
+
+	if (!mm_swap_room(mm, 1))
+	{
+		pg_stat_inc(PG_STAT_SWAPQUOTA);
 		return -1;
+	}
+
+	if (swptyp >= 0 && !PAGING_PAGE_DIRTY(*pte))
+		pg_stat_inc(PG_STAT_WBSKIP);
+	else
+	{
+		/* A pool entry is not rewritten in place, it is dropped once
+		 * the page has been stored again */
+		if (swptyp == ZSWAP_SWPTYP)
+			swptyp = -1;
+
+		if (swptyp < 0 && zswap_enabled &&
+			MEMPHY_read_page(caller->mram, fpn, buf) == 0 &&
+			zswap_store(buf, &swpfpn) == 0)
+			swptyp = ZSWAP_SWPTYP;
+		else
+		{
+			if (swptyp < 0 && get_swap_slot(caller, &swptyp, &swpfpn) < 0)
+				return -1;
+			__swap_cp_page(caller->mram, fpn, caller->mswp[swptyp], swpfpn);
+			pg_stat_inc(PG_STAT_WRITEBACK);
+		}
 
-	*retpgn = pg->pgn;
-	mm->fifo_pgn = pg->pg_next;
-	free(pg);
+		if (oldtyp == ZSWAP_SWPTYP)
+			zswap_free(oldoff);
+	}
 
+	pte_set_swap(pte, swptyp, swpfpn);
+	mm_charge_swap(mm, 1);
+	pg_stat_inc(PG_STAT_EVICT);
 	return 0;
 }
 
-/*get_free_vmrg_area - get a free vm region
- *@caller: caller
- *@vmaid: ID vm area to alloc memory region
- *@size: allocated size
+/*swap_out_huge - move the pages of a huge page out to swap
+ *@caller: caller, whose swap devices are used
+ *@mm: owner of the huge page, locked
+ *@pgn: its first page
  *
+ * Return how many of its frames, from the first one, are free now. If
+ * swap runs out midway the huge page is split, the pages still online
+ * stay mapped as base pages. The caller updates the reverse map
  */
-int get_free_vmrg_area(struct pcb_t *caller, int vmaid, int size, struct vm_rg_struct *newrg)
+static int swap_out_huge(struct pcb_t *caller, struct mm_struct *mm, int pgn)
 {
-	struct vm_area_struct *cur_vma = get_vma_by_num(caller->mm, vmaid);
+	int fpn = PAGING_PTE_FPN(pte_get(mm, pgn)), n;
+
+	for (n = 0; n < PAGING_HPAGE_NR; n++)
+	{
+		if (swap_write_back(caller, mm, pte_ptr(mm, pgn + n), fpn + n, -1, -1) < 0)
+		{
+			pg_split_huge(mm, pgn);
+			return n;
+		}
+#ifdef MM_TLB
+		tlb_flush_page(mm->pid, pgn + n);
+#endif
+	}
 
-	struct vm_rg_struct *rgit = cur_vma->vm_freerg_list;
+	pg_stat_inc(PG_STAT_HUGEEVICT);
+	return n;
+}
 
-	if (rgit == NULL)
-		return -1;
+/*swap_out_shared - move a page mapping a shared frame out to swap
+ *@caller: caller, whose swap devices are used
+ *@mm: owner of the page, locked
+ *@pgn: the page
+ *
+ * The page gets a swap slot of its own, mm-ksm.c then drops it from
+ * the mappers of the frame
+ */
+int swap_out_shared(struct pcb_t *caller, struct mm_struct *mm, int pgn)
+{
+	uint32_t *pte = pte_ptr(mm, pgn);
 
-	/* Probe unintialized newrg */
-	newrg->rg_start = newrg->rg_end = -1;
+	if (swap_write_back(caller, mm, pte, PAGING_PTE_FPN(*pte), -1, -1) < 0)
+		return -1;
+	CLRBIT(*pte, PAGING_PTE_COW_MASK);
+#ifdef MM_TLB
+	tlb_flush_page(mm->pid, pgn);
+#endif
+	return 0;
+}
 
-	/* Traverse on list of free vm region to find a fit space */
-	while (rgit != NULL)
+/*swap_out_clock - move the coldest page of any process out to swap
+ *@caller: caller
+ *@only: the one process to take the page from, NULL for any
+ *@retfpn: return the freed MEMRAM frame
+ *
+ * A clock over the reverse map of MEMRAM: a frame whose page was
+ * accessed since the hand last passed gets another round. Processes
+ * busy in their own memory operation are skipped rather than waited for.
+ * A caller without mm (kswapd) try-locks every owner. A huge page is
+ * looked at through its first frame only, and all its frames are freed.
+ * A shared frame goes out with all the pages mapping it. With @only,
+ * only its pages go and, the frame being still mapped by others, the
+ * clock stops once they made room under its resident limit
+ */
+static int swap_out_clock(struct pcb_t *caller, struct mm_struct *only, int *retfpn)
+{
+	struct memphy_struct *mram = caller->mram;
+	struct framephy_struct *fp;
+	struct mm_struct *owner;
+	int scan, ret, nfree, i;
+	uint32_t *pte;
+
+	pthread_mutex_lock(&mram->lock);
+	for (scan = 0; scan < 2 * mram->numfp; scan++)
 	{
-		if (rgit->rg_start + size <= rgit->rg_end)
-		{ /* Current region has enough space */
-			newrg->rg_start = rgit->rg_start;
-			newrg->rg_end = rgit->rg_start + size;
+		fp = &mram->rmap[mram->rmap_hand];
+		mram->rmap_hand = (mram->rmap_hand + 1) % mram->numfp;
+
+		owner = fp->owner;
+		if (owner == NULL && MEMPHY_is_used(mram, fp->fpn))
+		{ /* Shared, or just taken and not mapped yet */
+			pthread_mutex_unlock(&mram->lock);
+			if (ksm_swap_out(caller, only, fp->fpn, 1) == 0)
+			{
+				*retfpn = fp->fpn;
+				return 0;
+			}
+			if (only != NULL && mm_rss_room(only, 1))
+				return -1;
+			pthread_mutex_lock(&mram->lock);
+			continue;
+		}
+		if (owner == NULL || (only != NULL && owner != only))
+			continue;
+		if (owner != caller->mm && pthread_mutex_trylock(&owner->lock) != 0)
+			continue;
 
-			/* Update left space in chosen region */
-			if (rgit->rg_start + size < rgit->rg_end)
+		pte = pte_ptr(owner, fp->pgn);
+		nfree = 1;
+		if ((*pte & PAGING_PTE_HUGE_MASK) && fp->pgn != PAGING_HPAGE_HEAD(fp->pgn))
+			ret = -1;
+		else if (*pte & PAGING_PTE_ACCESSED_MASK)
+		{
+			CLRBIT(*pte, PAGING_PTE_ACCESSED_MASK);
+			ret = -1;
+		}
+		else if (*pte & PAGING_PTE_HUGE_MASK)
+			ret = ((nfree = swap_out_huge(caller, owner, fp->pgn)) > 0) ? 0 : -1;
+		else /* Update the owner page table, swap full leaves it online */
+			ret = swap_write_back(caller, owner, pte, fp->fpn, fp->swptyp, fp->swpoff);
+		if (ret == 0)
+		{
+#ifdef MM_TLB
+			tlb_flush_page(owner->pid, fp->pgn);
+#endif
+			for (i = 0; i < nfree; i++)
 			{
-				rgit->rg_start = rgit->rg_start + size;
+				fp[i].owner = NULL;
+				fp[i].swptyp = -1;
 			}
-			else
-			{ /*Use up all space, remove current node */
-				/*Clone next rg node */
-				struct vm_rg_struct *nextrg = rgit->rg_next;
+			mm_charge_rss(owner, -nfree);
+		}
+		if (owner != caller->mm)
+			pthread_mutex_unlock(&owner->lock);
+		if (ret < 0)
+			continue;
 
-				/*Cloning */
-				if (nextrg != NULL)
-				{
-					rgit->rg_start = nextrg->rg_start;
-					rgit->rg_end = nextrg->rg_end;
+		pthread_mutex_unlock(&mram->lock);
+		for (i = 1; i < nfree; i++)
+			MEMPHY_put_freefp(mram, fp->fpn + i);
+		*retfpn = fp->fpn;
+		return 0;
+	}
+	pthread_mutex_unlock(&mram->lock);
 
-					rgit->rg_next = nextrg->rg_next;
+	return -1;
+}
 
-					free(nextrg);
-				}
-				else
-				{								   /*End of free list */
-					rgit->rg_start = rgit->rg_end; // dummy, size 0 region
-					rgit->rg_next = NULL;
-				}
-			}
-			return 0;
+/*swap_out_global - move the coldest page of any process out to swap
+ *@caller: caller
+ *@retfpn: return the freed MEMRAM frame
+ *
+ */
+int swap_out_global(struct pcb_t *caller, int *retfpn)
+{
+	return swap_out_clock(caller, NULL, retfpn);
+}
+
+/*swap_out_local - move a page of the caller picked by its replacement
+ *policy out to swap
+ *@caller: caller
+ *@retfpn: return the freed MEMRAM frame
+ *
+ */
+static int swap_out_local(struct pcb_t *caller, int *retfpn)
+{
+	int vicpgn, vicfpn, swptyp, swpfpn, nfree, i;
+	uint32_t vicpte;
+
+	/* Pages merged into the zero frame since they were queued are not
+	 * the policy's anymore, nor are those that became part of a huge page */
+	do
+	{
+		if (find_victim_page(caller->mm, &vicpgn) < 0)
+			return -1;
+		vicpte = pte_get(caller->mm, vicpgn);
+	} while (!PAGING_PAGE_ONLINE(vicpte) ||
+			 ((vicpte & PAGING_PTE_COW_MASK) && ksm_is_zero(PAGING_PTE_FPN(vicpte))) ||
+			 ((vicpte & PAGING_PTE_HUGE_MASK) && vicpgn != PAGING_HPAGE_HEAD(vicpgn)));
+
+	vicfpn = PAGING_PTE_FPN(vicpte);
+	if (vicpte & PAGING_PTE_COW_MASK)
+	{ /* A shared frame is freed with all the pages mapping it */
+		if (ksm_swap_out(caller, NULL, vicfpn, 0) < 0)
+		{
+			if (PAGING_PAGE_ONLINE(pte_get(caller->mm, vicpgn)))
+				enlist_pgn_node(caller->mm, vicpgn);
+			return -1;
 		}
-		else
+		pg_stat_inc(PG_STAT_DIRECT);
+
+		*retfpn = vicfpn;
+		return 0;
+	}
+	if (vicpte & PAGING_PTE_HUGE_MASK)
+	{ /* All its frames are freed, the caller gets the first one */
+		if ((nfree = swap_out_huge(caller, caller->mm, vicpgn)) == 0)
+		{
+			enlist_pgn_node(caller->mm, vicpgn);
+			return -1;
+		}
+		for (i = 0; i < nfree; i++)
+			MEMPHY_set_owner(caller->mram, vicfpn + i, NULL, -1);
+		for (i = 1; i < nfree; i++)
+			MEMPHY_put_freefp(caller->mram, vicfpn + i);
+		pg_stat_inc(PG_STAT_DIRECT);
+
+		*retfpn = vicfpn;
+		return 0;
+	}
+
+	if (MEMPHY_get_swpcopy(caller->mram, vicfpn, &swptyp, &swpfpn) < 0)
+		swptyp = -1;
+
+	/* Copy victim frame to swap and update page table */
+	if (swap_write_back(caller, caller->mm, pte_ptr(caller->mm, vicpgn), vicfpn,
+						swptyp, swpfpn) < 0)
+	{ /* Swap is full, the victim stays online */
+		enlist_pgn_node(caller->mm, vicpgn);
+		return -1;
+	}
+	MEMPHY_set_owner(caller->mram, vicfpn, NULL, -1);
+#ifdef MM_TLB
+	tlb_flush_page(caller->pid, vicpgn);
+#endif
+	pg_stat_inc(PG_STAT_DIRECT);
+
+	*retfpn = vicfpn;
+	return 0;
+}
+
+/*swap_out_victim - move a victim page out to swap to free its frame
+ *@caller: caller
+ *@retfpn: return the freed MEMRAM frame
+ *
+ */
+int swap_out_victim(struct pcb_t *caller, int *retfpn)
+{
+	if (!pg_global)
+		return swap_out_local(caller, retfpn);
+
+	if (swap_out_global(caller, retfpn) < 0)
+		return -1;
+	pg_stat_inc(PG_STAT_DIRECT);
+	return 0;
+}
+
+/*swap_out_own - move a page of the caller out to swap, whatever the
+ *replacement scope
+ *@caller: caller
+ *@retfpn: return the freed MEMRAM frame
+ *
+ */
+static int swap_out_own(struct pcb_t *caller, int *retfpn)
+{
+	if (!pg_global)
+		return swap_out_local(caller, retfpn);
+
+	if (swap_out_clock(caller, caller->mm, retfpn) < 0)
+		return -1;
+	pg_stat_inc(PG_STAT_DIRECT);
+	return 0;
+}
+
+/*pg_get_frame - get a MEMRAM frame for a page
+ *@caller: caller, its mm locked
+ *@mm: memory region the page belongs to, locked
+ *@retfpn: return the frame
+ *
+ * A process at its resident limit swaps one of its own pages out for
+ * it, and is killed if it has none left to swap. A page moved out of a
+ * frame other processes keep mapped makes room under the limit all the
+ * same, the frame is then looked for as below. Otherwise a free frame
+ * is taken, or the frame of a victim page of the replacement scope, or
+ * of any process if local replacement found none. With swap full too
+ * the OOM killer gives back the memory of some process and the frame is
+ * looked for again. Reclaiming counts as a memory stall
+ */
+int pg_get_frame(struct pcb_t *caller, struct mm_struct *mm, int *retfpn)
+{
+	int ret;
+
+	if (oom_killed(caller->mm))
+		return -1;
+
+	if (mm == caller->mm && !mm_rss_room(mm, 1))
+	{
+		psi_memstall_enter();
+		if ((ret = swap_out_own(caller, retfpn)) == 0)
+			pg_stat_inc(PG_STAT_QUOTA);
+		else if (!mm_rss_room(mm, 1))
+			oom_kill(caller, caller->mm);
+		psi_memstall_leave();
+		if (ret == 0 || oom_killed(mm) || !mm_rss_room(mm, 1))
+			return ret;
+	}
+
+	if (MEMPHY_get_freefp(caller->mram, retfpn) == 0)
+		return 0;
+
+	psi_memstall_enter();
+	for (;;)
+	{
+		if ((ret = swap_out_victim(caller, retfpn)) == 0)
+			break;
+		if (!pg_global && (ret = swap_out_global(caller, retfpn)) == 0)
 		{
-			rgit = rgit->rg_next; // Traverse next rg
+			pg_stat_inc(PG_STAT_DIRECT);
+			break;
 		}
+		if ((ret = oom_kill(caller, NULL)) < 0)
+			break;
+		/* The frames of the victim just went back */
+		if ((ret = MEMPHY_get_freefp(caller->mram, retfpn)) == 0)
+			break;
 	}
+	psi_memstall_leave();
+
+	return ret;
+}
+
+/*get_free_vmrg_area - get a free vm region
+ *@caller: caller
+ *@vmaid: ID vm area to alloc memory region
+ *@size: allocated size
+ *
+ * Best fit among the regions of the size class of @size, any region of
+ * a larger class fits, and the smallest of the first such class is taken
+ */
+int get_free_vmrg_area(struct pcb_t *caller, int vmaid, int size, struct vm_rg_struct *newrg)
+{
+	struct vm_area_struct *cur_vma = get_vma_by_num(caller->mm, vmaid);
+	struct vm_rg_struct *rgit, *best = NULL;
+	unsigned long bestsz = 0, sz;
+	uint32_t map;
+
+	if (cur_vma == NULL || size <= 0)
+		return -1;
+
+	map = cur_vma->vm_freerg_map & ~((1U << freerg_class(size)) - 1);
+	for (; map != 0 && best == NULL; map &= map - 1)
+		for (rgit = cur_vma->vm_freerg_list[__builtin_ctz(map)]; rgit != NULL; rgit = rgit->rg_next)
+		{
+			sz = rgit->rg_end - rgit->rg_start;
+			if (sz >= size && (best == NULL || sz < bestsz))
+			{
+				best = rgit;
+				bestsz = sz;
+				if (sz == size)
+					break;
+			}
+		}
 
-	if (newrg->rg_start == -1) // new region not found
+	if (best == NULL)
 		return -1;
 
+	newrg->rg_start = best->rg_start;
+	newrg->rg_end = best->rg_start + size;
+
+	/* The rest stays free, in the class of its new size */
+	freerg_remove(cur_vma, best);
+	if (bestsz > size)
+	{
+		best->rg_start += size;
+		freerg_insert(cur_vma, best);
+	}
+	else
+		mm_node_free(caller->mm, MM_NODE_RG, best);
+
 	return 0;
 }
 
@@ -0,0 +1,328 @@
+// #ifdef MM_PAGING
+/*
+ * PAGING based Memory Management
+ * Compressed swap cache mm/mm-zswap.c
+ *
+ * Evicted pages are compressed into a host memory pool before any
+ * MEMSWP is used. A page kept in the pool is referenced from its PTE as
+ * swap type ZSWAP_SWPTYP, the swap offset being its entry in the pool.
+ */
+
+#include "mm.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * LZ codec
+ * The compressed stream is a sequence of tokens, each starting with a
+ * control byte c:
+ *   c <  0x80: c + 1 literal bytes follow
+ *   c >= 0x80: copy (c & 0x7f) + LZ_MIN_MATCH bytes from the output,
+ *              starting the 2 byte distance that follows back
+ * Copies may overlap the bytes they produce, which is how runs (zero
+ * pages above all) come out as a handful of bytes
+ */
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH (0x7f + LZ_MIN_MATCH)
+#define LZ_MAX_LIT 0x80
+#define LZ_MAX_DIST 0xffff
+#define LZ_HASH_BITS 10
+#define LZ_HASH(p) ((((p)[0] << 16 | (p)[1] << 8 | (p)[2]) * 2654435761U) >> (32 - LZ_HASH_BITS))
+
+static int lz_put_literals(const unsigned char *src, int n, unsigned char *dst, int op, int cap)
+{
+	while (n > 0)
+	{
+		int run = (n < LZ_MAX_LIT) ? n : LZ_MAX_LIT;
+
+		if (op + 1 + run > cap)
+			return -1;
+		dst[op++] = run - 1;
+		memcpy(&dst[op], src, run);
+		op += run;
+		src += run;
+		n -= run;
+	}
+
+	return op;
+}
+
+/*
+ * lz_compress - compress @n bytes of @src into at most @cap bytes of @dst
+ * Return the compressed size, -1 if it does not fit in @cap
+ */
+static int lz_compress(const unsigned char *src, int n, unsigned char *dst, int cap)
+{
+	int head[1 << LZ_HASH_BITS];
+	int ip = 0, lit = 0, op = 0;
+
+	memset(head, -1, sizeof(head));
+	while (ip + LZ_MIN_MATCH <= n)
+	{
+		uint32_t h = LZ_HASH(&src[ip]);
+		int cand = head[h], len;
+
+		head[h] = ip;
+		if (cand < 0 || ip - cand > LZ_MAX_DIST ||
+			memcmp(&src[cand], &src[ip], LZ_MIN_MATCH) != 0)
+		{
+			ip++;
+			continue;
+		}
+
+		for (len = LZ_MIN_MATCH; ip + len < n && len < LZ_MAX_MATCH &&
+								 src[cand + len] == src[ip + len];
+			 len++)
+			;
+
+		if ((op = lz_put_literals(&src[lit], ip - lit, dst, op, cap)) < 0 ||
+			op + 3 > cap)
+			return -1;
+		dst[op++] = 0x80 | (len - LZ_MIN_MATCH);
+		dst[op++] = (ip - cand) >> 8;
+		dst[op++] = (ip - cand) & 0xff;
+
+		ip += len;
+		lit = ip;
+	}
+
+	return lz_put_literals(&src[lit], n - lit, dst, op, cap);
+}
+
+/*
+ * lz_decompress - expand @n compressed bytes into exactly @cap bytes
+ * Return 0 on success, -1 on a corrupted stream
+ */
+static int lz_decompress(const unsigned char *src, int n, unsigned char *dst, int cap)
+{
+	int ip = 0, op = 0;
+
+	while (ip < n)
+	{
+		int c = src[ip++];
+
+		if (c < 0x80)
+		{
+			if (ip + c + 1 > n || op + c + 1 > cap)
+				return -1;
+			memcpy(&dst[op], &src[ip], c + 1);
+			ip += c + 1;
+			op += c + 1;
+		}
+		else
+		{
+			int len = (c & 0x7f) + LZ_MIN_MATCH, dist;
+
+			if (ip + 2 > n)
+				return -1;
+			dist = src[ip] << 8 | src[ip + 1];
+			ip += 2;
+			if (dist == 0 || dist > op || op + len > cap)
+				return -1;
+			for (; len > 0; len--, op++) /* byte by byte, copies overlap */
+				dst[op] = dst[op - dist];
+		}
+	}
+
+	return (op == cap) ? 0 : -1;
+}
+
+/*
+ * Pool
+ */
+struct zswap_entry
+{
+	unsigned char *data; /* NULL while the entry is free */
+	int len;
+	int next_free;
+};
+
+int zswap_enabled = 0;
+
+static pthread_mutex_t zswap_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct zswap_entry *zswap_ent;
+static int zswap_nent;
+static int zswap_free_head = -1;
+static long zswap_pool_sz;
+static long zswap_used;
+
+/* Byte counts of every page ever stored, for the compression ratio */
+static unsigned long zswap_in_bytes;
+static unsigned long zswap_out_bytes;
+
+/*
+ * zswap_init - enable the compressed swap cache
+ * @pool_sz: bytes of compressed data the pool may hold
+ */
+int zswap_init(long pool_sz)
+{
+	if (pool_sz <= 0)
+		return -1;
+
+	zswap_pool_sz = pool_sz;
+	zswap_enabled = 1;
+	return 0;
+}
+
+/*
+ * zswap_insert - put compressed data in a free entry of the pool
+ * Called under zswap_lock, return -1 if the pool is full
+ */
+static int zswap_insert(unsigned char *data, int len, int *idx)
+{
+	if (zswap_used + len > zswap_pool_sz)
+		return -1;
+
+	if (zswap_free_head < 0)
+	{ /* Grow the entry table, within what a swapped PTE can address */
+		int nent = zswap_nent ? 2 * zswap_nent : 256, i;
+		struct zswap_entry *ent;
+
+		if (nent > PAGING_MAX_SWPFPN)
+			nent = PAGING_MAX_SWPFPN;
+		if (nent == zswap_nent ||
+			(ent = realloc(zswap_ent, nent * sizeof(*ent))) == NULL)
+			return -1;
+		for (i = nent - 1; i >= zswap_nent; i--)
+		{
+			ent[i].data = NULL;
+			ent[i].next_free = zswap_free_head;
+			zswap_free_head = i;
+		}
+		zswap_ent = ent;
+		zswap_nent = nent;
+	}
+
+	*idx = zswap_free_head;
+	zswap_free_head = zswap_ent[*idx].next_free;
+	zswap_ent[*idx].data = data;
+	zswap_ent[*idx].len = len;
+	zswap_used += len;
+
+	return 0;
+}
+
+/*
+ * zswap_store - compress a page into the pool
+ * @page: PAGING_PAGESZ bytes
+ * @idx : return the pool entry
+ *
+ * Return -1 if the page does not compress well enough, the pool is full
+ * or the host is out of memory, the caller then writes it to a swap device
+ */
+int zswap_store(const BYTE *page, int *idx)
+{
+	unsigned char buf[PAGING_PAGESZ];
+	int cap = PAGING_PAGESZ * ZSWAP_MAX_PCT / 100;
+	int len = lz_compress((const unsigned char *)page, PAGING_PAGESZ, buf, cap);
+	unsigned char *data;
+	int ret = -1;
+
+	if (len >= 0 && (data = malloc(len)) != NULL)
+	{
+		memcpy(data, buf, len);
+
+		pthread_mutex_lock(&zswap_lock);
+		if ((ret = zswap_insert(data, len, idx)) == 0)
+		{
+			zswap_in_bytes += PAGING_PAGESZ;
+			zswap_out_bytes += len;
+		}
+		pthread_mutex_unlock(&zswap_lock);
+		if (ret < 0)
+			free(data);
+	}
+
+	pg_stat_inc((ret == 0) ? PG_STAT_ZSTORE : PG_STAT_ZREJECT);
+	return ret;
+}
+
+/*
+ * zswap_dup - copy a pool entry, still compressed
+ * @idx   : pool entry
+ * @newidx: return the copy
+ *
+ * Return -1 if the pool has no room for it
+ */
+int zswap_dup(int idx, int *newidx)
+{
+	unsigned char *data = NULL;
+	int ret = -1;
+
+	pthread_mutex_lock(&zswap_lock);
+	if (idx >= 0 && idx < zswap_nent && zswap_ent[idx].data != NULL &&
+		(data = malloc(zswap_ent[idx].len)) != NULL)
+	{
+		memcpy(data, zswap_ent[idx].data, zswap_ent[idx].len);
+		ret = zswap_insert(data, zswap_ent[idx].len, newidx);
+	}
+	pthread_mutex_unlock(&zswap_lock);
+
+	if (ret < 0)
+		free(data);
+	return ret;
+}
+
+/*
+ * zswap_load - expand a pool entry into a page, the entry stays
+ * @idx : pool entry
+ * @page: PAGING_PAGESZ bytes
+ */
+int zswap_load(int idx, BYTE *page)
+{
+	struct zswap_entry *ent;
+	int ret;
+
+	pthread_mutex_lock(&zswap_lock);
+	if (idx < 0 || idx >= zswap_nent || zswap_ent[idx].data == NULL)
+	{
+		pthread_mutex_unlock(&zswap_lock);
+		return -1;
+	}
+	ent = &zswap_ent[idx];
+	ret = lz_decompress(ent->data, ent->len, (unsigned char *)page, PAGING_PAGESZ);
+	pthread_mutex_unlock(&zswap_lock);
+
+	pg_stat_inc(PG_STAT_ZLOAD);
+	return ret;
+}
+
+/*
+ * zswap_free - drop a pool entry
+ * @idx: pool entry
+ */
+int zswap_free(int idx)
+{
+	unsigned char *data;
+
+	pthread_mutex_lock(&zswap_lock);
+	if (idx < 0 || idx >= zswap_nent || zswap_ent[idx].data == NULL)
+	{
+		pthread_mutex_unlock(&zswap_lock);
+		return -1;
+	}
+	data = zswap_ent[idx].data;
+	zswap_used -= zswap_ent[idx].len;
+	zswap_ent[idx].data = NULL;
+	zswap_ent[idx].next_free = zswap_free_head;
+	zswap_free_head = idx;
+	pthread_mutex_unlock(&zswap_lock);
+
+	free(data);
+	return 0;
+}
+
+/*
+ * zswap_report - print the compression ratio of the pool
+ */
+void zswap_report(void)
+{
+	printf("Zswap: %lu bytes stored as %lu (ratio %.2f), %ld bytes in use\n",
+		   zswap_in_bytes, zswap_out_bytes,
+		   zswap_out_bytes ? (double)zswap_in_bytes / zswap_out_bytes : 0.0,
+		   zswap_used);
+}
+
+// #endif
@@ -8,6 +8,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <string.h>
 
 /*
  * init_pte - Initialize PTE entry
@@ -74,6 +75,10 @@ int pte_set_fpn(uint32_t *pte, int fpn)
 {
 	SETBIT(*pte, PAGING_PTE_PRESENT_MASK);
 	CLRBIT(*pte, PAGING_PTE_SWAPPED_MASK);
+	CLRBIT(*pte, PAGING_PTE_ACCESSED_MASK);
+	CLRBIT(*pte, PAGING_PTE_DIRTY_MASK);
+	CLRBIT(*pte, PAGING_PTE_READAHEAD_MASK);
+	CLRBIT(*pte, PAGING_PTE_COW_MASK);
 
 	SETVAL(*pte, fpn, PAGING_PTE_FPN_MASK, PAGING_PTE_FPN_LOBIT);
 
@@ -89,49 +94,68 @@ int vmap_page_range(struct pcb_t *caller,			// process call
 					struct framephy_struct *frames, // list of the mapped frames
 					struct vm_rg_struct *ret_rg)	// return mapped region, the real mapped fp
 {													// no guarantee all given pages are mapped
-	// uint32_t * pte = malloc(sizeof(uint32_t));
-	struct framephy_struct *fpit = malloc(sizeof(struct framephy_struct));
-	struct framephy_struct *clrit = fpit;
-	// int  fpn;
+	struct framephy_struct *fpit = frames;
 	int pgit = 0;
 	int pgn = PAGING_PGN(addr);
 
 	ret_rg->rg_end = ret_rg->rg_start = addr; // at least the very first space is usable
 
-	fpit->fp_next = frames;
-
-	// struct framephy_struct *fpit=frames;
 	/* TODO map range of frame to address space
 	 *      [addr to addr + pgnum*PAGING_PAGESZ
-	 *      in page table caller->mm->pgd[]
+	 *      in page table caller->mm->pgd
 	 */
-	while (pgit < pgnum && fpit != NULL)
+	for (; pgit < pgnum && fpit != NULL; fpit = fpit->fp_next)
 	{
-		fpit = fpit->fp_next;
 		int pgd_index = PAGING_PGN(addr);
 
-		// Assuming that the pgd entry is already allocated in init_mm
+		// The table holding the entry is allocated on the way if needed
 		// Initialize the PTE with the frame page number and mark it as present
-		pte_set_fpn(&caller->mm->pgd[pgd_index], fpit->fpn);
+		pte_set_fpn(pte_ptr(caller->mm, pgd_index), fpit->fpn);
+		MEMPHY_set_owner(caller->mram, fpit->fpn, caller->mm, pgd_index);
 		/* Tracking for later page replacement activities (if needed)
 		 * Enqueue new usage page */
-		enlist_pgn_node(&caller->mm->fifo_pgn, pgn + pgit);
+		enlist_pgn_node(caller->mm, pgn + pgit);
 		ret_rg->rg_end = addr + PAGING_PAGESZ;
 		addr += PAGING_PAGESZ;
 
 		pgit++;
 	}
-	free(clrit);
 	return 0;
 }
 
+#ifdef MM_HUGEPAGE
+/*
+ * vmap_huge_page - map a huge page to a run of contiguous frames
+ * @caller: process call
+ * @pgn   : first page, aligned on PAGING_HPAGE_NR
+ * @fpn   : first frame of the run
+ */
+static void vmap_huge_page(struct pcb_t *caller, int pgn, int fpn)
+{
+	uint32_t *pte;
+	int pgit;
+
+	for (pgit = 0; pgit < PAGING_HPAGE_NR; pgit++)
+	{
+		pte = pte_ptr(caller->mm, pgn + pgit);
+		pte_set_fpn(pte, fpn + pgit);
+		SETBIT(*pte, PAGING_PTE_HUGE_MASK);
+		MEMPHY_set_owner(caller->mram, fpn + pgit, caller->mm, pgn + pgit);
+	}
+
+	/* One unit for the replacement policy */
+	enlist_pgn_node(caller->mm, pgn);
+	pg_stat_inc(PG_STAT_HUGEMAP);
+}
+#endif
+
 /*
  * alloc_pages_range - allocate req_pgnum of frame in ram
  * @caller    : caller
  * @req_pgnum : request page num
  * @frm_lst   : frame list
  */
-void free_frame_list(struct framephy_struct *head, struct memphy_struct *caller)
+void free_frame_list(struct pcb_t *caller, struct framephy_struct *head, int putback)
 {
 	struct framephy_struct *temp;
 
@@ -139,106 +163,66 @@ void free_frame_list(struct framephy_struct *head, struct memphy_struct *caller)
 	{
 		temp = head;
 		head = head->fp_next;
-		MEMPHY_put_freefp(caller, temp->fpn);
-		free(temp);
+		if (putback)
+			MEMPHY_put_freefp(caller->mram, temp->fpn);
+		mm_node_free(caller->mm, MM_NODE_FP, temp);
 	}
 }
 int alloc_pages_range(struct pcb_t *caller, int req_pgnum, struct framephy_struct **frm_lst)
 {
-	int pgit, fpn;
-	// struct framephy_struct *newfp_str;
-	int flm_allocated = 0;
-	int allocated_frames = 0;
-
-	struct framephy_struct *new_frame = NULL;
-	struct framephy_struct *curr = NULL;
+	int pgit, fpn, run, iter;
+	struct framephy_struct *newfp_str;
+	struct framephy_struct *tail = NULL;
 
-	for (pgit = 0; pgit < req_pgnum; pgit++)
+	*frm_lst = NULL;
+	for (pgit = 0; pgit < req_pgnum; pgit += run)
 	{
-		if (MEMPHY_get_freefp(caller->mram, &fpn) == 0)
+		/* With the buddy allocator, take the largest power of two run
+		 * of contiguous frames MEMRAM still has, down to single frames,
+		 * and never more than the resident limit leaves room for */
+		run = 1;
+		if (caller->mram->buddy)
 		{
-			// Successfully obtained a free frame
-			new_frame = malloc(sizeof(struct framephy_struct));
-			if (!new_frame)
+			run = 1 << MEMPHY_BUDDY_MAX_ORDER;
+			while (run > 1 && (run > req_pgnum - pgit || !mm_rss_room(caller->mm, run)))
+				run >>= 1;
+			while (run > 1 && MEMPHY_get_freerun(caller->mram, run, &fpn) < 0)
+				run >>= 1;
+		}
+		if (run > 1)
+		{
+			pg_stat_inc(PG_STAT_RUN);
+			pg_stat_add(PG_STAT_RUNPG, run);
+		}
+		else if (pg_get_frame(caller, caller->mm, &fpn) < 0)
+		{ /* ERROR CODE of obtaining somes but not enough frames */
+			free_frame_list(caller, *frm_lst, 1);
+			*frm_lst = NULL;
+			return -3000;
+		}
+
+		for (iter = 0; iter < run; iter++)
+		{
+			newfp_str = mm_node_alloc(caller->mm, MM_NODE_FP);
+			if (!newfp_str)
 			{
 				// Memory allocation failed, clean up and return error
-				free_frame_list(*frm_lst, caller->mram);
+				for (; iter < run; iter++)
+					MEMPHY_put_freefp(caller->mram, fpn + iter);
+				free_frame_list(caller, *frm_lst, 1);
+				*frm_lst = NULL;
 				return -ENOMEM;
 			}
 
-			new_frame->fpn = fpn;
-			// new_frame->owner = caller->mram;
-			new_frame->owner = caller->mm;
-			new_frame->fp_next = NULL;
-
-			if (flm_allocated == 1)
-			{
-				curr->fp_next = new_frame;
-			}
-			else
-			{
-				*frm_lst = new_frame;
-				flm_allocated = 1;
-			}
-			curr = new_frame;
-			allocated_frames++;
-		}
-		else
-		{ // ERROR CODE of obtaining somes but not enough frames
-			/*free_frame_list(caller->mram, *frm_lst);
-			return -3000;*/
-			// fail
-			int victim_fpn, victim_pgn, victim_pte;
-			int swpfpn = -1;
-			if (find_victim_page(caller->mm, &victim_pgn) < 0)
-				return -1;
-
-			victim_pte = caller->mm->pgd[victim_pgn];
-			victim_fpn = PAGING_FPN(victim_pte);
-
-			curr = (struct framephy_struct *)malloc(sizeof(struct framephy_struct));
-			curr->fpn = victim_fpn;
-
-			new_frame->owner = caller->mm;
-			if (flm_allocated == 1)
-			{
-				curr->fp_next = new_frame;
-			}
-			else
-			{
-				*frm_lst = new_frame;
-				flm_allocated = 1;
-			}
-			curr = new_frame;
-			allocated_frames++;
+			newfp_str->fpn = fpn + iter;
+			newfp_str->owner = caller->mm;
+			newfp_str->fp_next = NULL;
 
-			int i = 0;
-			if (MEMPHY_get_freefp(caller->active_mswp, &swpfpn) == 0)
-			{
-				__swap_cp_page(caller->mram, victim_fpn, caller->active_mswp, swpfpn);
-				while (caller->mswp[i] != caller->active_mswp && caller->mswp[i] != NULL)
-					i++;
-			}
+			if (tail == NULL)
+				*frm_lst = newfp_str;
 			else
-			{
-				swpfpn = -1;
-				while (caller->mswp[i] != NULL)
-				{
-					if (MEMPHY_get_freefp(caller->mswp[i], &swpfpn) == 0)
-					{
-						__swap_cp_page(caller->mram, victim_fpn, caller->mswp[i], swpfpn);
-						break;
-					}
-					i++;
-				}
-			}
-			if (swpfpn == -1)
-			{
-				free_frame_list(*frm_lst, caller->mram);
-				return -3000;
-			}
-
-			pte_set_swap(&caller->mm->pgd[victim_pgn], i, swpfpn);
+				tail->fp_next = newfp_str;
+			tail = newfp_str;
 		}
 	}
 
@@ -257,7 +241,31 @@ int alloc_pages_range(struct pcb_t *caller, int req_pgnum, struct framephy_struc
 int vm_map_ram(struct pcb_t *caller, int astart, int aend, int mapstart, int incpgnum, struct vm_rg_struct *ret_rg)
 {
 	struct framephy_struct *frm_lst = NULL;
-	int ret_alloc;
+	struct vm_rg_struct rg;
+	int ret_alloc, pgit, pgn, endpgn, npg;
+#ifdef MM_HUGEPAGE
+	int fpn;
+#endif
+
+	if (pg_demand)
+	{ /* Only reserved, pg_getpage maps each page when first touched */
+		ret_rg->rg_start = mapstart;
+		ret_rg->rg_end = mapstart + incpgnum * PAGING_PAGESZ;
+		return 0;
+	}
+
+	/* The PTEs set below then always find their table */
+	if (pgtbl_populate(caller->mm, PAGING_PGN(mapstart), PAGING_PGN(mapstart) + incpgnum) < 0)
+		return -1;
+
+	if (ksm_enabled)
+	{ /* Nothing is written there yet, every page maps the zero frame */
+		for (pgit = 0; pgit < incpgnum; pgit++)
+			ksm_map_zero(caller->mm, PAGING_PGN(mapstart) + pgit);
+		ret_rg->rg_start = mapstart;
+		ret_rg->rg_end = mapstart + incpgnum * PAGING_PAGESZ;
+		return 0;
+	}
 
 	/*@bksysnet: author provides a feasible solution of getting frames
 	 *FATAL logic in here, wrong behaviour if we have not enough page
@@ -266,23 +274,54 @@ int vm_map_ram(struct pcb_t *caller, int astart, int aend, int mapstart, int inc
 	 *in endless procedure of swap-off to get frame and we have not provide
 	 *duplicate control mechanism, keep it simple
 	 */
-	ret_alloc = alloc_pages_range(caller, incpgnum, &frm_lst);
-
-	if (ret_alloc < 0 && ret_alloc != -3000)
-		return -1;
-
-	/* Out of memory */
-	if (ret_alloc == -3000)
+	pgn = PAGING_PGN(mapstart);
+	endpgn = pgn + incpgnum;
+	ret_rg->rg_start = ret_rg->rg_end = mapstart;
+	while (pgn < endpgn)
 	{
+#ifdef MM_HUGEPAGE
+		/* An aligned huge page fits in the rest of the range */
+		if (PAGING_HPAGE_HEAD(pgn) == pgn && pgn + PAGING_HPAGE_NR <= endpgn &&
+			mm_rss_room(caller->mm, PAGING_HPAGE_NR) &&
+			MEMPHY_get_freerun(caller->mram, PAGING_HPAGE_NR, &fpn) == 0)
+		{
+			vmap_huge_page(caller, pgn, fpn);
+			pgn += PAGING_HPAGE_NR;
+			continue;
+		}
+
+		/* Base pages up to the next huge page boundary */
+		npg = PAGING_HPAGE_HEAD(pgn) + PAGING_HPAGE_NR - pgn;
+		if (npg > endpgn - pgn)
+			npg = endpgn - pgn;
+#else
+		npg = endpgn - pgn;
+#endif
+		/* Frames are only charged once mapped, under a resident limit
+		 * they are taken one by one so that the next one sees it */
+		if (caller->mm->rss_limit > 0)
+			npg = 1;
+		ret_alloc = alloc_pages_range(caller, npg, &frm_lst);
+		if (ret_alloc < 0)
+		{ /* What was mapped so far goes back */
+			free_pte_range(caller, PAGING_PGN(mapstart), pgn);
 #ifdef MMDBG
-		printf("OOM: vm_map_ram out of memory \n");
+			/* Out of memory */
+			if (ret_alloc == -3000)
+				printf("OOM: vm_map_ram out of memory \n");
 #endif
-		return -1;
-	}
+			return -1;
+		}
 
-	/* it leaves the case of memory is enough but half in ram, half in swap
-	 * do the swaping all to swapper to get the all in ram */
-	vmap_page_range(caller, mapstart, incpgnum, frm_lst, ret_rg);
+		/* it leaves the case of memory is enough but half in ram, half in swap
+		 * do the swaping all to swapper to get the all in ram */
+		vmap_page_range(caller, pgn * PAGING_PAGESZ, npg, frm_lst, &rg);
+
+		/* The frames are owned through the page table now, drop the list */
+		free_frame_list(caller, frm_lst, 0);
+		pgn += npg;
+	}
+	ret_rg->rg_end = endpgn * PAGING_PAGESZ;
 
 	return 0;
 }
@@ -296,51 +335,117 @@ int vm_map_ram(struct pcb_t *caller, int astart, int aend, int mapstart, int inc
 int __swap_cp_page(struct memphy_struct *mpsrc, int srcfpn,
 				   struct memphy_struct *mpdst, int dstfpn)
 {
-	int cellidx;
-	int addrsrc, addrdst;
-	for (cellidx = 0; cellidx < PAGING_PAGESZ; cellidx++)
-	{
-		addrsrc = srcfpn * PAGING_PAGESZ + cellidx;
-		addrdst = dstfpn * PAGING_PAGESZ + cellidx;
+	BYTE buf[PAGING_PAGESZ];
 
-		BYTE data;
-		MEMPHY_read(mpsrc, addrsrc, &data);
-		MEMPHY_write(mpdst, addrdst, data);
-	}
+	if (mpdst == NULL || (dstfpn + 1) * PAGING_PAGESZ > mpdst->maxsz)
+		return -1;
 
-	return 0;
+	/* Straight into a random access destination, no bounce buffer */
+	if (mpdst->rdmflg && mpdst->storage != NULL)
+		return MEMPHY_read_page(mpsrc, srcfpn, &mpdst->storage[dstfpn * PAGING_PAGESZ]);
+
+	if (MEMPHY_read_page(mpsrc, srcfpn, buf) < 0)
+		return -1;
+	return MEMPHY_write_page(mpdst, dstfpn, buf);
 }
 
 /*
  *Initialize a empty Memory Management instance
  * @mm:     self mm
  * @caller: mm owner
+ *
+ * Return -1 if the heap and stack cannot be set up, free_mm() then
+ * releases what was
  */
 int init_mm(struct mm_struct *mm, struct pcb_t *caller)
 {
-	struct vm_area_struct *vma = malloc(sizeof(struct vm_area_struct));
+	int ret;
+
+	mm_arena_init(&mm->arena);
+	pthread_mutex_init(&mm->lock, NULL);
+
+	mm->pid = caller->pid;
+	ret = pgtbl_init(mm);
+	memset(&mm->fifo_pgn, 0, sizeof(mm->fifo_pgn));
+	memset(&mm->hot_pgn, 0, sizeof(mm->hot_pgn));
+	memset(&mm->ghost_pgn, 0, sizeof(mm->ghost_pgn));
+	memset(mm->symrgtbl, 0, sizeof(mm->symrgtbl));
+	mm->rss_limit = mm->swap_limit = 0;
+	mm->rss = mm->swap_pages = 0;
+	mm->oom_state = mm->oom_listed = 0;
+	mm->oom_next = mm->oom_prev = NULL;
+
+	/* By default the owner comes with an empty heap and stack */
+	mm->map_count = 0;
+	mm->vm_next_id = VMA_STACK + 1;
+	if (ret < 0 || init_vma(mm, VMA_HEAP, 0, 0) == NULL ||
+		init_vma(mm, VMA_STACK, PAGING_STACK_TOP, VM_GROWSDOWN) == NULL)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * init_vma - add an empty VMA to a Memory Management instance
+ * @mm   : owner
+ * @id   : vm_id of the new VMA
+ * @start: where it begins and, for now, ends
+ * @flags: vm_flags
+ *
+ * Return NULL if @mm has VM_MAX_AREAS already or no node is left
+ */
+struct vm_area_struct *init_vma(struct mm_struct *mm, unsigned long id,
+								unsigned long start, unsigned int flags)
+{
+	struct vm_area_struct *vma = mm_node_alloc(mm, MM_NODE_VMA);
 
-	mm->pgd = malloc(PAGING_MAX_PGN * sizeof(uint32_t));
+	if (vma == NULL)
+		return NULL;
 
-	/* By default the owner comes with at least one vma */
-	vma->vm_id = 1;
-	vma->vm_start = 0;
+	vma->vm_id = id;
+	vma->vm_start = start;
 	vma->vm_end = vma->vm_start;
 	vma->sbrk = vma->vm_start;
-	struct vm_rg_struct *first_rg = init_vm_rg(vma->vm_start, vma->vm_end);
-	enlist_vm_rg_node(&vma->vm_freerg_list, first_rg);
-
-	vma->vm_next = NULL;
+	vma->vm_flags = flags;
+	init_vm_freerg(vma);
+	vma->ra_next = -1;
+	vma->ra_win = vma->ra_issued = vma->ra_hits = 0;
 	vma->vm_mm = mm; /*point back to vma owner */
 
-	mm->mmap = vma;
+	if (vma_insert(mm, vma) < 0)
+	{
+		mm_node_free(mm, MM_NODE_VMA, vma);
+		return NULL;
+	}
+
+	return vma;
+}
+
+/*
+ * free_mm - release the bookkeeping of a Memory Management instance
+ * @mm: self mm, its frames must have been given back already
+ */
+int free_mm(struct mm_struct *mm)
+{
+	oom_unregister(mm);
+
+	/* VMAs, regions and page nodes all live in the arena */
+	mm_arena_release(&mm->arena);
+	mm->map_count = 0;
+
+	pgtbl_free(mm);
+	pthread_mutex_destroy(&mm->lock);
+	free(mm);
 
 	return 0;
 }
 
-struct vm_rg_struct *init_vm_rg(int rg_start, int rg_end)
+struct vm_rg_struct *init_vm_rg(struct mm_struct *mm, int rg_start, int rg_end)
 {
-	struct vm_rg_struct *rgnode = malloc(sizeof(struct vm_rg_struct));
+	struct vm_rg_struct *rgnode = mm_node_alloc(mm, MM_NODE_RG);
+
+	if (rgnode == NULL)
+		return NULL;
 
 	rgnode->rg_start = rg_start;
 	rgnode->rg_end = rg_end;
@@ -349,6 +454,16 @@ struct vm_rg_struct *init_vm_rg(int rg_start, int rg_end)
 	return rgnode;
 }
 
+/* No free region yet */
+void init_vm_freerg(struct vm_area_struct *vma)
+{
+	memset(vma->vm_freerg_list, 0, sizeof(vma->vm_freerg_list));
+	memset(vma->vm_freerg_start, 0, sizeof(vma->vm_freerg_start));
+	memset(vma->vm_freerg_end, 0, sizeof(vma->vm_freerg_end));
+	vma->vm_freerg_map = 0;
+	vma->vm_freerg_bytes = 0;
+}
+
 int enlist_vm_rg_node(struct vm_rg_struct **rglist, struct vm_rg_struct *rgnode)
 {
 	rgnode->rg_next = *rglist;
@@ -357,15 +472,16 @@ int enlist_vm_rg_node(struct vm_rg_struct **rglist, struct vm_rg_struct *rgnode)
 	return 0;
 }
 
-int enlist_pgn_node(struct pgn_t **plist, int pgn)
+/* A page came online, let the replacement policy track it. Return -1 if
+ * the policy has no node left for it, the page then stays online until
+ * it is freed */
+int enlist_pgn_node(struct mm_struct *mm, int pgn)
 {
-	struct pgn_t *pnode = malloc(sizeof(struct pgn_t));
+	/* Global replacement scans the frames, not the pages */
+	if (pg_global)
+		return 0;
 
-	pnode->pgn = pgn;
-	pnode->pg_next = *plist;
-	*plist = pnode;
-
-	return 0;
+	return pg_policy->admit(mm, pgn);
 }
 
 int print_list_fp(struct framephy_struct *ifp)
@@ -408,28 +524,27 @@ int print_list_rg(struct vm_rg_struct *irg)
 	return 0;
 }
 
-int print_list_vma(struct vm_area_struct *ivma)
+int print_list_vma(struct mm_struct *mm)
 {
-	struct vm_area_struct *vma = ivma;
+	int i;
 
 	printf("print_list_vma: ");
-	if (vma == NULL)
+	if (mm->map_count == 0)
 	{
 		printf("NULL list\n");
 		return -1;
 	}
 	printf("\n");
-	while (vma != NULL)
-	{
-		printf("va[%ld->%ld]\n", vma->vm_start, vma->vm_end);
-		vma = vma->vm_next;
-	}
+	for (i = 0; i < mm->map_count; i++)
+		printf("va[%ld->%ld]\n", mm->mmap[i]->vm_start, mm->mmap[i]->vm_end);
 	printf("\n");
 	return 0;
 }
 
-int print_list_pgn(struct pgn_t *ip)
+int print_list_pgn(struct pgn_queue *q)
 {
+	struct pgn_t *ip = q->head;
+
 	printf("print_list_pgn: ");
 	if (ip == NULL)
 	{
@@ -446,31 +561,39 @@ int print_list_pgn(struct pgn_t *ip)
 	return 0;
 }
 
+/* Dump the PTEs in [start, end), end -1 for the heap. A page without a
+ * table shows as empty, the status bits of replacement, copy-on-write
+ * and huge pages are left out so that the trace stays a plain one */
 int print_pgtbl(struct pcb_t *caller, uint32_t start, uint32_t end)
 {
 	int pgn_start, pgn_end;
 	int pgit;
+	uint32_t pte;
+
+	if (caller == NULL)
+	{
+		printf("print_pgtbl: NULL caller\n");
+		return -1;
+	}
 
 	if (end == -1)
 	{
-		pgn_start = 0;
 		struct vm_area_struct *cur_vma = get_vma_by_num(caller->mm, 0);
 		end = cur_vma->vm_end;
 	}
 	pgn_start = PAGING_PGN(start);
 	pgn_end = PAGING_PGN(end);
 
-	printf("print_pgtbl: %d - %d", start, end);
-	if (caller == NULL)
-	{
-		printf("NULL caller\n");
-		return -1;
-	}
-	printf("\n");
+	printf("print_pgtbl: %d - %d\n", start, end);
 
 	for (pgit = pgn_start; pgit < pgn_end; pgit++)
 	{
-		printf("%08ld: %08x\n", pgit * sizeof(uint32_t), caller->mm->pgd[pgit]);
+		pte = pte_get(caller->mm, pgit);
+		if (!(pte & PAGING_PTE_SHM_MASK))
+			pte &= ~(PAGING_PTE_DIRTY_MASK | PAGING_PTE_COW_MASK | PAGING_PTE_HUGE_MASK);
+		if (PAGING_PAGE_ONLINE(pte))
+			pte &= ~(PAGING_PTE_ACCESSED_MASK | PAGING_PTE_READAHEAD_MASK);
+		printf("%08ld: %08x\n", pgit * sizeof(uint32_t), pte);
 	}
 
 	return 0;
@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 int time_slot;
 int *cur_prio;
@@ -18,7 +19,8 @@ static int done = 0;
 
 #ifdef MM_PAGING
 static int memramsz;
-static int memswpsz[PAGING_MAX_MMSWP];
+static long memswpsz[PAGING_MAX_MMSWP];
+static enum memphy_kind memswpkind[PAGING_MAX_MMSWP];
 
 struct mmpaging_ld_args
 {
@@ -37,6 +39,11 @@ static struct ld_args
 #ifdef MLQ_SCHED
 	unsigned long *prio;
 #endif
+#ifdef MM_PAGING
+	/* Resident and swap limits in bytes, 0 for none */
+	unsigned long *rss_limit;
+	unsigned long *swap_limit;
+#endif
 } ld_processes;
 int num_processes;
 
@@ -50,6 +57,9 @@ static void *cpu_routine(void *args)
 {
 	struct timer_id_t *timer_id = ((struct cpu_args *)args)->timer_id;
 	int id = ((struct cpu_args *)args)->id;
+#ifdef MM_TLB
+	tlb_bind_cpu(id);
+#endif
 	/* Check for new process in ready queue */
 	int time_left = 0;
 	struct pcb_t *proc = NULL;
@@ -72,10 +82,25 @@ static void *cpu_routine(void *args)
 			/* The porcess has finish it job */
 			printf("\tCPU %d: Processed %2d has finished\n",
 				   id, proc->pid);
-			free(proc);
+#ifdef MM_PAGING
+			free_pcb_mm(proc);
+#endif
+			unload(proc);
+			proc = get_proc(id);
+			time_left = 0;
+		}
+#ifdef MM_PAGING
+		else if (oom_killed(proc->mm))
+		{
+			/* The OOM killer picked it, its memory is gone */
+			printf("\tCPU %d: Process %2d killed, out of memory\n",
+				   id, proc->pid);
+			free_pcb_mm(proc);
+			unload(proc);
 			proc = get_proc(id);
 			time_left = 0;
 		}
+#endif
 		else if (time_left == 0)
 		{
 			/* The process has done its job in current time slot */
@@ -139,10 +164,17 @@ static void *ld_routine(void *args)
 		}
 #ifdef MM_PAGING
 		proc->mm = malloc(sizeof(struct mm_struct));
-		init_mm(proc->mm, proc);
+		if (proc->mm == NULL || init_mm(proc->mm, proc) < 0)
+		{
+			printf("Cannot set up the address space of %s\n", ld_processes.path[i]);
+			exit(1);
+		}
 		proc->mram = mram;
 		proc->mswp = mswp;
 		proc->active_mswp = active_mswp;
+		proc->mm->rss_limit = DIV_ROUND_UP(ld_processes.rss_limit[i], PAGING_PAGESZ);
+		proc->mm->swap_limit = DIV_ROUND_UP(ld_processes.swap_limit[i], PAGING_PAGESZ);
+		oom_register(proc->mm);
 #endif
 		printf("\tLoaded a process at %s, PID: %d PRIO: %ld\n",
 			   ld_processes.path[i], proc->pid, ld_processes.prio[i]);
@@ -153,6 +185,10 @@ static void *ld_routine(void *args)
 	}
 	free(ld_processes.path);
 	free(ld_processes.start_time);
+#ifdef MM_PAGING
+	free(ld_processes.rss_limit);
+	free(ld_processes.swap_limit);
+#endif
 	done = 1;
 	detach_event(timer_id);
 	pthread_exit(NULL);
@@ -166,6 +202,9 @@ static void read_config(const char *path)
 		printf("Cannot find configure file at %s\n", path);
 		exit(1);
 	}
+	char line[256];
+	int pending = 0; /* line holds the first process line already */
+
 	fscanf(file, "%d %d %d\n", &time_slot, &num_cpus, &num_processes);
 	ld_processes.path = (char **)malloc(sizeof(char *) * num_processes);
 	ld_processes.start_time = (unsigned long *)
@@ -186,12 +225,51 @@ static void read_config(const char *path)
 	/* Read input config of memory size: MEMRAM and upto 4 MEMSWP (mem swap)
 	 * Format: (size=0 result non-used memswap, must have RAM and at least 1 SWAP)
 	 *        MEM_RAM_SZ MEM_SWP0_SZ MEM_SWP1_SZ MEM_SWP2_SZ MEM_SWP3_SZ
+	 * A swap size may be followed by :mmap or :file to keep that swap in
+	 * a host file instead of host memory. A legacy configure file has no
+	 * such line: if the line has a path as second field it is the first
+	 * process line, and the sizes of MM_FIXED_MEMSZ are used
 	 */
-	fscanf(file, "%d\n", &memramsz);
+	char swp[PAGING_MAX_MMSWP][32] = {"", "", "", ""};
+
+	if (fgets(line, sizeof(line), file) == NULL)
+		line[0] = '\0';
+	sscanf(line, "%d %31s %31s %31s %31s", &memramsz, swp[0], swp[1], swp[2], swp[3]);
+	if (swp[0][0] < '0' || swp[0][0] > '9')
+	{
+		pending = 1;
+		memramsz = 0x100000;
+		strcpy(swp[0], "16777216");
+	}
 	for (sit = 0; sit < PAGING_MAX_MMSWP; sit++)
-		fscanf(file, "%d", &(memswpsz[sit]));
+	{
+		char kind[16] = "";
 
-	fscanf(file, "\n"); /* Final character */
+		memswpsz[sit] = 0;
+		sscanf(swp[sit], "%ld:%15s", &(memswpsz[sit]), kind);
+		if (strcmp(kind, "mmap") == 0)
+			memswpkind[sit] = MEMPHY_MMAP;
+		else if (strcmp(kind, "file") == 0)
+			memswpkind[sit] = MEMPHY_FILE;
+		else
+			memswpkind[sit] = MEMPHY_MEM;
+	}
+
+	/* A PTE holds frame numbers up to these only, bigger devices are
+	 * turned down rather than partly used */
+	if (memramsz > (long)PAGING_MAX_FPN * PAGING_PAGESZ)
+	{
+		fprintf(stderr, "Configure file %s: MEMRAM of %d bytes, at most %ld can be mapped\n",
+				path, memramsz, (long)PAGING_MAX_FPN * PAGING_PAGESZ);
+		exit(1);
+	}
+	for (sit = 0; sit < PAGING_MAX_MMSWP; sit++)
+		if (memswpsz[sit] > (long)PAGING_MAX_SWPFPN * PAGING_PAGESZ)
+		{
+			fprintf(stderr, "Configure file %s: MEMSWP %d of %ld bytes, at most %ld can be swapped to\n",
+					path, sit, memswpsz[sit], (long)PAGING_MAX_SWPFPN * PAGING_PAGESZ);
+			exit(1);
+		}
 #endif
 #endif
 
@@ -199,37 +277,117 @@ static void read_config(const char *path)
 	ld_processes.prio = (unsigned long *)
 		malloc(sizeof(unsigned long) * num_processes);
 #endif
-	int i;
+#ifdef MM_PAGING
+	/* A process line may end with the resident and swap limits of the
+	 * process in bytes:
+	 *        [start time] [path] [priority] [RSS_LIMIT] [SWAP_LIMIT]
+	 */
+	ld_processes.rss_limit = (unsigned long *)
+		calloc(num_processes, sizeof(unsigned long));
+	ld_processes.swap_limit = (unsigned long *)
+		calloc(num_processes, sizeof(unsigned long));
+#endif
+	int i, nf;
 	for (i = 0; i < num_processes; i++)
 	{
-		ld_processes.path[i] = (char *)malloc(sizeof(char) * 100);
-		ld_processes.path[i][0] = '\0';
-		strcat(ld_processes.path[i], "input/proc/");
-		char proc[100];
+		char proc[100] = "";
+		unsigned long limit[2] = {0, 0};
+
+		/* One line per process, blank and malformed lines are skipped.
+		 * Legacy lines have no priority, they get the highest one */
+		ld_processes.start_time[i] = 0;
 #ifdef MLQ_SCHED
-		fscanf(file, "%lu %s %lu\n", &ld_processes.start_time[i], proc, &ld_processes.prio[i]);
+		ld_processes.prio[i] = 0;
+		for (nf = 0; nf < 2 && (pending || fgets(line, sizeof(line), file) != NULL); pending = 0)
+			nf = sscanf(line, "%lu %99s %lu %lu %lu", &ld_processes.start_time[i], proc,
+						&ld_processes.prio[i], &limit[0], &limit[1]);
+		if (nf < 2)
 #else
-		fscanf(file, "%lu %s\n", &ld_processes.start_time[i], proc);
+		for (nf = 0; nf < 2 && (pending || fgets(line, sizeof(line), file) != NULL); pending = 0)
+			nf = sscanf(line, "%lu %99s %lu %lu", &ld_processes.start_time[i], proc,
+						&limit[0], &limit[1]);
+		if (nf < 2)
+#endif
+		{
+			fprintf(stderr, "Configure file %s lists %d of its %d processes\n",
+					path, i, num_processes);
+			if (i == 0)
+				exit(1);
+			num_processes = i;
+			break;
+		}
+#ifdef MM_PAGING
+		ld_processes.rss_limit[i] = limit[0];
+		ld_processes.swap_limit[i] = limit[1];
 #endif
+		ld_processes.path[i] = (char *)malloc(sizeof(char) * 100);
+		ld_processes.path[i][0] = '\0';
+		strcat(ld_processes.path[i], "input/proc/");
 		strcat(ld_processes.path[i], proc);
 	}
+	fclose(file);
 }
 
 int main(int argc, char *argv[])
 {
-	cur_prio = calloc(num_cpus, sizeof(int));
+	int opt;
+#ifdef MM_PAGING
+	const char *policy = PG_POLICY_DEFAULT;
+	int kswapd = 0;
+	int ksm = 0;
+	int buddy = 0;
+#endif
 
-	/* Read config */
-	if (argc != 2)
+	/* Read options and config */
+	while ((opt = getopt(argc, argv, "r:gkzmbd")) != -1)
+	{
+		switch (opt)
+		{
+#ifdef MM_PAGING
+		case 'r': /* page replacement policy */
+			policy = optarg;
+			break;
+		case 'g': /* replace pages of any process, -r is not used */
+			pg_global = 1;
+			break;
+		case 'k': /* background reclaim, needs global replacement */
+			kswapd = pg_global = 1;
+			break;
+		case 'z': /* compressed swap cache */
+			zswap_init(ZSWAP_POOL_SZ);
+			break;
+		case 'm': /* zero frame and same-page merging */
+			ksm = 1;
+			break;
+		case 'b': /* buddy allocator of MEMRAM frames */
+			buddy = 1;
+			break;
+		case 'd': /* demand paging, frames are given on first touch */
+			pg_demand = 1;
+			break;
+#endif
+		default:
+			optind = argc;
+		}
+	}
+	if (optind != argc - 1)
+	{
+		printf("Usage: os [-r fifo|clock|2q] [-g] [-k] [-z] [-m] [-b] [-d] [path to configure file]\n");
+		return 1;
+	}
+#ifdef MM_PAGING
+	if (pg_policy_select(policy) < 0)
 	{
-		printf("Usage: os [path to configure file]\n");
+		printf("Unknown page replacement policy %s\n", policy);
 		return 1;
 	}
+#endif
 	char path[100];
 	path[0] = '\0';
 	strcat(path, "input/");
-	strcat(path, argv[1]);
+	strcat(path, argv[optind]);
 	read_config(path);
+	cur_prio = calloc(num_cpus, sizeof(int));
 
 	pthread_t *cpu = (pthread_t *)malloc(num_cpus * sizeof(pthread_t));
 	struct cpu_args *args =
@@ -252,26 +410,55 @@ int main(int argc, char *argv[])
 
 	struct memphy_struct mram;
 	struct memphy_struct mswp[PAGING_MAX_MMSWP];
+	struct memphy_struct *mswp_tbl[PAGING_MAX_MMSWP];
 
 	/* Create MEM RAM */
 	init_memphy(&mram, memramsz, rdmflag);
+	MEMPHY_rmap_init(&mram);
+	if (buddy)
+		MEMPHY_buddy_init(&mram);
 
 	/* Create all MEM SWAP */
 	int sit;
 	for (sit = 0; sit < PAGING_MAX_MMSWP; sit++)
-		init_memphy(&mswp[sit], memswpsz[sit], rdmflag);
+	{
+		if (memswpkind[sit] == MEMPHY_MEM || memswpsz[sit] <= 0)
+			init_memphy(&mswp[sit], memswpsz[sit], rdmflag);
+		else if (init_memphy_file(&mswp[sit], memswpsz[sit], memswpkind[sit]) < 0)
+		{
+			printf("Cannot create the file of MEMSWP %d in %s\n", sit, MEMPHY_FILE_DIR);
+			return 1;
+		}
+		mswp_tbl[sit] = &mswp[sit];
+	}
 
 	/* In Paging mode, it needs passing the system mem to each PCB through loader*/
 	struct mmpaging_ld_args *mm_ld_args = malloc(sizeof(struct mmpaging_ld_args));
 
 	mm_ld_args->timer_id = ld_event;
 	mm_ld_args->mram = (struct memphy_struct *)&mram;
-	mm_ld_args->mswp = (struct memphy_struct **)&mswp;
+	mm_ld_args->mswp = mswp_tbl;
 	mm_ld_args->active_mswp = (struct memphy_struct *)&mswp[0];
+
+	if (kswapd)
+		kswapd_start(&mram, mswp_tbl, &mswp[0]);
+#endif
+
+#ifdef MM_TLB
+	tlb_init(num_cpus);
+#endif
+#ifdef MM_PAGING
+	/* Before any process maps a page to the zero frame */
+	ksm_init(&mram, mswp_tbl, &mswp[0]);
+	if (ksm)
+		ksm_start();
 #endif
 
 	/* Init scheduler */
 	init_scheduler();
+#ifdef MM_PAGING
+	psi_init(num_cpus);
+#endif
 
 	/* Run CPU and loader */
 #ifdef MM_PAGING
@@ -291,9 +478,20 @@ int main(int argc, char *argv[])
 		pthread_join(cpu[i], NULL);
 	}
 	pthread_join(ld, NULL);
+#ifdef MM_PAGING
+	kswapd_stop();
+	ksm_stop();
+#endif
 
 	/* Stop timer */
 	stop_timer();
 
+#ifdef MM_TLB
+	tlb_report();
+#endif
+#ifdef MM_PAGING
+	pg_policy_report();
+#endif
+
 	return 0;
 }
\ No newline at end of file
@@ -12,18 +12,33 @@ int empty(struct queue_t *q)
 
 void enqueue(struct queue_t *q, struct pcb_t *proc)
 {
-    /* TODO: put a new process to queue [q] */
-
     /* Check for invalid queue or process */
     if (q == NULL || proc == NULL)
         return;
 
-    /* Check if the queue is already full */
-    if (q->size >= MAX_QUEUE_SIZE)
-        return;
+    /* Grow the ring when it is full, unrolling it from its head. A
+     * process that cannot be queued would never run again */
+    if (q->size >= q->cap)
+    {
+        int cap = (q->cap > 0) ? q->cap * 2 : MAX_QUEUE_SIZE;
+        struct pcb_t **ring = malloc(sizeof(struct pcb_t *) * cap);
+        if (ring == NULL)
+        {
+            printf("Cannot queue process %d, out of memory\n", proc->pid);
+            exit(1);
+        }
+
+        for (int idx = 0; idx < q->size; ++idx)
+            ring[idx] = q->proc[(q->head + idx) % q->cap];
+        free(q->proc);
+        q->proc = ring;
+        q->cap = cap;
+        q->head = 0;
+    }
 
     /* Add process to tail of the queue */
-    q->proc[q->size++] = proc;
+    q->proc[(q->head + q->size) % q->cap] = proc;
+    ++q->size;
 }
 
 struct pcb_t *dequeue(struct queue_t *q)
@@ -37,13 +52,10 @@ struct pcb_t *dequeue(struct queue_t *q)
         return NULL;
 
     /* Get the head process of the queue */
-    struct pcb_t *ret_proc = q->proc[0];
-    q->proc[0] = NULL;
+    struct pcb_t *ret_proc = q->proc[q->head];
+    q->proc[q->head] = NULL;
+    q->head = (q->head + 1) % q->cap;
     --q->size;
 
-    /* Shift elements towards head of the queue */
-    for (int idx = 0; idx < q->size; ++idx)
-        q->proc[idx] = q->proc[idx + 1];
-
     return ret_proc;
 }
\ No newline at end of file
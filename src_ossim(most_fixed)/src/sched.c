@@ -34,11 +34,14 @@ void init_scheduler(void)
 	for (i = 0; i < MAX_PRIO; ++i)
 	{
 		mlq_ready_queue[i].size = 0;
+		mlq_ready_queue[i].head = 0;
 		mlq_ready_queue[i].slot = 0;
 	}
 #endif
 	ready_queue.size = 0;
+	ready_queue.head = 0;
 	run_queue.size = 0;
+	run_queue.head = 0;
 	pthread_mutex_init(&queue_lock, NULL);
 }
 